@@ -0,0 +1,112 @@
+/* Microbenchmark harness
+ *
+ * Each benchmark is a function running its body n times. The harness warms it up,
+ * calibrates n so a sample takes roughly BENCH_SAMPLE_NS, then times BENCH_SAMPLES
+ * samples and prints a summary of nanoseconds per iteration, one tab separated
+ * record per benchmark:
+ *
+ *   bench <file> <name> <iterations> <min> <median> <mean> <max> <stddev>
+ *
+ * rirc writes its terminal output to stdout, so results are written to a
+ * duplicate of the original stdout, and stdout itself is redirected to /dev/null */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_WARMUP_NS  (50 * 1000 * 1000ULL)
+#define BENCH_SAMPLE_NS  (10 * 1000 * 1000ULL)
+#define BENCH_SAMPLES    15
+
+#define BENCH(N, F) bench_run(__FILE__, (N), (F))
+
+/* Written by benchmarks so results can't be optimized away */
+static volatile unsigned long bench_sink;
+
+static FILE *bench_out;
+
+static unsigned long long
+bench_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench_init(void)
+{
+	/* Keep the original stdout for results, discard everything else */
+
+	int fd;
+
+	if ((fd = dup(STDOUT_FILENO)) < 0 || (bench_out = fdopen(fd, "w")) == NULL) {
+		perror("bench_init");
+		exit(EXIT_FAILURE);
+	}
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("bench_init");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+bench_run(const char *file, const char *name, void (*f)(size_t))
+{
+	double samples[BENCH_SAMPLES], mean = 0, var = 0;
+	unsigned long long start, t;
+	size_t i, n = 1;
+
+	/* Warm up, doubling n until a single run is long enough to time accurately */
+	for (start = bench_ns(); bench_ns() - start < BENCH_WARMUP_NS;) {
+
+		t = bench_ns();
+		f(n);
+		t = bench_ns() - t;
+
+		if (t < BENCH_SAMPLE_NS)
+			n *= 2;
+	}
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+
+		t = bench_ns();
+		f(n);
+		t = bench_ns() - t;
+
+		samples[i] = (double) t / n;
+		mean += samples[i];
+	}
+
+	mean /= BENCH_SAMPLES;
+
+	for (i = 0; i < BENCH_SAMPLES; i++)
+		var += (samples[i] - mean) * (samples[i] - mean);
+
+	qsort(samples, BENCH_SAMPLES, sizeof(double), bench_cmp);
+
+	fprintf(bench_out, "bench\t%s\t%s\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+		file, name, n,
+		samples[0],
+		samples[BENCH_SAMPLES / 2],
+		mean,
+		samples[BENCH_SAMPLES - 1],
+		sqrt(var / BENCH_SAMPLES));
+
+	fflush(bench_out);
+}
@@ -0,0 +1,134 @@
+/* For clock_gettime, dup, fdopen */
+#define _POSIX_C_SOURCE 200112L
+
+#include "../src/draw.c"
+
+#include "bench.h"
+
+static char text[] =
+	"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+	"tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, "
+	"quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo "
+	"consequat. Duis aute irure dolor in reprehenderit in voluptate velit esse "
+	"cillum dolore eu fugiat nulla pariatur. Excepteur sint occaecat cupidatat non "
+	"proident, sunt in culpa qui officia deserunt mollit anim id est laborum.";
+
+static channel *chan;
+
+static void
+bench_word_wrap(size_t n)
+{
+	char *ptr1, *ptr2 = text + sizeof(text) - 1;
+
+	while (n--) {
+
+		ptr1 = text;
+
+		while (*ptr1)
+			bench_sink += (unsigned long) word_wrap(80, &ptr1, ptr2);
+	}
+}
+
+static void
+bench_count_line_rows(size_t n)
+{
+	line l = {
+		.text = text,
+		.len = sizeof(text) - 1
+	};
+
+	while (n--)
+		bench_sink += count_line_rows(80, &l);
+}
+
+static void
+bench_newline(size_t n)
+{
+	while (n--)
+		newline(chan, LINE_CHAT, "nickname", text);
+}
+
+static void
+bench_draw_buffer(size_t n)
+{
+	/* Redraw a full buffer with cached line rows */
+
+	while (n--)
+		draw_buffer(chan);
+}
+
+static void
+bench_draw_buffer_resized(size_t n)
+{
+	/* Redraw a full buffer, recounting every line's rows */
+
+	while (n--) {
+		chan->resized = 1;
+		draw_buffer(chan);
+	}
+}
+
+static void
+bench_draw_buffer_append(size_t n, int scroll)
+{
+	/* Append a line to a full buffer at its bottom, then draw it */
+
+	while (n--) {
+
+		_newline(chan, LINE_CHAT, "nick", text, n % 160);
+
+		if (!scroll)
+			chan->draw.scrollable = 0;
+
+		draw_buffer(chan);
+	}
+}
+
+static void
+bench_draw_buffer_append_full(size_t n)
+{
+	bench_draw_buffer_append(n, 0);
+}
+
+static void
+bench_draw_buffer_append_scroll(size_t n)
+{
+	bench_draw_buffer_append(n, 1);
+}
+
+int
+main(void)
+{
+	int i;
+
+	bench_init();
+
+	config.timestamp_format = TIMESTAMP_FORMAT;
+
+	w.ws_row = 50;
+	w.ws_col = 200;
+
+	/* As probed from a typical terminal emulator */
+	term_caps = TERM_SCROLL | TERM_REP;
+
+	rirc = new_channel("rirc", NULL, NULL);
+	chan = ccur = new_channel("#bench", NULL, rirc);
+
+	/* Fill the scrollback buffer, with varying message lengths */
+	for (i = 0; i < SCROLLBACK_BUFFER; i++)
+		_newline(chan, LINE_CHAT, (i % 2) ? "nick" : "nickname", text, i % (sizeof(text) - 1));
+
+	BENCH("word_wrap", bench_word_wrap);
+	BENCH("count_line_rows", bench_count_line_rows);
+	BENCH("draw_buffer", bench_draw_buffer);
+	BENCH("draw_buffer/resized", bench_draw_buffer_resized);
+	BENCH("draw_buffer/append/full", bench_draw_buffer_append_full);
+	BENCH("draw_buffer/append/scroll", bench_draw_buffer_append_scroll);
+
+	/* Newlines aren't drawn when added to a channel other than the current one */
+	ccur = rirc;
+
+	BENCH("_newline", bench_newline);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/* For clock_gettime, dup, fdopen */
+#define _POSIX_C_SOURCE 200112L
+
+#include "../src/input.c"
+
+#include "bench.h"
+
+/* Keys typed faster than they're read, with cursor movement and deletes */
+static char keys[] =
+	"the quick brown fox\x1b[D\x1b[D\x1b[3~\x1b[C jumps over\x7f\x7f\x7f" "er the lazy dog";
+
+static void
+bench_input_decode(char *input, size_t len, size_t split, size_t n)
+{
+	/* Decode input in reads of split bytes, clearing the input line after each */
+
+	size_t i;
+
+	while (n--) {
+
+		for (i = 0; i < len; i += split)
+			input_decode(input + i, (len - i < split) ? len - i : split);
+
+		input_load(ccur->input, "");
+	}
+}
+
+static void
+bench_input_keys(size_t n)
+{
+	/* One key per read */
+
+	char *ptr, *end = keys + sizeof(keys) - 1;
+	size_t len;
+
+	while (n--) {
+
+		for (ptr = keys; ptr < end; ptr += len) {
+
+			/* Escape sequences are CSI D, CSI C and CSI 3 ~ */
+			len = (*ptr == 0x1b) ? 3 + (ptr[2] == '3') : 1;
+
+			input_decode(ptr, len);
+		}
+
+		input_load(ccur->input, "");
+	}
+}
+
+static void
+bench_input_keys_coalesced(size_t n)
+{
+	/* All keys in a single read */
+
+	bench_input_decode(keys, sizeof(keys) - 1, sizeof(keys) - 1, n);
+}
+
+static void
+bench_input_keys_split(size_t n)
+{
+	/* Keys in reads of 5 bytes, splitting escape sequences */
+
+	bench_input_decode(keys, sizeof(keys) - 1, 5, n);
+}
+
+static void
+bench_input_paste(size_t n)
+{
+	/* A bracketed paste in full reads, fitting on the input line */
+
+	static char paste[MAX_READ];
+	static size_t len;
+
+	if (len == 0) {
+		len += sprintf(paste, PASTE_START);
+		while (len < MAX_INPUT / 2)
+			len += sprintf(paste + len, "pasted text ");
+		len += sprintf(paste + len, PASTE_END);
+	}
+
+	bench_input_decode(paste, len, len, n);
+}
+
+int
+main(void)
+{
+	bench_init();
+
+	config.timestamp_format = TIMESTAMP_FORMAT;
+
+	rirc = ccur = new_channel("rirc", NULL, NULL);
+
+	BENCH("input_decode/keys", bench_input_keys);
+	BENCH("input_decode/keys/coalesced", bench_input_keys_coalesced);
+	BENCH("input_decode/keys/split", bench_input_keys_split);
+	BENCH("input_decode/paste", bench_input_paste);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,672 @@
+/* IRC server simulator for load testing rirc
+ *
+ * Speaks enough of RFC 2812 to register a client, answer PING and echo
+ * JOIN/PART/NICK, then generates traffic into the client's joined channels
+ * at a fixed rate. Output is deterministic for a given seed and traffic type.
+ *
+ * Traffic types, one event is:
+ *   chat   PRIVMSG from a random nick
+ *   names  RPL_NAMREPLY listing every nick, followed by RPL_ENDOFNAMES
+ *   split  netsplit QUIT of a tenth of the nicks, followed by their netjoin
+ *   mode   MODE +ov/-ov on four random nicks
+ *
+ * Every second the client is sent PING :<timestamp> and round trip times are
+ * measured from its PONG, i.e. including the time taken to handle all traffic
+ * sent before the PING.
+ *
+ * A summary is printed for each client on disconnect, as key=value pairs */
+
+/* For getaddrinfo, clock_gettime, sigaction */
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFSIZE 512
+#define NICKSIZE 256
+#define CHANSIZE 256
+
+#define MAX_CLIENTS  16
+#define MAX_CHANNELS 16
+#define MAX_RTT      4096
+
+/* Traffic isn't generated while a client has this many bytes unsent */
+#define OUTPUT_HIGH  (1 << 20)
+
+#define SERVER_NAME "irc.sim.tld"
+
+enum traffic
+{
+	TRAFFIC_CHAT,
+	TRAFFIC_NAMES,
+	TRAFFIC_SPLIT,
+	TRAFFIC_MODE
+};
+
+struct client
+{
+	int fd;
+	int registered;
+	char nick[NICKSIZE];
+	char chans[MAX_CHANNELS][CHANSIZE];
+	int chans_count;
+	char input[BUFFSIZE];
+	size_t input_len;
+	char *output;
+	size_t output_len;
+	size_t output_size;
+	unsigned long long time_start;
+	unsigned long long time_ping;
+	unsigned long events;
+	unsigned long lines;
+	unsigned long bytes;
+	unsigned long stalls;
+	unsigned long long rtt[MAX_RTT];
+	unsigned int rtt_count;
+	unsigned int rng;
+};
+
+static void client_close(struct client*);
+static void client_event(struct client*);
+static void client_input(struct client*);
+static void client_line(struct client*, char*);
+static void client_names(struct client*, const char*);
+static void client_output(struct client*);
+static void client_sendf(struct client*, const char*, ...);
+static void client_summary(struct client*);
+static void client_traffic(struct client*, unsigned long long);
+static void signal_stop(int);
+static void usage(void);
+
+static int listen_port(const char*);
+static int rtt_cmp(const void*, const void*);
+static unsigned int rng_next(unsigned int*);
+static unsigned long long time_us(void);
+
+static struct client clients[MAX_CLIENTS];
+
+static volatile sig_atomic_t flag_stop;
+
+/* Command line options */
+static struct
+{
+	const char *port;
+	enum traffic traffic;
+	double rate;
+	unsigned int nicks;
+	unsigned int duration;
+	unsigned int seed;
+} opts = {
+	.port = "6667",
+	.traffic = TRAFFIC_CHAT,
+	.rate = 1000,
+	.nicks = 10000,
+	.duration = 0,
+	.seed = 1
+};
+
+int
+main(int argc, char **argv)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	struct sigaction sa;
+	int c, i, n, soc;
+
+	while ((c = getopt(argc, argv, "p:t:r:n:d:s:h")) != -1) {
+
+		switch (c) {
+
+			case 'p':
+				opts.port = optarg;
+				break;
+
+			case 't':
+				if (!strcmp(optarg, "chat"))
+					opts.traffic = TRAFFIC_CHAT;
+				else if (!strcmp(optarg, "names"))
+					opts.traffic = TRAFFIC_NAMES;
+				else if (!strcmp(optarg, "split"))
+					opts.traffic = TRAFFIC_SPLIT;
+				else if (!strcmp(optarg, "mode"))
+					opts.traffic = TRAFFIC_MODE;
+				else {
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'r':
+				opts.rate = strtod(optarg, NULL);
+				break;
+
+			case 'n':
+				if ((opts.nicks = strtoul(optarg, NULL, 10)) == 0)
+					opts.nicks = 1;
+				break;
+
+			case 'd':
+				opts.duration = strtoul(optarg, NULL, 10);
+				break;
+
+			case 's':
+				opts.seed = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+
+			default:
+				usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	soc = listen_port(opts.port);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	unsigned long long start = time_us();
+
+	while (!flag_stop) {
+
+		if (opts.duration && time_us() - start >= opts.duration * 1000000ULL)
+			break;
+
+		fds[0].fd = soc;
+		fds[0].events = POLLIN;
+
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN | (clients[i].output_len ? POLLOUT : 0);
+			fds[i + 1].revents = 0;
+		}
+
+		/* Wake every millisecond to generate traffic */
+		if ((n = poll(fds, MAX_CLIENTS + 1, 1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		if (fds[0].revents & POLLIN) {
+
+			int fd = accept(soc, NULL, NULL);
+
+			for (i = 0; fd >= 0 && i < MAX_CLIENTS && clients[i].fd >= 0; i++)
+				;
+
+			if (fd >= 0 && i == MAX_CLIENTS) {
+				close(fd);
+			} else if (fd >= 0) {
+				memset(&clients[i], 0, sizeof(clients[i]));
+				clients[i].fd = fd;
+				clients[i].rng = opts.seed;
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			}
+		}
+
+		unsigned long long now = time_us();
+
+		for (i = 0; i < MAX_CLIENTS; i++) {
+
+			struct client *cl = &clients[i];
+
+			if (cl->fd >= 0 && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				client_input(cl);
+
+			if (cl->fd >= 0 && cl->registered)
+				client_traffic(cl, now);
+
+			if (cl->fd >= 0 && cl->output_len)
+				client_output(cl);
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			client_close(&clients[i]);
+
+	close(soc);
+
+	return EXIT_SUCCESS;
+}
+
+static void
+usage(void)
+{
+	puts(
+	"Usage:\n"
+	"  ircd [-p port] [-t traffic] [-r rate] [-n nicks] [-d seconds] [-s seed]\n"
+	"\n"
+	"Options:\n"
+	"  -p  Listen on port, default 6667\n"
+	"  -t  Traffic type: chat, names, split, mode, default chat\n"
+	"  -r  Events per second per client, 0 for as fast as the client reads, default 1000\n"
+	"  -n  Number of simulated nicks per channel, default 10000\n"
+	"  -d  Exit after seconds, default 0 (run until interrupted)\n"
+	"  -s  Random seed, default 1\n"
+	"\n"
+	"Example:\n"
+	"  ircd -t split -r 0.5 -n 10000 &\n"
+	"  rirc -c localhost -j '#sim'\n"
+	);
+}
+
+static void
+signal_stop(int signum)
+{
+	(void)(signum);
+
+	flag_stop = 1;
+}
+
+static int
+listen_port(const char *port)
+{
+	struct addrinfo hints, *res;
+	int ret, soc, yes = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((ret = getaddrinfo("127.0.0.1", port, &hints, &res))) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	if ((soc = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0
+	 || setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0
+	 || bind(soc, res->ai_addr, res->ai_addrlen) < 0
+	 || listen(soc, MAX_CLIENTS) < 0) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	freeaddrinfo(res);
+
+	return soc;
+}
+
+static unsigned long long
+time_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static unsigned int
+rng_next(unsigned int *state)
+{
+	/* xorshift32, deterministic across platforms for a given seed */
+
+	unsigned int x = *state ? *state : 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return (*state = x);
+}
+
+static void
+client_sendf(struct client *cl, const char *fmt, ...)
+{
+	/* Append a line to the client's output buffer */
+
+	char buff[BUFFSIZE + 1];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buff, BUFFSIZE - 1, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return;
+
+	if (len > BUFFSIZE - 2)
+		len = BUFFSIZE - 2;
+
+	buff[len++] = '\r';
+	buff[len++] = '\n';
+
+	if (cl->output_len + len > cl->output_size) {
+
+		size_t size = cl->output_size ? cl->output_size : 4096;
+
+		while (size < cl->output_len + len)
+			size *= 2;
+
+		if ((cl->output = realloc(cl->output, size)) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		cl->output_size = size;
+	}
+
+	memcpy(cl->output + cl->output_len, buff, len);
+
+	cl->output_len += len;
+	cl->bytes += len;
+	cl->lines++;
+}
+
+static void
+client_output(struct client *cl)
+{
+	ssize_t ret;
+
+	if ((ret = send(cl->fd, cl->output, cl->output_len, 0)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			client_close(cl);
+		return;
+	}
+
+	memmove(cl->output, cl->output + ret, cl->output_len - ret);
+
+	cl->output_len -= ret;
+}
+
+static void
+client_input(struct client *cl)
+{
+	/* Read from the client and handle each complete line */
+
+	char buff[BUFFSIZE * 8];
+	ssize_t i, ret;
+
+	if ((ret = recv(cl->fd, buff, sizeof(buff), 0)) <= 0) {
+		if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			client_close(cl);
+		return;
+	}
+
+	for (i = 0; i < ret && cl->fd >= 0; i++) {
+
+		if (buff[i] == '\n' || buff[i] == '\r') {
+
+			if (cl->input_len) {
+				cl->input[cl->input_len] = '\0';
+				cl->input_len = 0;
+				client_line(cl, cl->input);
+			}
+
+		} else if (cl->input_len < BUFFSIZE - 1) {
+			cl->input[cl->input_len++] = buff[i];
+		}
+	}
+}
+
+static void
+client_line(struct client *cl, char *line)
+{
+	/* Handle a line received from the client */
+
+	char *cmd, *args;
+
+	if (!(cmd = strtok_r(line, " ", &args)))
+		return;
+
+	if (!strcmp(cmd, "NICK")) {
+
+		char *nick = strtok_r(NULL, " :", &args);
+
+		if (nick == NULL)
+			return;
+
+		if (cl->registered)
+			client_sendf(cl, ":%s!sim@" SERVER_NAME " NICK :%s", cl->nick, nick);
+
+		snprintf(cl->nick, NICKSIZE, "%s", nick);
+
+	} else if (!strcmp(cmd, "USER")) {
+
+		if (cl->registered || !*cl->nick)
+			return;
+
+		client_sendf(cl, ":" SERVER_NAME " 001 %s :Welcome to the simulator %s", cl->nick, cl->nick);
+		client_sendf(cl, ":" SERVER_NAME " 002 %s :Your host is " SERVER_NAME, cl->nick);
+		client_sendf(cl, ":" SERVER_NAME " 003 %s :This server was created for load testing", cl->nick);
+		client_sendf(cl, ":" SERVER_NAME " 004 %s " SERVER_NAME " sim io ovntk", cl->nick);
+		client_sendf(cl, ":" SERVER_NAME " 375 %s :- " SERVER_NAME " Message of the day -", cl->nick);
+		client_sendf(cl, ":" SERVER_NAME " 376 %s :End of MOTD command", cl->nick);
+
+		cl->registered = 1;
+		cl->time_start = cl->time_ping = time_us();
+
+	} else if (!strcmp(cmd, "PING")) {
+
+		client_sendf(cl, ":" SERVER_NAME " PONG " SERVER_NAME " :%s", (*args == ':') ? args + 1 : args);
+
+	} else if (!strcmp(cmd, "PONG")) {
+
+		/* PONG <timestamp>, sent by rirc in reply to the periodic PING */
+
+		char *ts = strrchr(args, ' ');
+
+		ts = ts ? ts + 1 : args;
+
+		if (*ts == ':')
+			ts++;
+
+		unsigned long long sent = strtoull(ts, NULL, 10);
+
+		if (sent && cl->rtt_count < MAX_RTT)
+			cl->rtt[cl->rtt_count++] = time_us() - sent;
+
+	} else if (!strcmp(cmd, "JOIN")) {
+
+		char *chan, *chans = strtok_r(NULL, " ", &args);
+
+		while (chans && (chan = strtok_r(chans, ",", &chans)) && cl->chans_count < MAX_CHANNELS) {
+
+			snprintf(cl->chans[cl->chans_count++], CHANSIZE, "%s", chan);
+
+			client_sendf(cl, ":%s!sim@" SERVER_NAME " JOIN %s", cl->nick, chan);
+
+			client_names(cl, chan);
+		}
+
+	} else if (!strcmp(cmd, "PART")) {
+
+		char *chan = strtok_r(NULL, " ", &args);
+		int i;
+
+		for (i = 0; chan && i < cl->chans_count; i++) {
+			if (!strcmp(cl->chans[i], chan)) {
+				client_sendf(cl, ":%s!sim@" SERVER_NAME " PART %s", cl->nick, chan);
+				memmove(cl->chans[i], cl->chans[i + 1], (cl->chans_count - i - 1) * CHANSIZE);
+				cl->chans_count--;
+				break;
+			}
+		}
+
+	} else if (!strcmp(cmd, "QUIT")) {
+
+		client_sendf(cl, "ERROR :Closing link");
+		client_output(cl);
+
+		if (cl->fd >= 0)
+			client_close(cl);
+	}
+}
+
+static void
+client_names(struct client *cl, const char *chan)
+{
+	/* Send the channel's names list, every simulated nick and the client */
+
+	char buff[BUFFSIZE];
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < opts.nicks; i++) {
+
+		len += sprintf(buff + len, "%snick%05u", len ? " " : "", i);
+
+		if (len > BUFFSIZE - 100 || i == opts.nicks - 1) {
+			client_sendf(cl, ":" SERVER_NAME " 353 %s = %s :%s", cl->nick, chan, buff);
+			len = 0;
+		}
+	}
+
+	client_sendf(cl, ":" SERVER_NAME " 353 %s = %s :@%s", cl->nick, chan, cl->nick);
+	client_sendf(cl, ":" SERVER_NAME " 366 %s %s :End of NAMES list", cl->nick, chan);
+}
+
+static void
+client_traffic(struct client *cl, unsigned long long now)
+{
+	/* Generate the events due since the client registered */
+
+	if (now - cl->time_ping >= 1000000) {
+		client_sendf(cl, "PING :%llu", now);
+		cl->time_ping = now;
+	}
+
+	if (cl->chans_count == 0)
+		return;
+
+	if (opts.rate <= 0) {
+
+		if (cl->output_len < OUTPUT_HIGH)
+			client_event(cl);
+
+		return;
+	}
+
+	unsigned long due = (now - cl->time_start) * opts.rate / 1000000;
+
+	while (cl->events < due) {
+
+		/* The client isn't keeping up, count it and try again next iteration */
+		if (cl->output_len >= OUTPUT_HIGH) {
+			cl->stalls++;
+			return;
+		}
+
+		client_event(cl);
+	}
+}
+
+static void
+client_event(struct client *cl)
+{
+	/* Generate a single traffic event into one of the client's channels */
+
+	const char *chan = cl->chans[rng_next(&cl->rng) % cl->chans_count];
+	unsigned int i, n;
+
+	cl->events++;
+
+	switch (opts.traffic) {
+
+		case TRAFFIC_CHAT:
+			n = rng_next(&cl->rng) % opts.nicks;
+			client_sendf(cl, ":nick%05u!user@host%u.sim PRIVMSG %s :message %lu, "
+				"the quick brown fox jumps over the lazy dog", n, n, chan, cl->events);
+			break;
+
+		case TRAFFIC_NAMES:
+			client_names(cl, chan);
+			break;
+
+		case TRAFFIC_SPLIT:
+			n = rng_next(&cl->rng) % opts.nicks;
+
+			for (i = 0; i < opts.nicks / 10 + 1; i++)
+				client_sendf(cl, ":nick%05u!user@host%u.sim QUIT :hub.sim.tld leaf.sim.tld",
+					(n + i) % opts.nicks, (n + i) % opts.nicks);
+
+			for (i = 0; i < opts.nicks / 10 + 1; i++)
+				client_sendf(cl, ":nick%05u!user@host%u.sim JOIN %s",
+					(n + i) % opts.nicks, (n + i) % opts.nicks, chan);
+			break;
+
+		case TRAFFIC_MODE:
+			n = rng_next(&cl->rng) % opts.nicks;
+			client_sendf(cl, ":nick%05u!user@host%u.sim MODE %s %s nick%05u nick%05u nick%05u nick%05u",
+				n, n, chan, (cl->events % 2) ? "+oovv" : "-oovv",
+				(n + 1) % opts.nicks, (n + 2) % opts.nicks,
+				(n + 3) % opts.nicks, (n + 4) % opts.nicks);
+			break;
+	}
+}
+
+static int
+rtt_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+client_summary(struct client *cl)
+{
+	/* Print the client's throughput and round trip latency */
+
+	double secs = (time_us() - cl->time_start) / 1e6;
+
+	unsigned long long p50 = 0, p99 = 0, max = 0;
+
+	if (cl->rtt_count) {
+		qsort(cl->rtt, cl->rtt_count, sizeof(cl->rtt[0]), rtt_cmp);
+		p50 = cl->rtt[cl->rtt_count / 2];
+		p99 = cl->rtt[(cl->rtt_count * 99) / 100];
+		max = cl->rtt[cl->rtt_count - 1];
+	}
+
+	printf("nick=%s secs=%.3f events=%lu lines=%lu bytes=%lu lines_per_sec=%.1f "
+		"bytes_per_sec=%.1f stalls=%lu unsent=%zu rtt_count=%u rtt_p50_us=%llu "
+		"rtt_p99_us=%llu rtt_max_us=%llu\n",
+		*cl->nick ? cl->nick : "-", secs, cl->events, cl->lines, cl->bytes,
+		secs > 0 ? cl->lines / secs : 0,
+		secs > 0 ? cl->bytes / secs : 0,
+		cl->stalls, cl->output_len, cl->rtt_count, p50, p99, max);
+
+	fflush(stdout);
+}
+
+static void
+client_close(struct client *cl)
+{
+	if (cl->registered)
+		client_summary(cl);
+
+	close(cl->fd);
+	free(cl->output);
+
+	cl->fd = -1;
+	cl->output = NULL;
+	cl->output_len = 0;
+	cl->output_size = 0;
+}
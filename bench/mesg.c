@@ -0,0 +1,321 @@
+/* For clock_gettime, dup, fdopen */
+#define _POSIX_C_SOURCE 200112L
+
+#include "../src/mesg.c"
+
+#include "bench.h"
+
+#include <sys/ioctl.h>
+
+/* Defined in draw.c */
+extern struct winsize w;
+
+static char mesg[] = ":nick!user@hostname.domain PRIVMSG #bench :a typical message of typical length\r\n";
+
+static char mesg_ignored[] = ":spammer!spam@flood.spam.tld PRIVMSG #bench :a typical message of typical length\r\n";
+
+static char mesg_filtered[] = ":bot!bot@relay.bots.tld PRIVMSG #bench :<relayed> a typical message of typical length\r\n";
+
+static const char *filter_rules[] = {
+	"join,part,quit over 100",
+	"nick over 100",
+	"privmsg,notice in #bench from *!*@*.bots.tld matching ^<[a-z]+>"
+};
+
+static const char *ignore_masks[] = {
+	"troll!*@*", "troll_!*@*", "*!*@*.spam.tld", "*!*bot@*", "idler!*@*",
+	"flooder?!*@*", "*!*@192.0.2.*", "*!~spam*@*", "guest*!*@*", "nick_!*@*"
+};
+
+static server *serv;
+
+#define HISTORY_LINES 1000
+
+static void
+bench_recv_mesg(size_t n)
+{
+	/* One message per read */
+
+	while (n--)
+		recv_mesg(mesg, sizeof(mesg) - 1, serv);
+}
+
+static void
+bench_recv_mesg_split(size_t n)
+{
+	/* One message split across two reads */
+
+	int split = (sizeof(mesg) - 1) / 2;
+
+	while (n--) {
+		recv_mesg(mesg, split, serv);
+		recv_mesg(mesg + split, sizeof(mesg) - 1 - split, serv);
+	}
+}
+
+static void
+bench_recv_mesg_batch(size_t n)
+{
+	/* Many messages per read */
+
+	static char batch[BUFFSIZE * 4];
+	static int len;
+
+	if (len == 0)
+		while (len + sizeof(mesg) < sizeof(batch))
+			len += sprintf(batch + len, "%s", mesg);
+
+	while (n--)
+		recv_mesg(batch, len, serv);
+}
+
+static void
+bench_recv_mesg_ignored(size_t n, int ignored)
+{
+	/* A flood of messages, checked against ignore masks */
+
+	char *m = ignored ? mesg_ignored : mesg;
+	size_t len = ignored ? sizeof(mesg_ignored) - 1 : sizeof(mesg) - 1;
+
+	while (n--)
+		recv_mesg(m, len, serv);
+}
+
+static void
+bench_recv_mesg_ignore_miss(size_t n)
+{
+	bench_recv_mesg_ignored(n, 0);
+}
+
+static void
+bench_recv_mesg_ignore_hit(size_t n)
+{
+	bench_recv_mesg_ignored(n, 1);
+}
+
+static void
+bench_recv_mesg_filtered(size_t n, int filtered)
+{
+	/* A flood of messages, checked against filter rules */
+
+	char *m = filtered ? mesg_filtered : mesg;
+	size_t len = filtered ? sizeof(mesg_filtered) - 1 : sizeof(mesg) - 1;
+
+	while (n--)
+		recv_mesg(m, len, serv);
+}
+
+static void
+bench_recv_mesg_filter_pass(size_t n)
+{
+	bench_recv_mesg_filtered(n, 0);
+}
+
+static void
+bench_recv_mesg_filter_drop(size_t n)
+{
+	bench_recv_mesg_filtered(n, 1);
+}
+
+#define NAMES_NICKS 5000
+
+static void
+bench_recv_mesg_names(size_t n)
+{
+	/* Joining a large channel, its NAMES reply in lines of 40 nicks */
+
+	static char *names;
+	static size_t len;
+	channel *c;
+	size_t i;
+
+	if (names == NULL) {
+
+		if ((names = malloc(NAMES_NICKS * 32 + BUFFSIZE)) == NULL)
+			fatal("malloc");
+
+		for (i = 0; i < NAMES_NICKS; i++) {
+			if (i % 40 == 0)
+				len += sprintf(names + len, "%s:bench.tld 353 me = #names :", i ? "\r\n" : "");
+			len += sprintf(names + len, "%snick%05zu ", (i % 7) ? "" : "@", (i * 7919) % NAMES_NICKS);
+		}
+
+		len += sprintf(names + len, "\r\n:bench.tld 366 me #names :End of /NAMES list\r\n");
+	}
+
+	if ((c = channel_get("#names", serv)) == NULL)
+		c = new_channel("#names", serv, serv->channel);
+
+	/* The nicklist is left built, for recv_mesg/mode */
+	while (n--) {
+		free_avl(c->nicklist);
+		c->nicklist = NULL;
+		c->nick_count = 0;
+		recv_mesg(names, len, serv);
+	}
+}
+
+static void
+bench_recv_mesg_mode(size_t n)
+{
+	/* Opping and voicing members of the large channel, then taking it back */
+
+	char buf[BUFFSIZE];
+	int len;
+
+	while (n--) {
+		len = sprintf(buf, ":nick!user@host MODE #names %coovv nick%05zu nick%05zu nick%05zu nick%05zu\r\n",
+				(n % 2) ? '+' : '-', n % NAMES_NICKS, (n + 1) % NAMES_NICKS,
+				(n + 2) % NAMES_NICKS, (n + 3) % NAMES_NICKS);
+		recv_mesg(buf, len, serv);
+	}
+}
+
+#define SPLIT_NICKS 1000
+
+static void
+bench_recv_mesg_quit_join(size_t n, const char *reason)
+{
+	/* Nicks quitting and rejoining the channel */
+
+	char buf[BUFFSIZE];
+	int len;
+
+	while (n--) {
+		len = sprintf(buf, ":split%04zu!user@host QUIT :%s\r\n", n % SPLIT_NICKS, reason);
+		len += sprintf(buf + len, ":split%04zu!user@host JOIN #bench\r\n", n % SPLIT_NICKS);
+		recv_mesg(buf, len, serv);
+	}
+}
+
+static void
+bench_recv_mesg_quit(size_t n)
+{
+	bench_recv_mesg_quit_join(n, "Quit: leaving");
+}
+
+static void
+bench_recv_mesg_netsplit(size_t n)
+{
+	/* Summarized, without a line per quit and rejoin */
+
+	bench_recv_mesg_quit_join(n, "hub.bench.tld leaf.bench.tld");
+}
+
+static void
+bench_recv_mesg_history(size_t n, int batched)
+{
+	/* A channel's history played back as HISTORY_LINES messages, received
+	 * in reads of BUFFSIZE as from the socket, redrawing after each */
+
+	static char history[2][(sizeof(mesg) + 64) * (HISTORY_LINES + 2)];
+	static int len[2];
+
+	int i, count;
+
+	if (len[batched] == 0) {
+
+		if (batched)
+			len[1] += sprintf(history[1], ":bench.tld BATCH +ref chathistory #bench\r\n");
+
+		for (i = 0; i < HISTORY_LINES; i++)
+			len[batched] += sprintf(history[batched] + len[batched], "%s%s",
+				batched ? "@batch=ref;time=2011-10-19T16:40:51.620Z " : "@time=2011-10-19T16:40:51.620Z ", mesg);
+
+		if (batched)
+			len[1] += sprintf(history[1] + len[1], ":bench.tld BATCH -ref\r\n");
+	}
+
+	while (n--) {
+		for (i = 0; i < len[batched]; i += BUFFSIZE) {
+			count = (len[batched] - i < BUFFSIZE) ? len[batched] - i : BUFFSIZE;
+			recv_mesg(history[batched] + i, count, serv);
+			redraw(ccur);
+		}
+	}
+}
+
+static void
+bench_recv_mesg_history_lines(size_t n)
+{
+	bench_recv_mesg_history(n, 0);
+}
+
+static void
+bench_recv_mesg_history_batch(size_t n)
+{
+	bench_recv_mesg_history(n, 1);
+}
+
+int
+main(void)
+{
+	size_t i;
+
+	bench_init();
+
+	config.timestamp_format = TIMESTAMP_FORMAT;
+
+	if ((serv = calloc(1, sizeof(*serv))) == NULL)
+		fatal("calloc");
+
+	serv->soc = -1;
+	serv->iptr = serv->input;
+	serv->host = "bench.tld";
+
+	strcpy(serv->nick_me, "me");
+
+	reset_isupport(serv);
+
+	serv->channel = new_channel(serv->host, serv, NULL);
+
+	rirc = ccur = new_channel("#bench", serv, serv->channel);
+
+	ccur->type = 'c';
+
+	BENCH("recv_mesg", bench_recv_mesg);
+	BENCH("recv_mesg/split", bench_recv_mesg_split);
+	BENCH("recv_mesg/batch", bench_recv_mesg_batch);
+
+	for (i = 0; i < sizeof(ignore_masks) / sizeof(ignore_masks[0]); i++)
+		ignore_add(&serv->ignore, serv->isupport.casemap, ignore_masks[i], IGNORE_ALL);
+
+	BENCH("recv_mesg/names", bench_recv_mesg_names);
+	BENCH("recv_mesg/mode", bench_recv_mesg_mode);
+
+	BENCH("recv_mesg/ignore/miss", bench_recv_mesg_ignore_miss);
+	BENCH("recv_mesg/ignore/hit", bench_recv_mesg_ignore_hit);
+
+	ignore_free(serv->ignore);
+	serv->ignore = NULL;
+
+	for (i = 0; i < sizeof(filter_rules) / sizeof(filter_rules[0]); i++)
+		filter_add(&filters, filter_rules[i]);
+
+	BENCH("recv_mesg/filter/pass", bench_recv_mesg_filter_pass);
+	BENCH("recv_mesg/filter/drop", bench_recv_mesg_filter_drop);
+
+	filter_free(filters);
+	filters = NULL;
+
+	for (i = 0; i < SPLIT_NICKS; i++) {
+		char nick[NICKSIZE];
+		sprintf(nick, "split%04zu", i);
+		avl_add(&ccur->nicklist, serv->isupport.casemap, nick, NULL);
+		ccur->nick_count++;
+	}
+
+	BENCH("recv_mesg/quit", bench_recv_mesg_quit);
+	BENCH("recv_mesg/netsplit", bench_recv_mesg_netsplit);
+
+	free_netsplits(serv);
+
+	/* History played back unbatched, and held in a batch */
+	w.ws_row = 50;
+	w.ws_col = 200;
+
+	BENCH("recv_mesg/history/lines", bench_recv_mesg_history_lines);
+	BENCH("recv_mesg/history/batch", bench_recv_mesg_history_batch);
+
+	return EXIT_SUCCESS;
+}
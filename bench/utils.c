@@ -0,0 +1,207 @@
+/* For clock_gettime, dup, fdopen */
+#define _POSIX_C_SOURCE 200112L
+
+#include "../src/utils.c"
+
+#include "bench.h"
+
+#define AVL_KEYS 10000
+
+static char avl_keys[AVL_KEYS][16];
+static avl_node *avl_tree;
+static size_t avl_size;
+
+static const char *parse_mesgs[] = {
+	"PING :irc.server.tld",
+	":irc.server.tld 372 nick :- Message of the day line",
+	":nick!user@hostname.domain PRIVMSG #channel :a typical message of typical length",
+	":nick!user@hostname.domain MODE #channel +ov nick1 nick2",
+	":irc.server.tld 353 nick = #channel :nick1 @nick2 +nick3 nick4 nick5 nick6 nick7",
+};
+
+static const char *parse_tagged_mesgs[] = {
+	"@time=2011-10-19T16:40:51.620Z :nick!user@hostname.domain PRIVMSG #channel :a typical message",
+	"@account=nick;msgid=63E1033A051D4B41B1AB1FA3CF4B243E;time=2011-10-19T16:40:51.620Z :nick!user@hostname.domain PRIVMSG #channel :a typical message",
+};
+
+#define PARSE_MESGS (sizeof(parse_mesgs) / sizeof(parse_mesgs[0]))
+#define PARSE_TAGGED_MESGS (sizeof(parse_tagged_mesgs) / sizeof(parse_tagged_mesgs[0]))
+
+static void
+bench_parse(size_t n)
+{
+	/* parse() tokenizes in place, so each message is first copied to a buffer */
+
+	char buff[BUFFSIZE];
+	parsed_mesg p;
+
+	while (n--) {
+		strcpy(buff, parse_mesgs[n % PARSE_MESGS]);
+		bench_sink += parse(&p, buff);
+	}
+}
+
+static void
+bench_parse_tagged(size_t n)
+{
+	/* As recv_mesg() does for tagged messages, parse then find the server-time */
+
+	char buff[BUFFSIZE];
+	mesg_tag t;
+	parsed_mesg p;
+
+	while (n--) {
+		strcpy(buff, parse_tagged_mesgs[n % PARSE_TAGGED_MESGS]);
+
+		if (parse(&p, buff) && tag_get(p.tags, "time", &t))
+			bench_sink += tag_time(&t);
+	}
+}
+
+static struct highlight *highlight_nick;
+static struct highlight *highlight_words;
+
+static void
+bench_highlight(size_t n, struct highlight *h)
+{
+	/* Worst case, no match, the whole message is scanned */
+
+	char mesg[] = "the quick brown fox jumps over the lazy dog, and then some more words";
+
+	while (n--)
+		bench_sink += highlight_match(h, mesg);
+}
+
+static void
+bench_highlight_nick(size_t n)
+{
+	bench_highlight(n, highlight_nick);
+}
+
+static void
+bench_highlight_words(size_t n)
+{
+	bench_highlight(n, highlight_words);
+}
+
+static void
+avl_fill(size_t size)
+{
+	/* Build a tree of size nodes from the first size keys */
+
+	size_t i;
+
+	free_avl(avl_tree);
+	avl_tree = NULL;
+
+	for (i = 0; i < size; i++)
+		avl_add(&avl_tree, casemap_rfc1459, avl_keys[i], NULL);
+
+	avl_size = size;
+}
+
+static void
+bench_avl_get(size_t n)
+{
+	while (n--)
+		bench_sink += (avl_get(avl_tree, casemap_rfc1459, avl_keys[n % avl_size], 16) != NULL);
+}
+
+static void
+bench_avl_add_del(size_t n)
+{
+	/* Remove and re-add an existing key, leaving the tree's size unchanged */
+
+	while (n--) {
+		bench_sink += avl_del(&avl_tree, casemap_rfc1459, avl_keys[n % avl_size]);
+		bench_sink += avl_add(&avl_tree, casemap_rfc1459, avl_keys[n % avl_size], NULL);
+	}
+}
+
+static void
+bench_avl_add_all(size_t n)
+{
+	/* Build a tree of all keys, added one at a time */
+
+	avl_node *tree;
+	size_t i;
+
+	while (n--) {
+
+		for (tree = NULL, i = 0; i < avl_size; i++)
+			avl_add(&tree, casemap_rfc1459, avl_keys[i], NULL);
+
+		free_avl(tree);
+	}
+}
+
+static void
+bench_avl_build(size_t n)
+{
+	/* Build a tree of all keys at once, as a NAMES reply is */
+
+	static avl_node *nodes[AVL_KEYS];
+	size_t i, len;
+
+	while (n--) {
+
+		for (i = 0; i < avl_size; i++)
+			nodes[i] = avl_new_node(avl_keys[i], NULL);
+
+		len = avl_size;
+
+		free_avl(avl_build(casemap_rfc1459, nodes, &len));
+	}
+}
+
+int
+main(void)
+{
+	size_t i, sizes[] = {10, 100, 1000, AVL_KEYS};
+	char name[64];
+
+	bench_init();
+
+	srand(0);
+
+	for (i = 0; i < AVL_KEYS; i++)
+		snprintf(avl_keys[i], sizeof(avl_keys[i]), "nick%08x", rand());
+
+	BENCH("parse", bench_parse);
+	BENCH("parse/tagged", bench_parse_tagged);
+
+	/* A nick, and a nick with alternates and keywords, sharing prefixes with
+	 * the message's words */
+	highlight_nick = highlight_compile(casemap_rfc1459, "nickname");
+	highlight_words = highlight_compile(casemap_rfc1459,
+		"nickname, nickname_, nickname__, nick, thequick, brownie, foxes, jumper, "
+		"overt, lazybones, doge, andy, thence, someone, moreover, wordsmith, "
+		"rirc, irc, release, bug, crash, deploy, outage, urgent");
+
+	BENCH("highlight_match/nick", bench_highlight_nick);
+	BENCH("highlight_match/words", bench_highlight_words);
+
+	highlight_free(highlight_nick);
+	highlight_free(highlight_words);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+		avl_fill(sizes[i]);
+
+		snprintf(name, sizeof(name), "avl_get/%zu", sizes[i]);
+		BENCH(name, bench_avl_get);
+
+		snprintf(name, sizeof(name), "avl_add_del/%zu", sizes[i]);
+		BENCH(name, bench_avl_add_del);
+
+		snprintf(name, sizeof(name), "avl_add/all/%zu", sizes[i]);
+		BENCH(name, bench_avl_add_all);
+
+		snprintf(name, sizeof(name), "avl_build/%zu", sizes[i]);
+		BENCH(name, bench_avl_build);
+	}
+
+	free_avl(avl_tree);
+
+	return EXIT_SUCCESS;
+}
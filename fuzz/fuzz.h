@@ -0,0 +1,74 @@
+/* Fuzz target driver
+ *
+ * Each target defines LLVMFuzzerTestOneInput(). When built with clang and
+ * -fsanitize=fuzzer (make fuzz FUZZ_ENGINE=libfuzzer) libFuzzer provides main(),
+ * otherwise main() below runs each file given as an argument through the target,
+ * or stdin when none are given, for corpus regression runs and AFL.
+ *
+ * Seed corpora in fuzz/corpus/<target> are the example messages of rfc_2812.txt,
+ * plus numeric replies handled by rirc */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t*, size_t);
+
+#ifndef FUZZ_LIBFUZZER
+
+static size_t
+fuzz_read(FILE *f, uint8_t **buf)
+{
+	/* Read a file in full, returns its length */
+
+	size_t len = 0, size = 4096;
+
+	if ((*buf = malloc(size)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((len += fread(*buf + len, 1, size - len, f)) == size) {
+		if ((*buf = realloc(*buf, size *= 2)) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return len;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint8_t *buf;
+	size_t len;
+	FILE *f;
+	int i;
+
+	if (argc < 2) {
+		len = fuzz_read(stdin, &buf);
+		LLVMFuzzerTestOneInput(buf, len);
+		free(buf);
+	}
+
+	for (i = 1; i < argc; i++) {
+
+		if ((f = fopen(argv[i], "rb")) == NULL) {
+			perror(argv[i]);
+			exit(EXIT_FAILURE);
+		}
+
+		len = fuzz_read(f, &buf);
+		fclose(f);
+
+		LLVMFuzzerTestOneInput(buf, len);
+		free(buf);
+	}
+
+	printf("%s: %d inputs\n", argv[0], (argc < 2) ? 1 : argc - 1);
+
+	return EXIT_SUCCESS;
+}
+
+#endif
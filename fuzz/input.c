@@ -0,0 +1,44 @@
+/* Fuzz input_decode() and the user input handlers
+ *
+ * The first byte of input sizes the reads the remaining input is split into,
+ * of 1 to 64 bytes, as from the terminal.
+ *
+ * Line feeds are dropped, sending input runs commands and is fuzzed through
+ * the mesg target. Each input starts from a blank input line in the main
+ * buffer, with the decoder reset */
+
+#include "../src/input.c"
+
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char buf[MAX_READ];
+	size_t i, len, chunk;
+
+	if (rirc == NULL) {
+		config.timestamp_format = TIMESTAMP_FORMAT;
+		rirc = ccur = new_channel("rirc", NULL, NULL);
+	}
+
+	if (size < 1)
+		return 0;
+
+	chunk = data[0] % 64 + 1;
+
+	for (i = 1, len = 0; i < size && len < sizeof(buf); i++)
+		if (data[i] != '\n')
+			buf[len++] = data[i];
+
+	for (i = 0; i < len; i += chunk)
+		input_decode(buf + i, (len - i < chunk) ? len - i : chunk);
+
+	input_state = INPUT_GROUND;
+	action_message = NULL;
+	action_handler = NULL;
+
+	input_load(ccur->input, "");
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* Fuzz recv_mesg() and the recv_* handlers
+ *
+ * The first byte of input selects the target:
+ *
+ *   0       recv_mesg(), the remaining input is split into reads of
+ *           1 to 64 bytes, sized by the second byte
+ *   1..N    a single recv_* handler, called with the remaining input
+ *           sanitized and parsed as recv_mesg() would
+ *
+ * Each input runs against a new stub server, with a channel #chan with
+ * nicks me, nick and op, a private channel with nick, ignored nick
+ * ignored, and ignored joins and nick changes from *!*@*.ignored.tld.
+ *
+ * Filters drop nick changes in #chan from *!*@*.tld, and messages starting
+ * with spam or flood in channels over 2 users */
+
+#include "../src/mesg.c"
+
+#include "fuzz.h"
+
+static int (*const handlers[])(char*, parsed_mesg*, server*) = {
+	recv_ctcp_req,
+	recv_ctcp_rpl,
+	recv_error,
+	recv_join,
+	recv_mode,
+	recv_nick,
+	recv_notice,
+	recv_numeric,
+	recv_part,
+	recv_ping,
+	recv_priv,
+	recv_quit,
+	recv_batch,
+	recv_cap
+};
+
+#define HANDLERS (sizeof(handlers) / sizeof(handlers[0]))
+
+static server*
+stub_server(void)
+{
+	channel *c;
+	server *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		fatal("calloc");
+
+	s->soc = -1;
+	s->capture_id = -1;
+	s->iptr = s->input;
+	s->nptr = config.nicks;
+	s->host = "irc.stub.tld";
+	s->port = "6667";
+
+	strcpy(s->nick_me, "me");
+
+	reset_isupport(s);
+
+	ignore_add(&s->ignore, casemap_rfc1459, "ignored!*@*", IGNORE_ALL);
+	ignore_add(&s->ignore, casemap_rfc1459, "*!*@*.ignored.tld", IGNORE_JOIN | IGNORE_NICK);
+
+	s->channel = new_channel(s->host, s, NULL);
+
+	c = new_channel("nick", s, s->channel);
+	c->type = 'p';
+
+	c = new_channel("#chan", s, s->channel);
+	c->type = 'c';
+
+	avl_add(&c->nicklist, casemap_rfc1459, "me", NULL);
+	avl_add(&c->nicklist, casemap_rfc1459, "nick", NULL);
+	avl_add(&c->nicklist, casemap_rfc1459, "op", NULL);
+	c->nick_count = 3;
+
+	ccur = c;
+
+	return s;
+}
+
+static void
+stub_free(server *s)
+{
+	channel *t, *c = s->channel;
+
+	batch_end_all(s);
+
+	/* Summarize pending netsplits, and end them */
+	check_netsplits(s, time(NULL) + NETSPLIT_TIMEOUT);
+
+	do {
+		t = c;
+		c = c->next;
+		free_channel(t);
+	} while (c != s->channel);
+
+	free_netsplits(s);
+	ignore_free(s->ignore);
+	highlight_free(s->highlight);
+	free(s);
+
+	ccur = rirc;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char errbuff[MAX_ERROR];
+	char mesg[BUFFSIZE];
+	parsed_mesg p;
+	server *s;
+	size_t i, len;
+
+	if (rirc == NULL) {
+		config.nicks = "";
+		config.timestamp_format = TIMESTAMP_FORMAT;
+		config.filters = DEFAULT_FILTERS "; nick in #chan from *!*@*.tld; "
+			"privmsg,notice over 2 matching ^(spam|flood)";
+		rirc = ccur = new_channel("rirc", NULL, NULL);
+		init_filters();
+	}
+
+	if (size < 1)
+		return 0;
+
+	s = stub_server();
+
+	if (data[0] == 0) {
+
+		size_t chunk = (size > 1) ? data[1] % 64 + 1 : 1;
+
+		for (i = 2; i < size; i += chunk)
+			recv_mesg((char *) data + i, (size - i < chunk) ? size - i : chunk, s);
+
+	} else {
+
+		/* Keep only what recv_mesg() would accumulate */
+		for (i = 1, len = 0; i < size && len < BUFFSIZE - 1; i++)
+			if (isgraph(data[i]) || data[i] == ' ' || data[i] == 0x01)
+				mesg[len++] = data[i];
+
+		mesg[len] = '\0';
+
+		if (parse(&p, mesg))
+			handlers[(data[0] - 1) % HANDLERS](errbuff, &p, s);
+	}
+
+	stub_free(s);
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+/* Fuzz parse()
+ *
+ * Input is a single message, as accumulated by recv_mesg() */
+
+#include "../src/utils.c"
+
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char buf[64], mesg[TAGSIZE + BUFFSIZE];
+	const char *tags;
+	mesg_tag t;
+	parsed_mesg p;
+
+	static struct highlight *highlight;
+
+	if (highlight == NULL)
+		highlight = highlight_compile(casemap_rfc1459, "nick, nick_ keyword");
+
+	/* recv_mesg() never accumulates more than TAGSIZE + BUFFSIZE - 1 characters */
+	if (size > sizeof(mesg) - 1)
+		size = sizeof(mesg) - 1;
+
+	memcpy(mesg, data, size);
+	mesg[size] = '\0';
+
+	if (!parse(&p, mesg))
+		return 0;
+
+	for (tags = p.tags; tag_next(&tags, &t);) {
+		tag_unescape(buf, sizeof(buf), &t);
+		tag_time(&t);
+	}
+
+	if (p.trailing)
+		highlight_match(highlight, p.trailing);
+
+	return 0;
+}
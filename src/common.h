@@ -1,13 +1,37 @@
 #define VERSION "0.1"
 
 #define SCROLLBACK_BUFFER 200
-#define SCROLLBACK_INPUT 15
+#define SCROLLBACK_INPUT 10000
 #define BUFFSIZE 512
+#define TAGSIZE 8192
+#define BATCH_LINES 4096
+#define BATCH_OPEN 16
+#define BATCH_REFSIZE 64
+#define ISUPPORT_SIZE 64
 #define NICKSIZE 256
 #define CHANSIZE 256
 #define MAX_INPUT 256
 #define RECONNECT_DELTA 15
 
+/* Queued messages are sent in bursts of up to SENDQ_BURST lines, then paced
+ * at one line per SENDQ_DELTA seconds to avoid excess flood disconnects */
+#define SENDQ_BURST 5
+#define SENDQ_DELTA 1
+
+/* Quits with a netsplit's reason, and the rejoins following it, are summarized
+ * per channel once none have been received for NETSPLIT_DELAY seconds, or held
+ * for NETSPLIT_HOLD seconds. Rejoins are expected for up to NETSPLIT_TIMEOUT
+ * seconds following the split */
+#define NETSPLIT_DELAY 5
+#define NETSPLIT_HOLD 30
+#define NETSPLIT_TIMEOUT 900
+
+/* Max size of a formatted line timestamp, including null terminator.
+ * Timestamp formats are assumed to be of at most minute resolution, and
+ * can be set with -T/--timestamp */
+#define TIMESTAMP_SIZE 16
+#define TIMESTAMP_FORMAT "%H:%M"
+
 /* When tab completing a nick at the beginning of the line, append the following char */
 #define TAB_COMPLETE_DELIMITER ':'
 
@@ -53,6 +77,7 @@
 #include <time.h>
 #include <errno.h>
 #include <error.h>
+#include <stdio.h>
 
 /* Irrecoverable error */
 #define fatal(mesg) do { \
@@ -61,6 +86,9 @@
 /* Error message length */
 #define MAX_ERROR 512
 
+/* Filter rules applied by default, see filter_add() */
+#define DEFAULT_FILTERS "join,part,quit over 99"
+
 /* Message sent for PART and QUIT by default */
 #define DEFAULT_QUIT_MESG "rirc v" VERSION
 
@@ -114,16 +142,85 @@ typedef enum {
 	LINE_T_SIZE
 } line_t;
 
+/* Received message types, counted per server */
+typedef enum {
+	RECV_NUMERIC,
+	RECV_PRIVMSG,
+	RECV_JOIN,
+	RECV_PART,
+	RECV_QUIT,
+	RECV_NOTICE,
+	RECV_NICK,
+	RECV_PING,
+	RECV_MODE,
+	RECV_ERROR,
+	RECV_BATCH,
+	RECV_CAP,
+	RECV_UNKNOWN,
+	RECV_T_SIZE
+} recv_t;
+
+/* Log-linear histogram, values are counted in buckets with 2^HISTOGRAM_SUB_BITS
+ * linear sub-buckets per power of 2, bounding the relative error per value */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS (40 << HISTOGRAM_SUB_BITS)
+
+typedef struct histogram
+{
+	unsigned long count;
+	unsigned long max;
+	unsigned long long sum;
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+/* Receive to render latency tracing, times are monotonic microseconds.
+ *
+ * read and parse are set while received messages are being handled, lines
+ * added to the current channel keep them until they're first drawn.
+ *
+ * Lines never drawn, added to another channel or overwritten in the buffer
+ * before being drawn, are recorded with a draw time of 0 and counted in
+ * undrawn, but not in the draw latencies */
+struct trace
+{
+	unsigned long long read;
+	unsigned long long parse;
+	unsigned long undrawn;
+	histogram read_parse;
+	histogram parse_insert;
+	histogram insert_draw;
+	histogram read_draw;
+	FILE *file;
+};
+
+/* Trace file record, written in native byte order */
+struct trace_record
+{
+	unsigned long long read;
+	unsigned long long parse;
+	unsigned long long insert;
+	unsigned long long draw;
+};
+
 /* Global configuration */
 struct config
 {
-	int join_part_quit_threshold;
 	char *username;
 	char *realname;
 	char *nicks;
 	char *auto_connect;
 	char *auto_port;
 	char *auto_join;
+	char *highlights;
+	char *filters;
+	char *history_file;
+	char *timestamp_format;
+	char *trace_file;
+	char *headless;
+	char *record_file;
+	char *replay_file;
+	int replay_fast;
+	unsigned int history_size;
 } config;
 
 /* Nicklist AVL tree node */
@@ -134,6 +231,7 @@ typedef struct avl_node
 	struct avl_node *r;
 	char *key;
 	void *val;
+	unsigned int prefix;
 } avl_node;
 
 /* TODO: buffer_line */
@@ -145,16 +243,22 @@ typedef struct line
 	time_t time;
 	char *text;
 	char from[NICKSIZE];
+	char time_str[TIMESTAMP_SIZE];
+	int from_fg;
+	size_t from_len;
 	line_t type;
+	struct {
+		unsigned long long read;
+		unsigned long long parse;
+		unsigned long long insert;
+	} trace;
 } line;
 
-/* Channel input line */
+/* Channel input line, with room for a null terminator */
 typedef struct input_line
 {
 	char *end;
-	char text[MAX_INPUT];
-	struct input_line *next;
-	struct input_line *prev;
+	char text[MAX_INPUT + 1];
 } input_line;
 
 /* Channel input */
@@ -163,9 +267,9 @@ typedef struct input
 	char *head;
 	char *tail;
 	char *window;
-	int count;
+	unsigned long history;
 	struct input_line *line;
-	struct input_line *list_head;
+	struct input_line saved;
 } input;
 
 /* Channel buffer */
@@ -180,13 +284,23 @@ typedef struct channel
 	int resized;
 	struct channel *next;
 	struct channel *prev;
+	unsigned int batch_lines;
 	struct line *buffer_head;
 	struct line buffer[SCROLLBACK_BUFFER];
 	struct avl_node *nicklist;
 	struct server *server;
+	char *key;
+	struct {
+		struct avl_node **nodes;
+		size_t len;
+		size_t size;
+	} names;
 	struct input *input;
 	struct {
+		int scrollable;
 		size_t nick_pad;
+		unsigned int appended;
+		unsigned int nick_pad_count[NICKSIZE];
 		struct line *scrollback;
 	} draw;
 } channel;
@@ -195,14 +309,16 @@ typedef struct channel
 typedef struct server
 {
 	char *host;
-	char input[BUFFSIZE];
+	char input[TAGSIZE + BUFFSIZE];
 	char *iptr;
 	char nick_me[NICKSIZE];
 	char *nptr;
 	char *port;
 	int soc;
 	int usermode;
-	struct avl_node *ignore;
+	struct ignore *ignore;
+	struct netsplit *netsplit;
+	struct avl_node *join_keys;
 	struct channel *channel;
 	struct server *next;
 	struct server *prev;
@@ -211,11 +327,50 @@ typedef struct server
 	time_t reconnect_delta;
 	time_t reconnect_time;
 	void *connecting;
+	int capture_id;
+	int replay;
+	unsigned int caps;
+	unsigned int caps_ls;
+	time_t history_time;
+	struct batch *batch;
+	struct highlight *highlight;
+	char highlight_nick[NICKSIZE];
+	struct isupport {
+		const unsigned char *casemap;
+		char chanmodes[4][ISUPPORT_SIZE];
+		char chantypes[ISUPPORT_SIZE];
+		char prefix_chars[ISUPPORT_SIZE];
+		char prefix_modes[ISUPPORT_SIZE];
+		unsigned int nicklen;
+		unsigned int targmax_join;
+	} isupport;
+	struct {
+		int tokens;
+		unsigned int count;
+		unsigned int total;
+		size_t offset;
+		time_t time;
+		struct sendq_line *head;
+		struct sendq_line *tail;
+	} sendq;
+	struct {
+		unsigned long parse_errors;
+		unsigned long recv_bytes;
+		unsigned long recv_filtered;
+		unsigned long recv_ignored;
+		unsigned long recv_lines;
+		unsigned long recv_types[RECV_T_SIZE];
+		unsigned long send_bytes;
+		unsigned long send_errors;
+		unsigned long send_lines;
+		unsigned int sendq_max;
+	} stats;
 } server;
 
 /* Parsed IRC message */
 typedef struct parsed_mesg
 {
+	char *tags;
 	char *from;
 	char *hostinfo;
 	char *command;
@@ -223,18 +378,35 @@ typedef struct parsed_mesg
 	char *trailing;
 } parsed_mesg;
 
+/* IRCv3 message tag, key and value point into the parsed message's tags and
+ * aren't null terminated. Values are unescaped on demand by tag_unescape() */
+typedef struct mesg_tag
+{
+	const char *key;
+	const char *val;
+	size_t key_len;
+	size_t val_len;
+} mesg_tag;
+
 /* rirc.c */
 channel *rirc;
 channel *ccur;
 
 /* net.c */
 int sendf(char*, server*, const char*, ...);
+int sendq_join(char*, server*, const char*, const char*);
+int sendq_privmsg(char*, server*, const char*, const char*);
 void check_servers(void);
+void free_capture(void);
+void init_capture(void);
 void server_connect(char*, char*);
 void server_disconnect(server*, int, int, char*);
 
 /* draw.c */
 unsigned int draw;
+unsigned int term_caps;
+int nick_col(const char*, const unsigned char*);
+void draw_bell(void);
 void redraw(channel*);
 #define draw(X) draw |= X
 #define D_RESIZE (1 << 0)
@@ -244,31 +416,109 @@ void redraw(channel*);
 #define D_STATUS (1 << 4)
 #define D_FULL ~((draw & 0) | D_RESIZE);
 
+/* Terminal capabilities */
+#define TERM_SCROLL (1 << 0) /* DECSTBM scrolling regions */
+#define TERM_SYNC   (1 << 1) /* Synchronized output, mode 2026 */
+#define TERM_REP    (1 << 2) /* REP, repeat the preceding character */
+#define TERM_RGB    (1 << 3) /* 24-bit colour */
+
+/* Redraw count and duration in microseconds */
+struct draw_stats
+{
+	unsigned long count;
+	histogram time;
+};
+
 /* input.c */
 char *action_message;
 input* new_input(void);
 void action(int(*)(char), const char*, ...);
 void free_input(input*);
+void free_history(void);
+void init_headless(void);
+void init_history(void);
+void poll_headless(void);
 void poll_input(void);
+void probe_term(void);
 
 /* utils.c */
+#define IGNORE_PRIVMSG (1 << 0)
+#define IGNORE_NOTICE  (1 << 1)
+#define IGNORE_CTCP    (1 << 2)
+#define IGNORE_JOIN    (1 << 3) /* JOIN, PART and QUIT lines */
+#define IGNORE_NICK    (1 << 4) /* NICK change lines */
+#define IGNORE_ALL     ((1 << 5) - 1)
+#define FILTER_PRIVMSG (1 << 0)
+#define FILTER_NOTICE  (1 << 1)
+#define FILTER_JOIN    (1 << 2)
+#define FILTER_PART    (1 << 3)
+#define FILTER_QUIT    (1 << 4)
+#define FILTER_NICK    (1 << 5)
+#define FILTER_ALL     ((1 << 6) - 1)
+struct filter;
+struct filter_mesg
+{
+	unsigned int type;
+	const char *chan;
+	unsigned long users;
+	const char *nick;
+	const char *hostinfo;
+	const char *text;
+};
 char* strdup(const char*);
-const avl_node* avl_get(avl_node*, const char*, size_t);
-int avl_add(avl_node**, const char*, void*);
-int avl_del(avl_node**, const char*);
-int check_pinged(char*, char*);
+extern const unsigned char casemap_ascii[256];
+extern const unsigned char casemap_rfc1459[256];
+extern const unsigned char casemap_strict_rfc1459[256];
+avl_node* avl_get(avl_node*, const unsigned char*, const char*, size_t);
+avl_node* avl_build(const unsigned char*, avl_node**, size_t*);
+avl_node* avl_new_node(const char*, void*);
+int avl_add(avl_node**, const unsigned char*, const char*, void*);
+int avl_del(avl_node**, const unsigned char*, const char*);
+int irc_strcmp(const unsigned char*, const char*, const char*);
+int irc_strncmp(const unsigned char*, const char*, const char*, size_t);
+unsigned long histogram_percentile(const histogram*, double);
+unsigned long long time_us(void);
+void histogram_add(histogram*, unsigned long);
 int parse(parsed_mesg*, char*);
+char* getarg(char**, int);
+int tag_get(const char*, const char*, mesg_tag*);
+int tag_next(const char**, mesg_tag*);
+size_t tag_unescape(char*, size_t, const mesg_tag*);
+time_t tag_time(const mesg_tag*);
 void auto_nick(char**, char*);
 void free_avl(avl_node*);
+const char* ignore_list(const struct ignore*, const void**, unsigned int*);
+int ignore_add(struct ignore**, const unsigned char*, const char*, unsigned int);
+int ignore_del(struct ignore**, const unsigned char*, const char*);
+int ignore_match(struct ignore*, const unsigned char*, unsigned int, const char*, const char*);
+void ignore_free(struct ignore*);
+struct highlight* highlight_compile(const unsigned char*, const char*);
+int highlight_match(const struct highlight*, const char*);
+void highlight_free(struct highlight*);
+const char* filter_add(struct filter**, const char*);
+int filter_del(struct filter**, unsigned int);
+const char* filter_list(const struct filter*, const void**, unsigned long*);
+unsigned int filter_types(const struct filter*);
+int filter_match(struct filter*, const unsigned char*, const struct filter_mesg*);
+void filter_free(struct filter*);
 
 /* mesg.c */
 avl_node* commands;
 void init_commands(void);
+void init_filters(void);
+void check_netsplits(server*, time_t);
+void free_netsplits(server*);
 void recv_mesg(char*, int, server*);
+void reset_isupport(server*);
 void send_mesg(char*);
 void send_paste(char*);
 
 /* state.c */
+struct batch *newline_batch;
+time_t newline_time;
+struct trace trace;
+void trace_line(line*, unsigned long long);
+int timestamp_width(const char*);
 channel* channel_close(channel*);
 channel* channel_get(char*, server*);
 channel* channel_switch(channel*, int);
@@ -277,6 +527,11 @@ void buffer_scrollback_line(channel*, int);
 void buffer_scrollback_page(channel*, int);
 void clear_channel(channel*);
 void free_channel(channel*);
+void reset_names(channel*);
 void newline(channel*, line_t, const char*, const char*);
 void newlinef(channel*, line_t, const char*, const char*, ...);
 void _newline(channel*, line_t, const char*, const char*, size_t);
+struct batch* batch_get(server*, const char*);
+void batch_end(server*, const char*);
+void batch_end_all(server*);
+void batch_start(server*, const char*);
@@ -2,6 +2,7 @@
  * using terminal using vt-100 compatible escape codes
  * */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,25 +31,75 @@
 #define CURSOR_SAVE    "\x1b[s"
 #define CURSOR_RESTORE "\x1b[u"
 
+/* Begin and end synchronized output, the terminal displays the frame between
+ * them at once */
+#define SYNC_BEGIN "\x1b[?2026h"
+#define SYNC_END   "\x1b[?2026l"
+
+/* Set the scrolling region to rows [T, B], or reset it to the full screen.
+ * Both move the cursor home */
+#define SCROLL_REGION(T, B) "\x1b["#T";"#B"r"
+#define SCROLL_RESET        "\x1b[r"
+
 static void resize(void);
+static void draw_separator(int);
+static void move_to(int, int);
+static void sgr_bg(int);
+static void sgr_fg(int);
 static void draw_buffer(channel*);
+static int draw_buffer_line(channel*, line*, int, int, int, int, unsigned long long);
 static void draw_chans(channel*);
 static void draw_input(channel*);
 static void draw_status(channel*);
 
 static char* word_wrap(int, char**, char*);
 static int count_line_rows(int, line*);
-static int nick_col(char*);
 
 struct winsize w;
 
+struct draw_stats draw_stats;
+
+/* Cursor row and colours set by the buffer being drawn, 0 and -2 when unknown.
+ * The cursor's column is never tracked */
+static int cursor_row;
+static int sgr_state[2];
+
+/* Set by draw_bell(), the bell is rung after the next frame is drawn */
+static int bell;
+
+/* The channel whose buffer is on screen, and the padding it was drawn with */
+static struct {
+	channel *c;
+	size_t nick_pad;
+	int time_pad;
+} buffer_drawn;
+
+/* Timestamps are padded to the widest the format gives, computed once per format */
+static struct {
+	const char *format;
+	int width;
+} time_format;
+
 static int nick_colours[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14};
 static int actv_cols[ACTIVITY_T_SIZE] = {239, 247, 3};
 
+void
+draw_bell(void)
+{
+	/* Ring the terminal bell, between frames rather than within one */
+
+	bell = 1;
+}
+
 void
 redraw(channel *c)
 {
-	if (!draw) return;
+	if (!draw && !bell) return;
+
+	unsigned long long start = time_us();
+
+	if (term_caps & TERM_SYNC)
+		printf(SYNC_BEGIN);
 
 	if (draw & D_RESIZE) resize();
 
@@ -59,7 +110,16 @@ redraw(channel *c)
 
 	draw = 0;
 
+	if (term_caps & TERM_SYNC)
+		printf(SYNC_END);
+
+	if (bell)
+		putchar('\a'), bell = 0;
+
 	fflush(stdout);
+
+	draw_stats.count++;
+	histogram_add(&draw_stats.time, time_us() - start);
 }
 
 static void
@@ -72,8 +132,7 @@ resize(void)
 	printf(CLEAR_FULL MOVE(2, 1) FG(239));
 
 	/* Draw upper separator */
-	for (int i = 0; i < w.ws_col; i++)
-		printf("―");
+	draw_separator(w.ws_col);
 
 	/* Draw bottom bar, set color back to default */
 	printf(MOVE(%d, 1) " >>> " FG(250), w.ws_row);
@@ -134,32 +193,58 @@ draw_buffer(channel *c)
 	 *
 	 * 4. Clear any remaining rows that might exist in the case where the lines
 	 *    in the channel's buffer are insufficient to fill all rows
+	 *
+	 * When lines are appended to a buffer last drawn full and at its bottom,
+	 * and still at its bottom with the same padding, the buffer's rows are
+	 * instead scrolled up by the rows of the new lines, and only they're drawn
 	 */
 
 	printf(CURSOR_SAVE);
 
+	/* Moves and colours are relative to the state this draw sets */
+	cursor_row = 0;
+	sgr_state[0] = sgr_state[1] = -2;
+
+	/* Traced lines are first displayed by this frame */
+	unsigned long long draw_time = time_us();
+
 	/* Establish current, min and max row for drawing */
 	int buffer_start = 3, buffer_end = w.ws_row - 2;
 	int print_row = buffer_start;
 	int max_row = buffer_end - buffer_start + 1;
 	int count_row = 0;
+	int time_pad = 0;
+
+	/* Whether lines appended since the last draw can be scrolled in, set again
+	 * only when this draw fills the buffer at its bottom */
+	int scrollable = c->draw.scrollable;
+
+	c->draw.scrollable = 0;
 
 	/* Insufficient rows for drawing */
 	if (buffer_end < buffer_start)
 		return;
 
-	/* (#terminal columns) - strlen((widest nick in c)) - strlen(" HH:MM   ~ ") */
-	int text_cols = w.ws_col - c->draw.nick_pad - 11;
+	line *tmp, *l = c->draw.scrollback;
 
-	/* Insufficient columns for drawing */
-	if (text_cols < 1)
+	/* Empty buffer */
+	if (l->text == NULL)
 		goto clear_remainder;
 
-	line *tmp, *l = c->draw.scrollback;
+	/* Timestamps are preformatted when lines are added, padded to a fixed width
+	 * so variable width formats stay aligned */
+	if (time_format.format != config.timestamp_format) {
+		time_format.format = config.timestamp_format;
+		time_format.width = timestamp_width(config.timestamp_format);
+	}
 
+	time_pad = time_format.width;
 
-	/* Empty buffer */
-	if (l->text == NULL)
+	/* (#terminal columns) - strlen((widest nick in c)) - strlen(" <time>   ~ ") */
+	int text_cols = w.ws_col - c->draw.nick_pad - time_pad - 6;
+
+	/* Insufficient columns for drawing */
+	if (text_cols < 1)
 		goto clear_remainder;
 
 	/* If the window has been resized, force all cached line rows to be recalculated */
@@ -168,6 +253,54 @@ draw_buffer(channel *c)
 			tmp->rows = 0;
 
 		c->resized = 0;
+		scrollable = 0;
+	}
+
+	/* Scroll in lines appended since the last draw */
+	if ((term_caps & TERM_SCROLL) && c->draw.appended && scrollable && l == c->buffer_head && buffer_drawn.c == c
+			&& buffer_drawn.nick_pad == c->draw.nick_pad && buffer_drawn.time_pad == time_pad
+			&& c->draw.appended < SCROLLBACK_BUFFER) {
+
+		unsigned int n = c->draw.appended;
+
+		/* Find the first appended line, and the rows required to draw them */
+		for (tmp = l;; tmp = (tmp == c->buffer) ? &c->buffer[SCROLLBACK_BUFFER - 1] : tmp - 1) {
+
+			if (tmp->rows == 0)
+				tmp->rows = count_line_rows(text_cols, tmp);
+
+			count_row += tmp->rows;
+
+			if (--n == 0 || count_row >= max_row)
+				break;
+		}
+
+		if (n == 0 && count_row < max_row) {
+
+			printf(SCROLL_REGION(%d, %d) MOVE(%d, 1), buffer_start, buffer_end, buffer_end);
+
+			for (print_row = 0; print_row < count_row; print_row++)
+				putchar('\n');
+
+			printf(SCROLL_RESET);
+
+			cursor_row = 1;
+
+			for (print_row = buffer_end - count_row + 1; print_row <= buffer_end;) {
+
+				print_row = draw_buffer_line(c, tmp, print_row, buffer_end, time_pad, text_cols, draw_time);
+
+				tmp = (tmp == &c->buffer[SCROLLBACK_BUFFER - 1]) ? c->buffer : tmp + 1;
+			}
+
+			c->draw.appended = 0;
+			c->draw.scrollable = 1;
+
+			printf(CURSOR_RESTORE);
+			return;
+		}
+
+		count_row = 0;
 	}
 
 	/* 1. Find top-most drawable line */
@@ -199,8 +332,12 @@ draw_buffer(channel *c)
 			word_wrap(text_cols, &ptr1, ptr2);
 
 		do {
-			printf(MOVE(%d, %d) CLEAR_LINE, print_row++, (int)c->draw.nick_pad + 10);
-			printf(FG(239) "~" FG(250) " ");
+			move_to(print_row++, (int)c->draw.nick_pad + time_pad + 5);
+			printf(CLEAR_LINE);
+			sgr_fg(239);
+			putchar('~');
+			sgr_fg(250);
+			putchar(' ');
 
 			char *print = ptr1;
 			char *wrap = word_wrap(text_cols, &ptr1, ptr2);
@@ -222,87 +359,113 @@ draw_buffer(channel *c)
 	/* 3. Draw all lines */
 	while (print_row <= buffer_end) {
 
-		/* Draw the main line segment */
-		printf(MOVE(%d, 1) CLEAR_LINE, print_row++);
+		print_row = draw_buffer_line(c, l, print_row, buffer_end, time_pad, text_cols, draw_time);
 
-		/* Main line segment format example:
-		 *
-		 * | 01:23  long_nick ~ hello world |
-		 * | 12:34        rcr ~ testing     |
-		 *
-		 * */
-		int from_fg = -1;
-		int from_bg = -1;
+		if (l == c->buffer_head)
+			break;
 
-		if (l->type == LINE_DEFAULT)
-			;
+		l = (l == &c->buffer[SCROLLBACK_BUFFER - 1]) ? c->buffer : l + 1;
 
-		else if (l->type == LINE_CHAT)
-			from_fg = nick_col(l->from);
+		if (l->text == NULL)
+			break;
+	}
 
-		else if (l->type == LINE_PINGED)
-			from_fg = 255, from_bg = 1;
+	/* Lines appended to a full buffer at its bottom can be scrolled in by the next draw */
+	c->draw.scrollable = (count_row >= max_row && c->draw.scrollback == c->buffer_head);
 
-		struct tm *tmp = localtime(&l->time);
+clear_remainder:
 
-		/* Timestamp and padding */
-		printf(FG(239) " %02d:%02d  %*s",
-				tmp->tm_hour, tmp->tm_min,
-				(int)(c->draw.nick_pad - strlen(l->from)), "");
+	/* 4. Clear any remaining rows */
+	while (print_row <= buffer_end) {
+		move_to(print_row++, 1);
+		printf(CLEAR_LINE);
+	}
 
-		/* Set foreground and background for the line sender */
-		if (from_fg >= 0)
-			printf(FG(%d), from_fg);
+	buffer_drawn.c = c;
+	buffer_drawn.nick_pad = c->draw.nick_pad;
+	buffer_drawn.time_pad = time_pad;
 
-		if (from_bg >= 0)
-			printf(BG(%d), from_bg);
+	c->draw.appended = 0;
 
-		/* Line sender and separator */
-		printf("%s" FG(239) BG_R " ~ " FG(250), l->from);
+	printf(CURSOR_RESTORE);
+}
 
-		char *ptr1 = l->text;
-		char *ptr2 = l->text + l->len;
+static int
+draw_buffer_line(channel *c, line *l, int print_row, int buffer_end, int time_pad, int text_cols, unsigned long long draw_time)
+{
+	/* Draw a buffer line from print_row, until drawn in full or reaching
+	 * buffer_end. Returns the row following the line */
 
-		char *print = ptr1;
-		char *wrap = word_wrap(text_cols, &ptr1, ptr2);
+	/* Draw the main line segment */
+	move_to(print_row++, 1);
+	printf(CLEAR_LINE);
 
-		while (print < wrap)
-			putchar(*print++);
+	/* Main line segment format example:
+	 *
+	 * | 01:23  long_nick ~ hello world |
+	 * | 12:34        rcr ~ testing     |
+	 *
+	 * */
+	int from_fg = -1;
+	int from_bg = -1;
 
-		if (print_row > buffer_end)
-			break;
+	if (l->type == LINE_DEFAULT)
+		;
 
-		/* Draw any line continuations */
-		while (*ptr1) {
-			printf(MOVE(%d, %d) CLEAR_LINE, print_row++, (int)c->draw.nick_pad + 10);
-			printf(FG(239) "~" FG(250) " ");
+	else if (l->type == LINE_CHAT)
+		from_fg = l->from_fg;
 
-			char *print = ptr1;
-			char *wrap = word_wrap(text_cols, &ptr1, ptr2);
+	else if (l->type == LINE_PINGED)
+		from_fg = 255, from_bg = 1;
 
-			while (print < wrap)
-				putchar(*print++);
+	/* Timestamp and padding */
+	sgr_fg(239);
+	printf(" %-*.*s  %*s", time_pad, time_pad, l->time_str,
+			(int)(c->draw.nick_pad - l->from_len), "");
 
-			if (print_row > buffer_end)
-				break;
-		}
+	/* Set foreground and background for the line sender */
+	if (from_fg >= 0)
+		sgr_fg(from_fg);
 
-		if (l == c->buffer_head)
-			break;
+	if (from_bg >= 0)
+		sgr_bg(from_bg);
 
-		l = (l == &c->buffer[SCROLLBACK_BUFFER - 1]) ? c->buffer : l + 1;
+	/* Line sender and separator */
+	printf("%s", l->from);
+	sgr_fg(239);
+	sgr_bg(-1);
+	printf(" ~ ");
+	sgr_fg(250);
 
-		if (l->text == NULL)
-			break;
-	}
+	if (l->trace.read)
+		trace_line(l, draw_time);
 
-clear_remainder:
+	char *ptr1 = l->text;
+	char *ptr2 = l->text + l->len;
 
-	/* 4. Clear any remaining rows */
-	while (print_row <= buffer_end)
-		printf(MOVE(%d, 1) CLEAR_LINE, print_row++);
+	char *print = ptr1;
+	char *wrap = word_wrap(text_cols, &ptr1, ptr2);
 
-	printf(CURSOR_RESTORE);
+	while (print < wrap)
+		putchar(*print++);
+
+	/* Draw any line continuations */
+	while (*ptr1 && print_row <= buffer_end) {
+		move_to(print_row++, (int)c->draw.nick_pad + time_pad + 5);
+		printf(CLEAR_LINE);
+		sgr_fg(239);
+		putchar('~');
+		sgr_fg(250);
+		putchar(' ');
+
+		char *print = ptr1;
+		char *wrap = word_wrap(text_cols, &ptr1, ptr2);
+
+		while (print < wrap)
+			putchar(*print++);
+	}
+
+	return print_row;
 }
 
 /* TODO:
@@ -440,12 +603,97 @@ draw_status(channel *c)
 	if (c->server && c->server->latency_delta)
 		i += printf("―(%llds)", (long long) c->server->latency_delta);
 
-	for (; i < w.ws_col; i++)
-		printf("―");
+	/* If ccur's server has queued messages, display send progress */
+	if (c->server && c->server->sendq.count)
+		i += printf("―(sending %u/%u)",
+				c->server->sendq.total - c->server->sendq.count, c->server->sendq.total) - 2;
+
+	draw_separator(w.ws_col - i);
 
 	printf(CURSOR_RESTORE);
 }
 
+static void
+draw_separator(int n)
+{
+	/* Draw n separator characters, repeated by the terminal when supported
+	 * and shorter than drawing each */
+
+	if (n < 1)
+		return;
+
+	printf("―");
+
+	if (n > 2 && (term_caps & TERM_REP))
+		printf("\x1b[%db", n - 1);
+	else while (--n)
+		printf("―");
+}
+
+static void
+move_to(int row, int col)
+{
+	/* Move the cursor to [row, col], relative to the previous move when
+	 * shorter, i.e. to the next row.
+	 *
+	 * The cursor is never moved past the last row, so the line feed doesn't
+	 * scroll, and the carriage return also clears a pending autowrap */
+
+	if (cursor_row && row == cursor_row + 1) {
+		if (col > 1)
+			printf("\r\n\x1b[%dC", col - 1);
+		else
+			printf("\r\n");
+	}
+	else if (col > 1)
+		printf(MOVE(%d, %d), row, col);
+	else
+		printf("\x1b[%dH", row);
+
+	cursor_row = row;
+}
+
+static void
+sgr_fg(int col)
+{
+	/* Set the foreground colour, or the default when < 0, with the shortest
+	 * SGR for the 16 basic colours, and only when changed */
+
+	if (sgr_state[0] == col)
+		return;
+
+	if (col < 0)
+		printf(FG_R);
+	else if (col < 8)
+		printf("\x1b[%dm", 30 + col);
+	else if (col < 16)
+		printf("\x1b[%dm", 90 + col - 8);
+	else
+		printf("\x1b[38;5;%dm", col);
+
+	sgr_state[0] = col;
+}
+
+static void
+sgr_bg(int col)
+{
+	/* Set the background colour, as sgr_fg() */
+
+	if (sgr_state[1] == col)
+		return;
+
+	if (col < 0)
+		printf(BG_R);
+	else if (col < 8)
+		printf("\x1b[%dm", 40 + col);
+	else if (col < 16)
+		printf("\x1b[%dm", 100 + col - 8);
+	else
+		printf("\x1b[48;5;%dm", col);
+
+	sgr_state[1] = col;
+}
+
 static char*
 word_wrap(int text_cols, char **ptr1, char *ptr2)
 {
@@ -518,13 +766,19 @@ count_line_rows(int text_cols, line *l)
 	return count;
 }
 
-static int
-nick_col(char *nick)
+int
+nick_col(const char *nick, const unsigned char *casemap)
 {
-	int colour = 0;
+	/* Case folded FNV-1a hash of a nick, mapped to a colour
+	 *
+	 * Called once per line when it's added to a buffer */
 
-	while (*nick)
-		colour += *nick++;
+	unsigned int hash = 2166136261u;
+
+	while (*nick) {
+		hash ^= casemap[(unsigned char) *nick++];
+		hash *= 16777619u;
+	}
 
-	return nick_colours[colour % sizeof(nick_colours) / sizeof(nick_colours[0])];
+	return nick_colours[hash % (sizeof(nick_colours) / sizeof(nick_colours[0]))];
 }
@@ -5,47 +5,186 @@
  * All input is handled synchronously and refers to the current
  * channel being drawn (ccur)
  *
- * A buffer input line consists of a doubly linked list of gap buffers
+ * In headless mode, input is instead read line by line from the FIFO
+ * config.headless, each line handled as if typed and sent
+ *
+ * A buffer input line consists of a gap buffer, input history is shared
+ * by all buffers and persisted to config.history_file
+ *
+ * Terminal input is decoded as a byte stream, escape sequences and pastes
+ * may be split across reads, and a single read may hold many keys.
  *
  * Escape sequences are assumed to be ANSI. As such, you mileage may vary
  * */
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "common.h"
 
-/* Max number of characters accepted in user pasted input */
-#define MAX_PASTE 2048
+/* Max number of characters read from stdin at once */
+#define MAX_READ 2048
+
+/* Max length of a control sequence, longer sequences are discarded */
+#define MAX_SEQ 32
+
+/* Time waited for the remainder of a partial escape sequence. On timeout
+ * it's discarded, e.g. a single press of the escape key */
+#define SEQ_TIMEOUT_MS 50
 
-/* Max number of lines that can result from a paste */
-#define MAX_PASTE_LINES 128
+/* Time waited for the terminal to answer capability queries */
+#define PROBE_TIMEOUT_MS 500
+
+/* Terminal capability queries, answered in order:
+ *
+ *   DECRQM ?2026     synchronized output, answered CSI ? 2026 ; 1|2 $ y if supported
+ *   XTGETTCAP rep    answered DCS 1 + r 726570 ... ST if supported
+ *   XTGETTCAP RGB    answered DCS 1 + r 524742 ... ST if supported
+ *   DA1              answered CSI ? ... c by any VT100 compatible terminal */
+#define PROBE_DECRQM_SYNC "\x1b[?2026$p"
+#define PROBE_XTGETTCAP   "\x1bP+q726570\x1b\\" "\x1bP+q524742\x1b\\"
+#define PROBE_DA1         "\x1b[c"
 
 /* Max length of user action message */
 #define MAX_ACTION_MESG 256
 
+/* Bracketed paste mode markers, sent by the terminal around pasted text */
+#define PASTE_START "\x1b[200~"
+#define PASTE_END   "\x1b[201~"
+
+/* Input history dedup hash table and substring index sizes, must be powers of 2 */
+#define HISTORY_TABLE_SIZE (1 << 16)
+#define HISTORY_INDEX_SIZE (1 << 14)
+
+/* Max length of a history search */
+#define MAX_HISTORY_SEARCH 64
+
 /* Defined in draw.c */
 extern struct winsize w;
 
+/* Input history entry, text is stored null terminated in the history arena */
+struct history_entry
+{
+	int deleted;
+	size_t len;
+	size_t offset;
+	unsigned int hash;
+	unsigned int next;
+	unsigned long seq;
+};
+
+/* List of history entries containing a trigram, in ascending order */
+struct history_posting
+{
+	unsigned int *ids;
+	unsigned int len;
+	unsigned int size;
+};
+
+/* Input history, shared by all channels
+ *
+ * Entries are appended in order, deleted entries are compacted once they
+ * outnumber live entries. Sequence numbers identify entries across compaction.
+ *
+ *  - Duplicates are found by hash chains, a duplicate entry is deleted and
+ *    the text appended as the most recent entry
+ *  - Substring search uses an index of each entry's trigrams, only entries
+ *    containing the rarest trigram of the search are compared */
+static struct
+{
+	char *text;
+	size_t text_len;
+	size_t text_size;
+	struct history_entry *entries;
+	unsigned int count;
+	unsigned int live;
+	unsigned int oldest;
+	unsigned int size;
+	unsigned long seq;
+	unsigned int table[HISTORY_TABLE_SIZE];
+	struct history_posting index[HISTORY_INDEX_SIZE];
+	FILE *file;
+} history;
+
+#define TRIGRAM(P) \
+	((((unsigned char)(P)[0] * 31u + (unsigned char)(P)[1]) * 31u + (unsigned char)(P)[2]) \
+		& (HISTORY_INDEX_SIZE - 1))
+
 /* Static buffer that accepts input from stdin */
-static char input_buff[MAX_PASTE];
+static char input_buff[MAX_READ];
 
-/* Buffer to hold paste message while waiting for confirmation, includes room for \r\n */
-static char paste_buff[MAX_INPUT + MAX_PASTE + (2 * MAX_PASTE_LINES)];
-static size_t paste_len;
+/* Headless mode command FIFO, and the partial line read from it */
+static int headless_fd = -1;
+static char headless_buff[BUFFSIZE];
+static size_t headless_len;
+
+/* Growable buffer, used for accumulating pasted input and rendered pastes */
+struct paste_buffer
+{
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* Raw bracketed paste input, accumulated across reads until PASTE_END */
+static struct paste_buffer paste_raw;
+static size_t paste_end_match;
+
+/* Terminal input decoder state, kept across reads:
+ *
+ *   INPUT_GROUND  text and single byte control characters
+ *   INPUT_ESC     following an escape character
+ *   INPUT_CSI     a control sequence, ESC [ parameters intermediates final
+ *   INPUT_SS3     ESC O final, cursor keys in application mode
+ *   INPUT_MOUSE   the 3 bytes of an X10 mouse report, following CSI M
+ *   INPUT_STRING  DCS, OSC, PM, APC and SOS strings, discarded until ST or BEL
+ *   INPUT_PASTE   bracketed paste, accumulated until PASTE_END
+ *
+ * Control sequences are kept in seq_buff, as "[" parameters intermediates
+ * final, with the same form for SS3 keys */
+static enum {
+	INPUT_GROUND,
+	INPUT_ESC,
+	INPUT_CSI,
+	INPUT_SS3,
+	INPUT_MOUSE,
+	INPUT_STRING,
+	INPUT_PASTE
+} input_state;
+
+static char seq_buff[MAX_SEQ + 1];
+static size_t seq_len;
+static int string_esc;
+
+/* Rendered paste message while waiting for confirmation, lines separated by \r\n */
+static struct paste_buffer paste_buff;
+
+static void paste_append(struct paste_buffer*, char);
+static size_t paste_stream(char*, size_t);
+
+/* Terminal input decoding */
+static void input_decode(char*, size_t);
+static size_t input_text(char*, size_t);
+static int input_printable(char);
+static void seq_append(char);
 
 /* User input handlers */
 static int input_char(char);
+static void input_insert(const char*, size_t);
 static void input_cchar(char);
-static void input_cseq(char*, ssize_t);
-static void input_paste(char*, ssize_t);
-static void input_action(char*, ssize_t);
+static void input_cseq(const char*, size_t);
+static void input_key(char);
+static void input_paste(char*, size_t);
+static void input_action(char);
 
 /* Action handling */
 static int (*action_handler)(char);
@@ -75,7 +214,19 @@ static inline void input_scroll_forwards(input*);
 static inline void reset_line(input*);
 static inline void reframe_line(input*);
 
-static void new_list_head(input*);
+/* Input history */
+static int history_find(unsigned long);
+static int history_search(const char*, int);
+static FILE* history_open(const char*, int, const char*);
+static int history_secret(const char*);
+static void history_add(const char*, size_t, int);
+static void history_compact(void);
+static void history_delete(unsigned int);
+static void history_insert(const char*, size_t, unsigned int);
+static void input_load(input*, const char*);
+
+/* Reverse incremental history search */
+static int action_history_search(char);
 
 input*
 new_input(void)
@@ -85,7 +236,14 @@ new_input(void)
 	if ((i = calloc(1, sizeof(*i))) == NULL)
 		fatal("calloc");
 
-	new_list_head(i);
+	if ((i->line = calloc(1, sizeof(*i->line))) == NULL)
+		fatal("calloc");
+
+	/* Gap buffer pointers */
+	i->head = i->line->text;
+	i->tail = i->line->text + MAX_INPUT;
+
+	i->window = i->line->text;
 
 	return i;
 }
@@ -93,92 +251,437 @@ new_input(void)
 void
 free_input(input *i)
 {
-	/* Free an input and all of it's lines */
+	/* Free an input and it's line */
 
-	input_line *t, *l = i->list_head;
+	free(i->line);
+	free(i);
+}
 
-	do {
-		t = l;
-		l = l->next;
-		free(t);
-	} while (l != i->list_head);
+void
+init_headless(void)
+{
+	/* Open the headless mode command FIFO, creating it if it doesn't exist.
+	 *
+	 * It's opened for reading and writing so that it never reads EOF when
+	 * the last writer closes */
 
-	free(i);
+	if (mkfifo(config.headless, 0600) < 0 && errno != EEXIST)
+		fatal("mkfifo");
+
+	if ((headless_fd = open(config.headless, O_RDWR | O_NONBLOCK)) < 0)
+		fatal("open");
 }
 
-static void
-new_list_head(input *i)
+void
+poll_headless(void)
 {
-	/* Append a new line as the list_head */
+	/* Poll the command FIFO, sending each complete line as if it were typed
+	 * into the current channel's input, sleep 200ms */
 
-	input_line *l;
+	int ret;
+	int timeout_ms = 200;
 
-	if ((l = calloc(1, sizeof(*l))) == NULL)
-		fatal("calloc");
+	struct pollfd fifo_fd[] = {{ .fd = headless_fd, .events = POLLIN }};
 
-	DLL_ADD(i->list_head, l);
+	if ((ret = poll(fifo_fd, 1, timeout_ms)) < 0 && errno != EINTR)
+		fatal("poll");
 
-	i->line = i->list_head = l;
+	if (ret <= 0)
+		return;
 
-	/* Gap buffer pointers */
-	i->head = l->text;
-	i->tail = l->text + MAX_INPUT;
+	ssize_t i, count;
+
+	if ((count = read(headless_fd, input_buff, MAX_READ)) < 0) {
+
+		if (errno != EINTR && errno != EAGAIN)
+			fatal("read");
+
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+
+		char c = input_buff[i];
+
+		if (c == '\n' || c == '\r') {
+
+			if (headless_len == 0)
+				continue;
+
+			headless_buff[headless_len] = '\0';
+			headless_len = 0;
 
-	i->window = l->text;
+			send_mesg(headless_buff);
+
+		/* Lines exceeding the max message length are truncated */
+		} else if (input_printable(c) && headless_len < MAX_INPUT) {
+			headless_buff[headless_len++] = c;
+		}
+	}
 }
 
 void
-poll_input(void)
+probe_term(void)
 {
-	/* Poll stdin for user input. 4 cases:
+	/* Probe the terminal's capabilities, once at startup in raw mode.
 	 *
-	 * 1. A single printable character
-	 * 2. A single byte control character
-	 * 3. A multibyte control sequence
-	 * 4. Pasted input (up to MAX_PASTE characters)
+	 * The DA1 reply ends the probe, any replies before it are checked for
+	 * support of the other queries. Terminals not answering DA1 within
+	 * PROBE_TIMEOUT_MS are assumed to support none, and any input read
+	 * meanwhile is discarded */
+
+	char buff[512], *ptr;
+	const char *term = getenv("TERM"), *colorterm = getenv("COLORTERM");
+	int ret, timeout_ms = PROBE_TIMEOUT_MS;
+	size_t len = 0;
+	unsigned long long start = time_us();
+
+	struct pollfd stdin_fd[] = {{ .fd = STDIN_FILENO, .events = POLLIN }};
+
+	/* Truecolor is commonly advertised by environment rather than terminfo */
+	if (colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit")))
+		term_caps |= TERM_RGB;
+
+	if (term && !strcmp(term, "dumb"))
+		return;
+
+	/* The linux console parses DCS as a palette change */
+	if (term && !strncmp(term, "linux", 5))
+		printf(PROBE_DECRQM_SYNC PROBE_DA1);
+	else
+		printf(PROBE_DECRQM_SYNC PROBE_XTGETTCAP PROBE_DA1);
+
+	fflush(stdout);
+
+	while (timeout_ms > 0 && len < sizeof(buff) - 1) {
+
+		if ((ret = poll(stdin_fd, 1, timeout_ms)) < 0 && errno != EINTR)
+			fatal("poll");
+
+		if (ret > 0 && (ret = read(STDIN_FILENO, buff + len, sizeof(buff) - 1 - len)) == 0)
+			break;
+
+		if (ret > 0) {
+
+			len += ret;
+			buff[len] = '\0';
+
+			/* DA1 reply, CSI ? *( digit / ";" ) c */
+			for (ptr = buff; (ptr = strstr(ptr, "\x1b[?")); ptr++) {
+
+				char *end = ptr + 3;
+
+				while (isdigit(*end) || *end == ';')
+					end++;
+
+				if (*end == 'c') {
+
+					term_caps |= TERM_SCROLL;
+
+					if (strstr(buff, "\x1b[?2026;1$y") || strstr(buff, "\x1b[?2026;2$y"))
+						term_caps |= TERM_SYNC;
+
+					if (strstr(buff, "\x1bP1+r726570"))
+						term_caps |= TERM_REP;
+
+					if (strstr(buff, "\x1bP1+r524742"))
+						term_caps |= TERM_RGB;
+
+					return;
+				}
+			}
+		}
+
+		timeout_ms = PROBE_TIMEOUT_MS - (int)((time_us() - start) / 1000);
+	}
+}
+
+void
+poll_input(void)
+{
+	/* Poll stdin for user input, and decode everything pending as one batch.
 	 *
-	 * Pastes should be sanitized of unprintable characters and split into
-	 * lines by \n characters or by MAX_INPUT. The user is warned about
-	 * pastes exceeding a single line before sending. */
+	 * A partial escape sequence left by the previous read is waited on for
+	 * at most SEQ_TIMEOUT_MS, otherwise poll for 200ms */
 
 	int ret;
 	int timeout_ms = 200;
+	size_t len = 0;
+	ssize_t count;
 
 	struct pollfd stdin_fd[] = {{ .fd = STDIN_FILENO, .events = POLLIN }};
 
+	if (input_state != INPUT_GROUND && input_state != INPUT_PASTE)
+		timeout_ms = SEQ_TIMEOUT_MS;
+
 	if ((ret = poll(stdin_fd, 1, timeout_ms)) < 0 && errno != EINTR)
 		fatal("poll");
 
-	if (ret > 0) {
+	if (ret == 0 && timeout_ms == SEQ_TIMEOUT_MS) {
+		input_state = INPUT_GROUND;
+		return;
+	}
 
-		ssize_t count;
+	/* Read until the buffer is full or no more input is pending */
+	while (ret > 0 && len < MAX_READ) {
 
-		if ((count = read(STDIN_FILENO, input_buff, MAX_PASTE)) < 0 && errno != EINTR)
+		if ((count = read(STDIN_FILENO, input_buff + len, MAX_READ - len)) < 0 && errno != EINTR)
 			fatal("read");
 
 		if (count == 0)
 			fatal("stdin closed");
 
-		/* Waiting for user action, ignore everything else */
-		 if (action_message)
-			input_action(input_buff, count);
+		if (count > 0)
+			len += count;
+
+		if ((ret = poll(stdin_fd, 1, 0)) < 0 && errno != EINTR)
+			fatal("poll");
+	}
+
+	input_decode(input_buff, len);
+}
+
+static void
+input_decode(char *input, size_t len)
+{
+	/* Decode terminal input into keys, control sequences and pastes,
+	 * continuing from the state left by the previous call. Events only
+	 * set what's to be drawn, a batch is redrawn once */
+
+	char *end = input + len;
+
+	while (input < end) {
+
+		char c = *input;
+
+		switch (input_state) {
+
+			case INPUT_GROUND:
+				if (c == 0x1b) {
+					input_state = INPUT_ESC;
+					input++;
+				} else {
+					input += input_text(input, end - input);
+				}
+				break;
+
+			case INPUT_ESC:
+				input++;
+				seq_len = 0;
+				seq_append('[');
+
+				if (c == '[')
+					input_state = INPUT_CSI;
+				else if (c == 'O')
+					input_state = INPUT_SS3;
+				else if (c == 'P' || c == ']' || c == '^' || c == '_' || c == 'X')
+					input_state = INPUT_STRING, string_esc = 0;
+				else if (c != 0x1b)
+					/* Alt modified keys are ignored */
+					input_state = INPUT_GROUND;
+				break;
+
+			case INPUT_CSI:
+				/* Control characters abort the sequence */
+				if (iscntrl((unsigned char) c)) {
+					input_state = INPUT_GROUND;
+					break;
+				}
+
+				input++;
+				seq_append(c);
+
+				/* Continue until the final byte */
+				if (c < 0x40 || c > 0x7e)
+					break;
+
+				if (!strcmp(seq_buff, "[M")) {
+					input_state = INPUT_MOUSE;
+				} else if (!strcmp(seq_buff, PASTE_START + 1)) {
+					input_state = INPUT_PASTE;
+					paste_raw.len = 0;
+					paste_end_match = 0;
+				} else {
+					input_state = INPUT_GROUND;
+					input_cseq(seq_buff, seq_len);
+				}
+				break;
+
+			case INPUT_SS3:
+				input++;
+				seq_append(c);
+				input_state = INPUT_GROUND;
+				input_cseq(seq_buff, seq_len);
+				break;
+
+			case INPUT_MOUSE:
+				input++;
+				seq_append(c);
+
+				if (seq_len == strlen("[M") + 3) {
+					input_state = INPUT_GROUND;
+					input_cseq(seq_buff, seq_len);
+				}
+				break;
+
+			case INPUT_STRING:
+				input++;
+
+				if ((string_esc && c == '\\') || c == 0x07)
+					input_state = INPUT_GROUND;
+				else
+					string_esc = (c == 0x1b);
+				break;
+
+			case INPUT_PASTE:
+				input += paste_stream(input, end - input);
+				break;
+		}
+	}
+}
+
+static size_t
+input_text(char *input, size_t len)
+{
+	/* Input the text at the start of the input, returns the number of
+	 * bytes consumed. 4 cases:
+	 *
+	 * 1. A single printable character, or single byte control character
+	 * 2. Characters typed faster than they're read, or a multi-byte character
+	 * 3. Pasted input, when the terminal doesn't support bracketed paste
+	 *
+	 * Text is a run of printable characters, including UTF-8 sequences and
+	 * tabs and line feeds between them. A run containing either of the latter
+	 * is taken as pasted, otherwise tabs and line feeds are keys */
 
-		/* Case 1 */
-		else if (count == 1 && isprint(*input_buff))
-			input_char(*input_buff);
+	size_t i, paste = 0;
 
-		/* Case 2 */
-		else if (count == 1 && iscntrl(*input_buff))
-			input_cchar(*input_buff);
+	for (i = 0; i < len; i++) {
 
-		/* Case 3 */
-		else if (*input_buff == 0x1b)
-			input_cseq(input_buff, count);
+		if (input_printable(input[i]))
+			continue;
 
-		/* Case 4 */
-		else if (count > 1)
-			input_paste(input_buff, count);
+		if (i && (input[i] == '\t' || input[i] == '\n') && i + 1 < len && input_printable(input[i + 1])) {
+			paste = 1;
+			continue;
+		}
+
+		break;
+	}
+
+	/* Case 1, control character */
+	if (i == 0) {
+		input_key(input[0]);
+		return 1;
+	}
+
+	/* Case 3 */
+	if (paste) {
+		/* Pastes while waiting for user action are ignored */
+		if (!action_message)
+			input_paste(input, i);
+	}
+
+	/* Case 2, each character is given to a user action, which may resolve
+	 * before the run's end */
+	else if (action_message) {
+		for (size_t j = 0; j < i; j++)
+			input_key(input[j]);
+	}
+
+	/* Case 2, inserted or split as a paste when exceeding the input line */
+	else if (i > 1) {
+		input_paste(input, i);
+	}
+
+	else {
+		input_char(input[0]);
+	}
+
+	return i;
+}
+
+static int
+input_printable(char c)
+{
+	/* Printable ASCII, or any byte of a UTF-8 sequence, which is kept as text */
+
+	return isprint((unsigned char) c) || (unsigned char) c >= 0x80;
+}
+
+static void
+seq_append(char c)
+{
+	/* Append a byte to the current control sequence, an overlong sequence
+	 * is kept truncated and never matches a known sequence */
+
+	if (seq_len < MAX_SEQ)
+		seq_buff[seq_len++] = c;
+
+	seq_buff[seq_len] = '\0';
+}
+
+static void
+paste_append(struct paste_buffer *p, char c)
+{
+	/* Append a character to a paste buffer, growing it as needed */
+
+	if (p->len == p->size) {
+
+		p->size = (p->size) ? p->size * 2 : MAX_READ;
+
+		if ((p->buf = realloc(p->buf, p->size)) == NULL)
+			fatal("realloc");
 	}
+
+	p->buf[p->len++] = c;
+}
+
+static size_t
+paste_stream(char *input, size_t len)
+{
+	/* Accumulate bracketed paste input until the end marker is found, returns
+	 * the number of bytes consumed.
+	 *
+	 * The end marker may be split across reads, so partial matches are tracked
+	 * between calls. Input following the end marker is left to be decoded */
+
+	const char *end = PASTE_END;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+
+		char c = input[i];
+
+		if (c == end[paste_end_match]) {
+
+			if (end[++paste_end_match] != '\0')
+				continue;
+
+			input_state = INPUT_GROUND;
+
+			/* Pastes while waiting for user action are ignored */
+			if (!action_message)
+				input_paste(paste_raw.buf, paste_raw.len);
+
+			return i + 1;
+		}
+
+		/* Partial match failed, the matched characters were pasted input */
+		if (paste_end_match) {
+			for (size_t i = 0; i < paste_end_match; i++)
+				paste_append(&paste_raw, end[i]);
+
+			paste_end_match = (c == *end);
+
+			if (paste_end_match)
+				continue;
+		}
+
+		paste_append(&paste_raw, c);
+	}
+
+	return len;
 }
 
 /*
@@ -201,6 +704,24 @@ input_char(char c)
 	return 1;
 }
 
+static void
+input_insert(const char *text, size_t len)
+{
+	/* Input text up to the gap buffer's space, without splitting a UTF-8 sequence */
+
+	size_t space = ccur->input->tail - ccur->input->head;
+
+	if (len > space) {
+		len = space;
+
+		while (len && ((unsigned char) text[len] & 0xC0) == 0x80)
+			len--;
+	}
+
+	while (len--)
+		input_char(*text++);
+}
+
 static void
 input_cchar(char c)
 {
@@ -230,6 +751,12 @@ input_cchar(char c)
 				action(action_find_channel, "Find: ");
 			break;
 
+		/* ^R */
+		case 0x12:
+			/* Search input history */
+			action(action_history_search, "History: ");
+			break;
+
 		/* ^L */
 		case 0x0C:
 			/* Clear current channel */
@@ -257,61 +784,74 @@ input_cchar(char c)
 }
 
 static void
-input_cseq(char *input, ssize_t len)
+input_cseq(const char *seq, size_t len)
 {
-	/* Input a multibyte control sequence */
+	/* Input a control sequence, in the form "[" parameters intermediates final.
+	 * Sequences are ignored while waiting for user action, as are unknown
+	 * sequences and any replies to terminal queries */
 
-	/* Skip comparing the escape character */
-	input++;
-	if (--len == 0)
+	UNUSED(len);
+
+	if (action_message)
 		return;
 
 	/* arrow up */
-	else if (!strncmp(input, "[A", len))
+	if (!strcmp(seq, "[A"))
 		input_scroll_backwards(ccur->input);
 
 	/* arrow down */
-	else if (!strncmp(input, "[B", len))
+	else if (!strcmp(seq, "[B"))
 		input_scroll_forwards(ccur->input);
 
 	/* arrow right */
-	else if (!strncmp(input, "[C", len))
+	else if (!strcmp(seq, "[C"))
 		cursor_right(ccur->input);
 
 	/* arrow left */
-	else if (!strncmp(input, "[D", len))
+	else if (!strcmp(seq, "[D"))
 		cursor_left(ccur->input);
 
 	/* delete */
-	else if (!strncmp(input, "[3~", len))
+	else if (!strcmp(seq, "[3~"))
 		delete_right(ccur->input);
 
 	/* FIXME: scrollback disabled while it's reworked */
 #if 0
 	/* page up */
-	else if (!strncmp(input, "[5~", len))
+	else if (!strcmp(seq, "[5~"))
 		buffer_scrollback_page(ccur, 1);
 
 	/* page down */
-	else if (!strncmp(input, "[6~", len))
+	else if (!strcmp(seq, "[6~"))
 		buffer_scrollback_page(ccur, 0);
 
 	/* mousewheel up */
-	else if (!strncmp(input, "[M`", len))
+	else if (len == 5 && !strncmp(seq, "[M`", 3))
 		buffer_scrollback_line(ccur, 1);
 
 	/* mousewheel down */
-	else if (!strncmp(input, "[Ma", len))
+	else if (len == 5 && !strncmp(seq, "[Ma", 3))
 		buffer_scrollback_line(ccur, 0);
 #endif
 }
 
-/* TODO:
- *
- * Rather than render with \r\n, separate messages with \0. The handler for this will
- * will iterate over it and call sendf & _newline */
 static void
-input_paste(char *paste, ssize_t len)
+input_key(char c)
+{
+	/* Input a single key, given to the user action when waiting for one */
+
+	if (action_message)
+		input_action(c);
+
+	else if (input_printable(c))
+		input_char(c);
+
+	else
+		input_cchar(c);
+}
+
+static void
+input_paste(char *paste, size_t len)
 {
 	/* Input pasted text and render a buffer of messages that will be sent if confirmed */
 
@@ -321,8 +861,7 @@ input_paste(char *paste, ssize_t len)
 	 */
 	if (*ccur->input->line->text == '/') {
 
-		while (len && input_char(*paste))
-			len--, paste++;
+		input_insert(paste, len);
 
 		return;
 	}
@@ -330,11 +869,11 @@ input_paste(char *paste, ssize_t len)
 	/* Determine how many lines would be required for the paste, confirm with user
 	 *
 	 * Where each message will be:
-	 *   `PRIVMESG <target> :<mesg>\r\n`
+	 *   `PRIVMSG <target> :<mesg>\r\n`
 	 */
 
 	/* Max number of characters per message that can be sent to this target */
-	size_t max_len = BUFFSIZE - strlen("PRIVMESG  :\r\n") - strlen(ccur->name);
+	size_t max_len = BUFFSIZE - strlen("PRIVMSG  :\r\n") - strlen(ccur->name);
 
 	/* Get the number of characters currently on the input line's gap buffer */
 	size_t input_len = (ccur->input->head - ccur->input->line->text)
@@ -342,10 +881,9 @@ input_paste(char *paste, ssize_t len)
 
 	/* If there are no \n characters in the paste and (head + paste + tail) fits in one
 	 * input line, insert the paste and skip the rest of the processing */
-	if ((input_len + len) <= max_len && !strchr(paste, '\n')) {
+	if ((input_len + len) <= max_len && !memchr(paste, '\n', len)) {
 
-		while (len && input_char(*paste))
-			len--, paste++;
+		input_insert(paste, len);
 
 		return;
 	}
@@ -357,13 +895,15 @@ input_paste(char *paste, ssize_t len)
 	 *
 	 * The paste body should be scanned for \n, the head and tail can be assumed to contain none
 	 */
-	char *input_ptr, *paste_ptr = paste_buff;
+	char *input_ptr;
 
 	int line_count = 1;
 
+	paste_buff.len = 0;
+
 	/* Copy the input head to the paste buffer */
 	for (input_ptr = ccur->input->line->text; input_ptr < ccur->input->head; input_ptr++)
-		*paste_ptr++ = *input_ptr;
+		paste_append(&paste_buff, *input_ptr);
 
 	/* Initial length is the input head's count */
 	size_t line_len = ccur->input->head - ccur->input->line->text;
@@ -375,63 +915,61 @@ input_paste(char *paste, ssize_t len)
 		if (*input_ptr == '\n' || line_len == max_len) {
 
 			/* Dedupe \n characters to avoid sending empty lines */
-			if (*paste_ptr == '\n')
+			if (line_len == 0)
 				continue;
 
 			line_count++;
 
-			*paste_ptr++ = '\r';
-			*paste_ptr++ = '\n';
+			paste_append(&paste_buff, '\r');
+			paste_append(&paste_buff, '\n');
 
 			line_len = 0;
 
-			if (line_count == MAX_PASTE_LINES) {
-				newlinef(ccur, 0, "-!!-",
-						"MAX_PASTE_LINES (%d) encountered, discarding excess", MAX_PASTE_LINES);
+			if (*input_ptr == '\n')
+				continue;
+		}
 
-				/* Goto send_paste to avoid adding the tail to the paste */
-				goto send_paste;
-			}
-		} else {
-			*paste_ptr++ = *input_ptr;
+		/* Sanitize control characters, UTF-8 sequences are kept */
+		if (input_printable(*input_ptr) || *input_ptr == '\t') {
+			paste_append(&paste_buff, (*input_ptr == '\t') ? ' ' : *input_ptr);
+			line_len++;
 		}
 	}
 
-	/* Copy the input tail to the paste buffer
-	 *
-	 * Since line_count is at least < MAX_PASTE_LINES there will always  be enough
-	 * for the tail, though it may be be split at least once more
-	 */
-	for (input_ptr = ccur->input->tail; input_ptr < ccur->input->head; input_ptr++) {
+	/* Copy the input tail to the paste buffer, it may be split at least once more */
+	for (input_ptr = ccur->input->tail; input_ptr < ccur->input->line->text + MAX_INPUT; input_ptr++) {
 
 		if (line_len == max_len) {
 			line_count++;
 
-			*paste_ptr++ = '\r';
-			*paste_ptr++ = '\n';
+			paste_append(&paste_buff, '\r');
+			paste_append(&paste_buff, '\n');
 
 			line_len = 0;
 		}
 
-		*paste_ptr++ = *input_ptr;
+		paste_append(&paste_buff, *input_ptr);
 		line_len++;
 	}
 
-send_paste:
+	/* A trailing \n leaves an empty last line */
+	if (line_len == 0 && paste_buff.len) {
+		line_count--;
+		paste_buff.len -= 2;
+	}
 
-	/* Store the paste length */
-	paste_len = paste_ptr - paste_buff;
+	paste_append(&paste_buff, '\0');
 
 	/* Confirm sending the paste */
 	action(action_send_paste, "Confirm sending %d lines? [y/n]", line_count);
 }
 
 static void
-input_action(char *input, ssize_t len)
+input_action(char c)
 {
 	/* Waiting for user confirmation */
 
-	if (len == 1 && action_handler(*input)) {
+	if (action_handler(c)) {
 
 		action_message = NULL;
 		action_handler = NULL;
@@ -514,17 +1052,27 @@ input_scroll_backwards(input *in)
 {
 	/* Scroll backwards through the input history */
 
+	int i;
+
+	/* Scrolling from the working line starts at the most recent entry */
+	if (in->history == 0)
+		i = history_search("", history.count);
+	else
+		i = history_search("", history_find(in->history));
+
 	/* Scrolling backwards on the last line */
-	if (in->line->prev == in->list_head)
+	if (i < 0)
 		return;
 
-	reset_line(in);
-
-	in->line = in->line->prev;
+	/* Keep the working line, it's restored when scrolling forwards past the first line */
+	if (in->history == 0) {
+		reset_line(in);
+		strcpy(in->saved.text, in->line->text);
+	}
 
-	reframe_line(in);
+	in->history = history.entries[i].seq;
 
-	draw(D_INPUT);
+	input_load(in, history.text + history.entries[i].offset);
 }
 
 static inline void
@@ -532,17 +1080,27 @@ input_scroll_forwards(input *in)
 {
 	/* Scroll forwards through the input history */
 
-	/* Scrolling forward on the first line */
-	if (in->line == in->list_head)
-		return;
+	unsigned int i;
 
-	reset_line(in);
+	/* Scrolling forward on the working line */
+	if (in->history == 0)
+		return;
 
-	in->line = in->line->next;
+	/* Find the next live entry, or the working line */
+	if ((i = history_find(in->history)) < history.count && history.entries[i].seq == in->history)
+		i++;
 
-	reframe_line(in);
+	for (; i < history.count; i++)
+		if (!history.entries[i].deleted)
+			break;
 
-	draw(D_INPUT);
+	if (i < history.count) {
+		in->history = history.entries[i].seq;
+		input_load(in, history.text + history.entries[i].offset);
+	} else {
+		in->history = 0;
+		input_load(in, in->saved.text);
+	}
 }
 
 /*
@@ -564,6 +1122,26 @@ reset_line(input *in)
 	in->line->end = h_tmp;
 }
 
+static void
+input_load(input *in, const char *text)
+{
+	/* Replace the contents of an input line */
+
+	size_t len = strlen(text);
+
+	if (len > MAX_INPUT)
+		len = MAX_INPUT;
+
+	memcpy(in->line->text, text, len);
+
+	in->line->end = in->line->text + len;
+	*in->line->end = '\0';
+
+	reframe_line(in);
+
+	draw(D_INPUT);
+}
+
 static inline void
 reframe_line(input *in)
 {
@@ -577,6 +1155,421 @@ reframe_line(input *in)
 		in->window = in->line->text;
 }
 
+/*
+ * Input history functions
+ * */
+
+void
+init_history(void)
+{
+	/* Load the input history from config.history_file and open it for appending.
+	 *
+	 * The file is append-only while running and may contain duplicates, so it's
+	 * rewritten when loading if most of its lines are stale */
+
+	char buff[MAX_INPUT + 2];
+	unsigned int lines = 0;
+	FILE *f;
+
+	if (config.history_file == NULL)
+		return;
+
+	if ((f = fopen(config.history_file, "r"))) {
+
+		while (fgets(buff, sizeof(buff), f)) {
+
+			size_t len = strcspn(buff, "\n");
+
+			buff[len] = '\0';
+
+			if (len) {
+				history_add(buff, len, 0);
+				lines++;
+			}
+		}
+
+		fclose(f);
+	}
+
+	if (lines > 2 * history.live) {
+
+		char tmp[BUFFSIZE];
+
+		snprintf(tmp, BUFFSIZE, "%s.tmp", config.history_file);
+
+		if ((f = history_open(tmp, O_WRONLY | O_TRUNC, "w"))) {
+
+			for (unsigned int i = 0; i < history.count; i++)
+				if (!history.entries[i].deleted)
+					fprintf(f, "%s\n", history.text + history.entries[i].offset);
+
+			if (fclose(f) || rename(tmp, config.history_file))
+				remove(tmp);
+		}
+	}
+
+	history.file = history_open(config.history_file, O_WRONLY | O_APPEND, "a");
+}
+
+static FILE*
+history_open(const char *path, int flags, const char *mode)
+{
+	/* Open a history file readable only by the user, as sent lines may hold
+	 * messages not meant for others. Files created as world readable by older
+	 * versions are restricted when opened */
+
+	FILE *f;
+	int fd;
+
+	if ((fd = open(path, flags | O_CREAT, 0600)) < 0)
+		return NULL;
+
+	if (fchmod(fd, 0600) < 0 || (f = fdopen(fd, mode)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	return f;
+}
+
+static int
+history_secret(const char *text)
+{
+	/* Whether a line may hold credentials, and isn't persisted. Matches any
+	 * of the words below, case insensitively, e.g. in /oper, /pass, /raw PASS
+	 * or /msg NickServ IDENTIFY */
+
+	static const char *const words[] = { "identify", "nickserv", "oper", "pass" };
+
+	const char *end;
+	size_t i, len;
+
+	while (*text) {
+
+		text += strspn(text, " /:");
+
+		for (end = text; *end && !strchr(" /:", *end); end++)
+			;
+
+		len = end - text;
+
+		for (i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+			if (len == strlen(words[i]) && !strncasecmp(text, words[i], len))
+				return 1;
+
+		text = end;
+	}
+
+	return 0;
+}
+
+void
+free_history(void)
+{
+	if (history.file)
+		fclose(history.file);
+
+	for (unsigned int i = 0; i < HISTORY_INDEX_SIZE; i++)
+		free(history.index[i].ids);
+
+	free(history.entries);
+	free(history.text);
+}
+
+static void
+history_add(const char *text, size_t len, int persist)
+{
+	/* Add a line to the input history, moving any duplicate to the front */
+
+	unsigned int i, hash = 2166136261u;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) text[i];
+		hash *= 16777619u;
+	}
+
+	for (i = history.table[hash & (HISTORY_TABLE_SIZE - 1)]; i; i = history.entries[i - 1].next) {
+
+		struct history_entry *e = &history.entries[i - 1];
+
+		if (e->hash == hash && e->len == len && !memcmp(history.text + e->offset, text, len)) {
+			history_delete(i - 1);
+			break;
+		}
+	}
+
+	history_insert(text, len, hash);
+
+	/* Drop the oldest entries past the configured depth */
+	while (history.live > config.history_size) {
+
+		while (history.entries[history.oldest].deleted)
+			history.oldest++;
+
+		history_delete(history.oldest);
+	}
+
+	if (history.count - history.live > history.live)
+		history_compact();
+
+	if (persist && history.file && !history_secret(text)) {
+		fprintf(history.file, "%s\n", text);
+		fflush(history.file);
+	}
+}
+
+static void
+history_insert(const char *text, size_t len, unsigned int hash)
+{
+	/* Append an entry to the history, its hash chain and the substring index */
+
+	struct history_entry *e;
+	unsigned int i = history.count;
+
+	if (history.count == history.size) {
+
+		history.size = (history.size) ? history.size * 2 : 64;
+
+		if ((history.entries = realloc(history.entries, history.size * sizeof(*e))) == NULL)
+			fatal("realloc");
+	}
+
+	while (history.text_len + len + 1 > history.text_size) {
+
+		history.text_size = (history.text_size) ? history.text_size * 2 : BUFFSIZE;
+
+		if ((history.text = realloc(history.text, history.text_size)) == NULL)
+			fatal("realloc");
+	}
+
+	e = &history.entries[history.count++];
+
+	e->deleted = 0;
+	e->len = len;
+	e->offset = history.text_len;
+	e->hash = hash;
+	e->seq = ++history.seq;
+
+	memcpy(history.text + e->offset, text, len);
+	history.text[e->offset + len] = '\0';
+	history.text_len += len + 1;
+
+	/* Hash chain indexes are offset by 1, 0 terminates the chain */
+	e->next = history.table[hash & (HISTORY_TABLE_SIZE - 1)];
+	history.table[hash & (HISTORY_TABLE_SIZE - 1)] = i + 1;
+
+	for (size_t j = 0; j + 3 <= len; j++) {
+
+		struct history_posting *p = &history.index[TRIGRAM(text + j)];
+
+		/* Trigram repeated in this entry */
+		if (p->len && p->ids[p->len - 1] == i)
+			continue;
+
+		if (p->len == p->size) {
+
+			p->size = (p->size) ? p->size * 2 : 8;
+
+			if ((p->ids = realloc(p->ids, p->size * sizeof(*p->ids))) == NULL)
+				fatal("realloc");
+		}
+
+		p->ids[p->len++] = i;
+	}
+
+	history.live++;
+}
+
+static void
+history_delete(unsigned int i)
+{
+	/* Delete an entry, removing it from its hash chain.
+	 *
+	 * Deleted entries remain in the substring index until compaction */
+
+	unsigned int *ptr = &history.table[history.entries[i].hash & (HISTORY_TABLE_SIZE - 1)];
+
+	while (*ptr != i + 1)
+		ptr = &history.entries[*ptr - 1].next;
+
+	*ptr = history.entries[i].next;
+
+	history.entries[i].deleted = 1;
+	history.live--;
+}
+
+static void
+history_compact(void)
+{
+	/* Rebuild the history from its live entries */
+
+	char *text = history.text;
+	struct history_entry *entries = history.entries;
+	unsigned int i, count = history.count;
+
+	history.text = NULL;
+	history.text_len = 0;
+	history.text_size = 0;
+	history.entries = NULL;
+	history.count = 0;
+	history.live = 0;
+	history.oldest = 0;
+	history.size = 0;
+
+	memset(history.table, 0, sizeof(history.table));
+
+	for (i = 0; i < HISTORY_INDEX_SIZE; i++)
+		history.index[i].len = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!entries[i].deleted) {
+
+			unsigned long seq = history.seq;
+
+			/* Entries keep their sequence numbers */
+			history.seq = entries[i].seq - 1;
+			history_insert(text + entries[i].offset, entries[i].len, entries[i].hash);
+			history.seq = seq;
+		}
+	}
+
+	free(entries);
+	free(text);
+}
+
+static int
+history_find(unsigned long seq)
+{
+	/* Binary search for the entry with sequence number seq */
+
+	unsigned int l = 0, r = history.count;
+
+	while (l < r) {
+
+		unsigned int m = l + (r - l) / 2;
+
+		if (history.entries[m].seq < seq)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+static int
+history_search(const char *search, int before)
+{
+	/* Find the most recent live entry containing search, prior to entry number before.
+	 *
+	 * Returns the entry number, or -1 if not found */
+
+	size_t j, len = strlen(search);
+	int i;
+
+	/* Searches shorter than a trigram scan all entries */
+	if (len < 3) {
+
+		for (i = before - 1; i >= 0; i--)
+			if (!history.entries[i].deleted && strstr(history.text + history.entries[i].offset, search))
+				return i;
+
+		return -1;
+	}
+
+	/* Only entries containing the rarest trigram of the search can match */
+	struct history_posting *p = &history.index[TRIGRAM(search)];
+
+	for (j = 1; j + 3 <= len; j++)
+		if (history.index[TRIGRAM(search + j)].len < p->len)
+			p = &history.index[TRIGRAM(search + j)];
+
+	/* Binary search for the first posting not prior to before */
+	unsigned int l = 0, r = p->len;
+
+	while (l < r) {
+
+		unsigned int m = l + (r - l) / 2;
+
+		if (p->ids[m] < (unsigned int) before)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	while (l--) {
+
+		struct history_entry *e = &history.entries[p->ids[l]];
+
+		if (!e->deleted && e->len >= len && strstr(history.text + e->offset, search))
+			return p->ids[l];
+	}
+
+	return -1;
+}
+
+static char history_search_buff[MAX_HISTORY_SEARCH];
+static char *history_search_ptr = history_search_buff;
+static int history_search_match = -1;
+
+static int
+action_history_search(char c)
+{
+	/* Reverse incremental history search */
+
+	/* \n confirms selecting the current match */
+	if (c == '\n' && history_search_match >= 0) {
+
+		ccur->input->history = history.entries[history_search_match].seq;
+
+		input_load(ccur->input, history.text + history.entries[history_search_match].offset);
+
+		*(history_search_ptr = history_search_buff) = '\0';
+		history_search_match = -1;
+
+		return 1;
+	}
+
+	/* \n, Esc, ^C cancels a search if no results are found */
+	if (c == '\n' || c == 0x1b || c == 0x03) {
+		*(history_search_ptr = history_search_buff) = '\0';
+		history_search_match = -1;
+		return 1;
+	}
+
+	if (c == 0x12) {
+		/* ^R repeats the search backwards from the current result */
+
+		if (history_search_match > 0)
+			history_search_match = history_search(history_search_buff, history_search_match);
+
+	} else if (c == 0x7f && history_search_ptr > history_search_buff) {
+		/* Backspace */
+
+		*(--history_search_ptr) = '\0';
+
+		history_search_match = history_search(history_search_buff, history.count);
+
+	} else if (isprint((unsigned char) c) && history_search_ptr < history_search_buff + MAX_HISTORY_SEARCH - 1) {
+		/* All other input, the current match is the most recent possible match */
+
+		*(history_search_ptr++) = c;
+		*history_search_ptr = '\0';
+
+		history_search_match = history_search(history_search_buff,
+				(history_search_match >= 0) ? history_search_match + 1 : (int) history.count);
+	}
+
+	/* Reprint the action message */
+	if (history_search_match < 0)
+		action(action_history_search, "History: NO MATCH -- %s", history_search_buff);
+	else
+		action(action_history_search, "History: %s -- %s",
+				history.text + history.entries[history_search_match].offset, history_search_buff);
+
+	return 0;
+}
+
 /* TODO: This is a first draft for simple channel searching functionality.
  *
  * It can be cleaned up, and input.c is probably not the most ideal place for this */
@@ -646,7 +1639,7 @@ action_find_channel(char c)
 		*(--search_ptr) = '\0';
 
 		search_cptr = search_channels(ccur, search_buff);
-	} else if (isprint(c) && search_ptr < search_buff + MAX_SEARCH && (search_cptr != NULL || *search_buff == '\0')) {
+	} else if (isprint((unsigned char) c) && search_ptr < search_buff + MAX_SEARCH && (search_cptr != NULL || *search_buff == '\0')) {
 		/* All other input */
 
 		*(search_ptr++) = c;
@@ -705,7 +1698,7 @@ tab_complete(input *inp)
 	if (*str == '/' && str == inp->line->text) {
 		/* Command tab completion */
 
-		if ((n = avl_get(commands, ++str, --len))) {
+		if ((n = avl_get(commands, casemap_ascii, ++str, --len))) {
 
 			match = n->key;
 
@@ -720,7 +1713,7 @@ tab_complete(input *inp)
 			/* For commands, append a space */
 			input_char(' ');
 		}
-	} else if ((n = avl_get(ccur->nicklist, str, len))) {
+	} else if (ccur->server && (n = avl_get(ccur->nicklist, ccur->server->isupport.casemap, str, len))) {
 		/* Nick tab completion */
 
 		match = n->key;
@@ -750,7 +1743,7 @@ action_send_paste(char c)
 {
 	/* Confirmed send */
 	if (toupper(c) == 'Y') {
-		send_paste(paste_buff);
+		send_paste(paste_buff.buf);
 		return 1;
 	}
 
@@ -773,49 +1766,19 @@ send_input(void)
 	reset_line(in);
 
 	/* After resetting, check for empty line */
-	if (in->head == in->line->text)
+	if (in->line->end == in->line->text)
 		return;
 
 	/* Pass a copy of the message to the send handler, since it may modify the contents */
 	strcpy(sendbuff, in->line->text);
 
-	/* Now check if the sent line was 'new' or was resent input scrollback
-	 *
-	 * If a new line was sent:
-	 *   append a blank input as the new list head
-	 *
-	 * If scrollback was sent:
-	 *   move it to the front of the input scrollback
-	 */
-	if (in->line == in->list_head) {
+	/* Sent lines are added to the history, moving any duplicate to the front */
+	history_add(in->line->text, in->line->end - in->line->text, 1);
 
-		if (in->count == SCROLLBACK_INPUT) {
-			/* Reached maximum input scrollback lines, delete the tail */
-			input_line *t = in->list_head->next;
-
-			DLL_DEL(in->list_head, t);
-			free(t);
-		} else {
-			in->count++;
-		}
+	/* Reset to a blank working line */
+	in->history = 0;
 
-		new_list_head(in);
-	} else {
-		/* TODO: the DLL macros don't seem to handle this task well...
-		 * Maybe they should be replaced with generic DLL functions in utils */
-
-		in->line->next->prev = in->line->prev;
-		in->line->prev->next = in->line->next;
-
-		in->list_head->prev->next = in->line;
-		in->line->prev = in->list_head->prev;
-		in->list_head->prev = in->line;
-		in->line->next = in->list_head;
-
-		in->line = in->list_head;
-
-		reframe_line(in);
-	}
+	input_load(in, "");
 
 	draw(D_INPUT);
 
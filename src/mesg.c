@@ -22,6 +22,7 @@
 #define RPL_LUSERME          255
 #define RPL_LOCALUSERS       265
 #define RPL_GLOBALUSERS      266
+#define RPL_CHANNELMODEIS    324
 #define RPL_CHANNEL_URL      328
 #define RPL_NOTOPIC          331
 #define RPL_TOPIC            332
@@ -47,7 +48,50 @@
 #define fail_if(C) \
 	do { if (C) return 1; } while (0)
 
-#define IS_ME(X) !strcmp(X, s->nick_me)
+#define IS_ME(X) !irc_strcmp(s->isupport.casemap, X, s->nick_me)
+
+/* IRCv3 capabilities, requested when listed by the server */
+#define CAP_BATCH       (1 << 0)
+#define CAP_SERVER_TIME (1 << 1)
+#define CAP_CHATHISTORY (1 << 2)
+#define CAP_PLAYBACK    (1 << 3)
+
+static const struct {
+	const char *name;
+	unsigned int cap;
+} caps[] = {
+	{ "batch",                  CAP_BATCH },
+	{ "server-time",            CAP_SERVER_TIME },
+	{ "znc.in/server-time-iso", CAP_SERVER_TIME },
+	{ "draft/chathistory",      CAP_CHATHISTORY },
+	{ "znc.in/playback",        CAP_PLAYBACK }
+};
+
+#define CAPS (sizeof(caps) / sizeof(caps[0]))
+
+/* ISUPPORT parameters assumed until sent by the server, per RFC 1459 */
+static const struct isupport isupport_default = {
+	.casemap = casemap_rfc1459,
+	.chanmodes = {"beI", "k", "l", "imnpst"},
+	.chantypes = "#&",
+	.prefix_chars = "@+",
+	.prefix_modes = "ov",
+	.nicklen = NICKSIZE - 1
+};
+
+/* Message types filtered by /ignore */
+static const struct {
+	const char *name;
+	unsigned int type;
+} ignore_types[] = {
+	{ "privmsg", IGNORE_PRIVMSG },
+	{ "notice",  IGNORE_NOTICE },
+	{ "ctcp",    IGNORE_CTCP },
+	{ "join",    IGNORE_JOIN },
+	{ "nick",    IGNORE_NICK }
+};
+
+#define IGNORE_TYPES (sizeof(ignore_types) / sizeof(ignore_types[0]))
 
 /* List of common IRC commands with no explicit handling */
 #define UNHANDLED_CMDS \
@@ -56,12 +100,12 @@
 	X(invite)  X(ison)     X(kick) \
 	X(kill)    X(knock)    X(links) \
 	X(list)    X(lusers)   X(mode) \
-	X(motd)    X(names)    X(namesx) \
+	X(motd)    X(namesx) \
 	X(notice)  X(oper)     X(pass) \
 	X(rehash)  X(restart)  X(rules) \
 	X(server)  X(service)  X(servlist) \
 	X(setname) X(silence)  X(squery) \
-	X(squit)   X(stats)    X(summon) \
+	X(squit)   X(summon) \
 	X(time)    X(trace)    X(uhnames) \
 	X(user)    X(userhost) X(userip) \
 	X(users)   X(version)  X(wallops) \
@@ -74,15 +118,19 @@
 	X(close) \
 	X(connect) \
 	X(disconnect) \
+	X(filter) \
 	X(ignore) \
 	X(join) \
 	X(me) \
 	X(msg) \
+	X(names) \
 	X(nick) \
 	X(part) \
 	X(privmsg) \
 	X(quit) \
 	X(raw) \
+	X(stats) \
+	X(unfilter) \
 	X(unignore) \
 	X(version)
 
@@ -91,19 +139,96 @@
 HANDLED_CMDS
 #undef X
 
+/* Complete an /ignore mask to nick!user@host */
+static void ignore_mask(char*, size_t, const char*);
+
 /* Special case handler for sending non-command input */
 static int send_default(char*, char*);
 
 /* Default case handler for sending commands */
 static int send_unhandled(char*, char*, char*);
 
+/* Received message type names, for /stats */
+static const char *recv_names[RECV_T_SIZE] = {
+	[RECV_NUMERIC] = "numeric",
+	[RECV_PRIVMSG] = "PRIVMSG",
+	[RECV_JOIN]    = "JOIN",
+	[RECV_PART]    = "PART",
+	[RECV_QUIT]    = "QUIT",
+	[RECV_NOTICE]  = "NOTICE",
+	[RECV_NICK]    = "NICK",
+	[RECV_PING]    = "PING",
+	[RECV_MODE]    = "MODE",
+	[RECV_ERROR]   = "ERROR",
+	[RECV_BATCH]   = "BATCH",
+	[RECV_CAP]     = "CAP",
+	[RECV_UNKNOWN] = "unknown"
+};
+
+/* Defined in draw.c */
+extern struct draw_stats draw_stats;
+
+/* Filter rules, applied to messages from all servers */
+static struct filter *filters;
+
+/* Set while handling a message replayed from history, which doesn't ping */
+static int recv_history;
+
+/* Netsplit summary lines list nicks up to this length, then count the rest */
+#define NETSPLIT_NICKS 320
+
+/* Nicks quit and rejoined in a channel, pending summary */
+struct netsplit_chan
+{
+	struct netsplit_chan *next;
+	unsigned int quits;
+	unsigned int joins;
+	size_t quits_len;
+	size_t joins_len;
+	char quits_str[NETSPLIT_NICKS];
+	char joins_str[NETSPLIT_NICKS];
+	char name[CHANSIZE];
+};
+
+/* A netsplit between two servers, the nicks lost expected to rejoin, and
+ * those rejoined since the last summary of rejoins */
+struct netsplit
+{
+	struct netsplit *next;
+	struct netsplit_chan *chans;
+	avl_node *nicks;
+	avl_node *rejoins;
+	time_t quit_time;
+	time_t quit_first;
+	time_t join_time;
+	time_t join_first;
+	char servers[];
+};
+
+/* Members' prefixes are a bit per PREFIX mode, by rank, the highest first */
+#define PREFIX_MAX 16
+#define PREFIX_BIT(I) (((I) < PREFIX_MAX) ? (1U << (I)) : 0)
+
+/* A JOIN line being packed with channels, and the keys of those first added */
+struct join_line
+{
+	char chans[BUFFSIZE];
+	char keys[BUFFSIZE];
+	size_t chans_len;
+	size_t keys_len;
+	unsigned int count;
+};
+
 /* Encapsulate a function pointer in a struct so AVL tree cleanup can free it */
 struct command { int (*fptr)(char*, char*); };
 static struct command* new_command(int (*fptr)(char*, char*));
 
 /* Message receiving handlers */
+static int recv_batch(char*, parsed_mesg*, server*);
+static void recv_isupport(server*, char*);
+static int recv_cap(char*, parsed_mesg*, server*);
 static int recv_ctcp_req(char*, parsed_mesg*, server*);
-static int recv_ctcp_rpl(char*, parsed_mesg*);
+static int recv_ctcp_rpl(char*, parsed_mesg*, server*);
 static int recv_error(char*, parsed_mesg*, server*);
 static int recv_join(char*, parsed_mesg*, server*);
 static int recv_mode(char*, parsed_mesg*, server*);
@@ -115,18 +240,65 @@ static int recv_ping(char*, parsed_mesg*, server*);
 static int recv_priv(char*, parsed_mesg*, server*);
 static int recv_quit(char*, parsed_mesg*, server*);
 
+static int request_history(char*, server*, const char*);
+
+static int join_add(char*, server*, struct join_line*, const char*, const char*);
+static int join_channels(char*, server*);
+static void join_key(server*, const char*, const char*);
+static int join_send(char*, server*, struct join_line*);
+
+static char* mode_arg(parsed_mesg*);
+static void names_print(channel*, const avl_node*, unsigned int, char, char*, size_t*);
+
+static int recv_filtered(server*, parsed_mesg*, unsigned int, channel*);
+static int recv_ignored(server*, parsed_mesg*, unsigned int);
+
+static int netsplit_reason(const char*);
+static struct netsplit* netsplit_find(server*, const char*);
+static struct netsplit* netsplit_get(server*, const char*);
+static void netsplit_add(struct netsplit*, channel*, const char*, int);
+static void netsplit_line(channel*, struct netsplit*, const char*, unsigned int, const char*, size_t);
+
+static int check_highlight(server*, const char*);
+
+void
+init_filters(void)
+{
+	/* Add the configured filter rules, separated by ';' */
+
+	char *rules, *rule, *state;
+	const char *invalid;
+
+	if (config.filters == NULL)
+		return;
+
+	if ((rules = strdup(config.filters)) == NULL)
+		fatal("strdup");
+
+	for (rule = strtok_r(rules, ";", &state); rule; rule = strtok_r(NULL, ";", &state)) {
+
+		while (*rule == ' ')
+			rule++;
+
+		if (*rule && (invalid = filter_add(&filters, rule)))
+			newlinef(rirc, 0, "-!!-", "Invalid filter '%s', %s", rule, invalid);
+	}
+
+	free(rules);
+}
+
 void
 init_commands(void)
 {
 	/* Build and AVL tree off commands and function pointers to handlers */
 
 	/* Add the unhandled commands with no explicit handler */
-	#define X(cmd) avl_add(&commands, #cmd, NULL);
+	#define X(cmd) avl_add(&commands, casemap_ascii, #cmd, NULL);
 	UNHANDLED_CMDS
 	#undef X
 
 	/* Add the handled commands with explicit handlers */
-	#define X(cmd) avl_add(&commands, #cmd, new_command(send_##cmd));
+	#define X(cmd) avl_add(&commands, casemap_ascii, #cmd, new_command(send_##cmd));
 	HANDLED_CMDS
 	#undef X
 }
@@ -170,8 +342,9 @@ send_mesg(char *mesg)
 			return;
 		}
 
-		/* Check if command is defined, and retrieve the handler */
-		if (!(cmd = avl_get(commands, cmd_str, strlen(cmd_str)))) {
+		/* Check if command is defined, exactly or else by prefix, and retrieve the handler */
+		if (!(cmd = avl_get(commands, casemap_ascii, cmd_str, strlen(cmd_str) + 1))
+				&& !(cmd = avl_get(commands, casemap_ascii, cmd_str, strlen(cmd_str)))) {
 			newlinef(ccur, 0, "-!!-", "Unknown command: '%s'", cmd_str);
 			return;
 		}
@@ -196,10 +369,37 @@ send_mesg(char *mesg)
 void
 send_paste(char *paste)
 {
-	/* TODO: send the paste buffer, which is preformatted with \r\n, and then
-	 * split the messages and newline them into the buffer * */
+	/* Queue a confirmed paste, which is preformatted with \r\n separated messages,
+	 * to be sent to the current buffer at a paced rate */
+
+	char errbuff[MAX_ERROR], *mesg, *end;
+
+	if (!ccur->type) {
+		newline(ccur, 0, "-!!-", "Error: This is not a channel");
+		return;
+	}
+
+	if (ccur->parted) {
+		newline(ccur, 0, "-!!-", "Error: Parted from channel");
+		return;
+	}
 
-	UNUSED(paste);
+	for (mesg = paste; *mesg; mesg = end) {
+
+		if ((end = strstr(mesg, "\r\n")) == NULL)
+			end = mesg + strlen(mesg);
+		else
+			*end = '\0', end += 2;
+
+		/* Skip empty lines */
+		if (*mesg == '\0')
+			continue;
+
+		if (sendq_privmsg(errbuff, ccur->server, ccur->name, mesg)) {
+			newline(ccur, 0, "-!!-", errbuff);
+			return;
+		}
+	}
 }
 
 static int
@@ -318,27 +518,91 @@ send_me(char *err, char *mesg)
 	return 0;
 }
 
-/* TODO discard privmesg and notice from users on the list */
+static int
+send_filter(char *err, char *mesg)
+{
+	/* /filter [rule], see filter_add() for the rule syntax */
+
+	const char *list, *invalid;
+	const void *iter = NULL;
+	unsigned long hits;
+	unsigned int n = 0;
+
+	while (*mesg == ' ')
+		mesg++;
+
+	if (*mesg == '\0') {
+
+		while ((list = filter_list(filters, &iter, &hits)))
+			newlinef(ccur, 0, "--", "Filter %u: %s (%lu dropped)", ++n, list, hits);
+
+		if (n == 0)
+			newline(ccur, 0, "--", "Filters: none");
+
+		return 0;
+	}
+
+	if ((invalid = filter_add(&filters, mesg)))
+		failf("Error: Invalid filter, %s", invalid);
+
+	newlinef(ccur, 0, "--", "Filtering '%s'", mesg);
+
+	return 0;
+}
+
 static int
 send_ignore(char *err, char *mesg)
 {
-	/* /ignore [nick] */
+	/* /ignore [mask [types]]
+	 *
+	 * mask:  nick, nick!user@host or user@host, globbed with '*' and '?'
+	 * types: comma separated, any of privmsg, notice, ctcp, join, nick.
+	 *        join covers JOIN, PART and QUIT. Defaults to all */
 
-	char *nick;
+	char *arg, *type, mask[NICKSIZE], types_str[64];
+	const char *list;
+	const void *iter = NULL;
+	unsigned int i, types = 0, count = 0;
 
 	if (!ccur->server)
 		fail("Error: Not connected to server");
 
-	if (!(nick = strtok(mesg, " "))) {
-		/* TODO */
-		newline(ccur, 0, "TODO", "Ignoring:");
+	if (!(arg = strtok_r(mesg, " ", &mesg))) {
+
+		while ((list = ignore_list(ccur->server->ignore, &iter, &types))) {
+
+			count++;
+
+			for (*types_str = '\0', i = 0; i < IGNORE_TYPES; i++)
+				if (types & ignore_types[i].type)
+					sprintf(types_str + strlen(types_str), "%s%s", *types_str ? "," : "", ignore_types[i].name);
+
+			newlinef(ccur, 0, "--", "Ignoring: %s (%s)", list, types_str);
+		}
+
+		if (count == 0)
+			newline(ccur, 0, "--", "Ignoring: none");
+
 		return 0;
 	}
 
-	if (!avl_add(&(ccur->server->ignore), nick, NULL))
-		failf("Error: Already ignoring '%s'", nick);
+	ignore_mask(mask, sizeof(mask), arg);
+
+	while ((type = strtok_r(mesg, ", ", &mesg))) {
+
+		for (i = 0; i < IGNORE_TYPES && strcmp(type, ignore_types[i].name); i++)
+			;
+
+		if (i == IGNORE_TYPES)
+			failf("Error: Unknown ignore type '%s'", type);
+
+		types |= ignore_types[i].type;
+	}
 
-	newlinef(ccur, 0, "--", "Ignoring '%s'", nick);
+	if (!ignore_add(&(ccur->server->ignore), ccur->server->isupport.casemap, mask, types ? types : IGNORE_ALL))
+		failf("Error: Already ignoring '%s'", mask);
+
+	newlinef(ccur, 0, "--", "Ignoring '%s'", mask);
 
 	return 0;
 }
@@ -346,12 +610,27 @@ send_ignore(char *err, char *mesg)
 static int
 send_join(char *err, char *mesg)
 {
-	/* /join [target[,targets]*] */
+	/* /join [target[,targets]* [key[,keys]*]] */
 
-	char *targ;
+	char *chan, *chans, *key, *keys;
+
+	if ((chans = strtok(mesg, " "))) {
 
-	if ((targ = strtok(mesg, " ")))
-		return sendf(err, ccur->server, "JOIN %s", targ);
+		keys = strtok(NULL, " ");
+
+		if (keys)
+			fail_if(sendf(err, ccur->server, "JOIN %s %s", chans, keys));
+		else
+			fail_if(sendf(err, ccur->server, "JOIN %s", chans));
+
+		/* Keys are kept for the channels once joined, see recv_join() */
+		while ((chan = strtok_r(chans, ",", &chans))) {
+			key = (keys) ? strtok_r(keys, ",", &keys) : NULL;
+			join_key(ccur->server, chan, key);
+		}
+
+		return 0;
+	}
 
 	if (!ccur->type)
 		fail("Error: JOIN requires a target");
@@ -373,6 +652,79 @@ send_msg(char *err, char *mesg)
 	return send_privmsg(err, mesg);
 }
 
+static int
+send_names(char *err, char *mesg)
+{
+	/* /names [channel]
+	 *
+	 * Without a channel, list the current channel's members by highest prefix
+	 * rank, then name, from the nicklist as kept */
+
+	char buf[BUFFSIZE];
+	size_t i, len = 0;
+	server *s = ccur->server;
+
+	if (!s)
+		fail("Error: Not connected to server");
+
+	while (*mesg == ' ')
+		mesg++;
+
+	if (*mesg)
+		return sendf(err, s, "NAMES %s", mesg);
+
+	if (ccur == s->channel || ccur->type == 'p')
+		fail("Error: NAMES requires a channel");
+
+	newlinef(ccur, 0, "--", "Names %s: %d", ccur->name, ccur->nick_count);
+
+	for (i = 0; s->isupport.prefix_chars[i] && i < PREFIX_MAX; i++)
+		names_print(ccur, ccur->nicklist, PREFIX_BIT(i), s->isupport.prefix_chars[i], buf, &len);
+
+	names_print(ccur, ccur->nicklist, 0, '\0', buf, &len);
+
+	if (len)
+		newline(ccur, 0, "--", buf);
+
+	return 0;
+}
+
+static void
+names_print(channel *c, const avl_node *n, unsigned int prefix, char prefix_char, char *buf, size_t *len)
+{
+	/* Append the members of a subtree whose highest prefix is prefix, in order,
+	 * printing buf a line at a time. Members without a prefix are appended for 0 */
+
+	size_t key_len;
+
+	if (n == NULL)
+		return;
+
+	names_print(c, n->l, prefix, prefix_char, buf, len);
+
+	if ((n->prefix & -n->prefix) == prefix) {
+
+		key_len = strlen(n->key);
+
+		/* A separating space, the prefix, the nick and its null */
+		if (*len && *len + key_len + 3 > BUFFSIZE) {
+			newline(c, 0, "--", buf);
+			*len = 0;
+		}
+
+		if (*len)
+			buf[(*len)++] = ' ';
+
+		if (prefix_char)
+			buf[(*len)++] = prefix_char;
+
+		memcpy(buf + *len, n->key, key_len + 1);
+		*len += key_len;
+	}
+
+	names_print(c, n->r, prefix, prefix_char, buf, len);
+}
+
 static int
 send_nick(char *err, char *mesg)
 {
@@ -380,8 +732,13 @@ send_nick(char *err, char *mesg)
 
 	char *nick;
 
-	if ((nick = strtok(mesg, " ")))
-		return sendf(err, ccur->server, "NICK %s", mesg);
+	if ((nick = strtok(mesg, " "))) {
+
+		if (ccur->server && strlen(nick) > ccur->server->isupport.nicklen)
+			failf("Error: Nick exceeds the server's maximum length, %u", ccur->server->isupport.nicklen);
+
+		return sendf(err, ccur->server, "NICK %s", nick);
+	}
 
 	if (!ccur->server)
 		fail("Error: Not connected to server");
@@ -428,9 +785,14 @@ send_privmsg(char *err, char *mesg) {
 
 	fail_if(sendf(err, ccur->server, "PRIVMSG %s :%s", targ, mesg));
 
+	/* Messages to channels not joined are shown in the current buffer */
 	if ((c = channel_get(targ, ccur->server)) == NULL) {
-		c = new_channel(targ, ccur->server, ccur);
-		c->type = 'p';
+		if (strchr(ccur->server->isupport.chantypes, *targ))
+			c = ccur;
+		else {
+			c = new_channel(targ, ccur->server, ccur);
+			c->type = 'p';
+		}
 	}
 
 	newline(c, LINE_CHAT, ccur->server->nick_me, mesg);
@@ -450,26 +812,112 @@ send_raw(char *err, char *mesg)
 	return 0;
 }
 
+static int
+send_stats(char *err, char *mesg)
+{
+	/* /stats [query] */
+
+	int i;
+	server *s = ccur->server;
+
+	/* With a query, request server statistics */
+	if (*mesg)
+		return sendf(err, s, "STATS %s", mesg);
+
+	newlinef(ccur, 0, "--", "Redraws: %lu, time (us) p50: %lu, p99: %lu, max: %lu",
+			draw_stats.count,
+			histogram_percentile(&draw_stats.time, 0.50),
+			histogram_percentile(&draw_stats.time, 0.99),
+			draw_stats.time.max);
+
+	newlinef(ccur, 0, "--", "Terminal: scroll regions %s, synchronized output %s, REP %s, truecolor %s",
+			(term_caps & TERM_SCROLL) ? "yes" : "no",
+			(term_caps & TERM_SYNC)   ? "yes" : "no",
+			(term_caps & TERM_REP)    ? "yes" : "no",
+			(term_caps & TERM_RGB)    ? "yes" : "no");
+
+	newlinef(ccur, 0, "--", "Latency (us) p50/p99/max");
+
+	newlinef(ccur, 0, "--", "  read-parse:   %lu/%lu/%lu",
+			histogram_percentile(&trace.read_parse, 0.50),
+			histogram_percentile(&trace.read_parse, 0.99),
+			trace.read_parse.max);
+
+	newlinef(ccur, 0, "--", "  parse-insert: %lu/%lu/%lu",
+			histogram_percentile(&trace.parse_insert, 0.50),
+			histogram_percentile(&trace.parse_insert, 0.99),
+			trace.parse_insert.max);
+
+	newlinef(ccur, 0, "--", "  insert-draw:  %lu/%lu/%lu",
+			histogram_percentile(&trace.insert_draw, 0.50),
+			histogram_percentile(&trace.insert_draw, 0.99),
+			trace.insert_draw.max);
+
+	newlinef(ccur, 0, "--", "  read-draw:    %lu/%lu/%lu",
+			histogram_percentile(&trace.read_draw, 0.50),
+			histogram_percentile(&trace.read_draw, 0.99),
+			trace.read_draw.max);
+
+	newlinef(ccur, 0, "--", "  never drawn:  %lu lines", trace.undrawn);
+
+	if (s == NULL)
+		return 0;
+
+	newlinef(ccur, 0, "--", "%s: received %lu bytes, %lu lines, %lu parse errors, %lu ignored, %lu filtered",
+			s->host, s->stats.recv_bytes, s->stats.recv_lines, s->stats.parse_errors,
+			s->stats.recv_ignored, s->stats.recv_filtered);
+
+	newlinef(ccur, 0, "--", "%s: sent %lu bytes, %lu lines, %lu send errors",
+			s->host, s->stats.send_bytes, s->stats.send_lines, s->stats.send_errors);
+
+	newlinef(ccur, 0, "--", "%s: send queue %u, max %u",
+			s->host, s->sendq.count, s->stats.sendq_max);
+
+	for (i = 0; i < RECV_T_SIZE; i++)
+		if (s->stats.recv_types[i])
+			newlinef(ccur, 0, "--", "%s:   %-8s %lu", s->host, recv_names[i], s->stats.recv_types[i]);
+
+	return 0;
+}
+
+static int
+send_unfilter(char *err, char *mesg)
+{
+	/* /unfilter <n> */
+
+	char *arg;
+	unsigned int n;
+
+	if (!(arg = strtok(mesg, " ")) || !(n = strtoul(arg, NULL, 10)))
+		fail("Error: /unfilter <n>");
+
+	if (!filter_del(&filters, n))
+		failf("Error: No filter %u", n);
+
+	newlinef(ccur, 0, "--", "Removed filter %u", n);
+
+	return 0;
+}
+
 static int
 send_unignore(char *err, char *mesg)
 {
-	/* /unignore [nick] */
+	/* /unignore <mask> */
 
-	char *nick;
+	char *arg, mask[NICKSIZE];
 
 	if (!ccur->server)
 		fail("Error: Not connected to server");
 
-	if (!(nick = strtok(mesg, " "))) {
-		/* TODO */
-		newline(ccur, 0, "TODO", "Ignoring:");
-		return 0;
-	}
+	if (!(arg = strtok(mesg, " ")))
+		fail("Error: /unignore <mask>");
+
+	ignore_mask(mask, sizeof(mask), arg);
 
-	if (!avl_del(&(ccur->server->ignore), nick))
-		failf("Error: '%s' not on ignore list", nick);
+	if (!ignore_del(&(ccur->server->ignore), ccur->server->isupport.casemap, mask))
+		failf("Error: '%s' not on ignore list", mask);
 
-	newlinef(ccur, 0, "--", "No longer ignoring '%s'", nick);
+	newlinef(ccur, 0, "--", "No longer ignoring '%s'", mask);
 
 	return 0;
 }
@@ -527,17 +975,103 @@ send_version(char *err, char *mesg)
  * Message receiving handlers
  * */
 
+static void
+ignore_mask(char *buf, size_t size, const char *arg)
+{
+	/* Complete a mask given as nick, nick!user or user@host */
+
+	const char *bang = strchr(arg, '!'), *at = strchr(arg, '@');
+
+	if (bang && at)
+		snprintf(buf, size, "%s", arg);
+	else if (bang)
+		snprintf(buf, size, "%s@*", arg);
+	else if (at)
+		snprintf(buf, size, "*!%s", arg);
+	else
+		snprintf(buf, size, "%s!*@*", arg);
+}
+
+static int
+recv_filtered(server *s, parsed_mesg *p, unsigned int type, channel *c)
+{
+	/* Check a message against the filter rules, in channel c if given, else
+	 * in the channel it targets, if any.
+	 *
+	 * PRIVMSG and NOTICE are dropped by recv_mesg() before being handled,
+	 * other messages are handled without adding lines */
+
+	char chan[CHANSIZE];
+	size_t len;
+
+	if (!(filter_types(filters) & type))
+		return 0;
+
+	struct filter_mesg m = {
+		.type = type,
+		.nick = p->from,
+		.hostinfo = p->hostinfo,
+		.text = p->trailing
+	};
+
+	if (c == NULL && p->params && *p->params && strchr(s->isupport.chantypes, *p->params)) {
+
+		if ((len = strcspn(p->params, " ")) >= sizeof(chan))
+			len = sizeof(chan) - 1;
+
+		memcpy(chan, p->params, len);
+		chan[len] = '\0';
+
+		m.chan = chan;
+
+		c = channel_get(chan, s);
+	}
+
+	if (c) {
+		m.chan = c->name;
+		m.users = c->nick_count;
+	}
+
+	if (!filter_match(filters, s->isupport.casemap, &m))
+		return 0;
+
+	s->stats.recv_filtered++;
+
+	return 1;
+}
+
+static int
+recv_ignored(server *s, parsed_mesg *p, unsigned int type)
+{
+	/* Check a message's sender against the receiving server's ignore masks.
+	 *
+	 * PRIVMSG and NOTICE are checked as CTCP when their trailing is CTCP
+	 * markup, and dropped by recv_mesg() before being handled */
+
+	if (!p->from || !s->ignore)
+		return 0;
+
+	if ((type & (IGNORE_PRIVMSG | IGNORE_NOTICE)) && p->trailing && *p->trailing == 0x01)
+		type = IGNORE_CTCP;
+
+	return ignore_match(s->ignore, s->isupport.casemap, type, p->from, p->hostinfo);
+}
+
 void
 recv_mesg(char *inp, int count, server *s)
 {
 	char *ptr = s->iptr;
-	char *max = s->input + BUFFSIZE;
+	char *max = s->input + sizeof(s->input) - 1;
 
 	char errbuff[MAX_ERROR];
 
 	int err = 0;
 
+	char ref[BATCH_REFSIZE];
+
 	parsed_mesg p;
+	mesg_tag tag;
+	recv_t type = RECV_UNKNOWN;
 
 	while (count--) {
 		if (*inp == '\r') {
@@ -548,36 +1082,88 @@ recv_mesg(char *inp, int count, server *s)
 			newline(s->channel, 0, "", "");
 			newline(s->channel, 0, "DEBUG <<", s->input);
 #endif
-			if (!(parse(&p, s->input)))
+			s->stats.recv_lines++;
+
+			int parsed = parse(&p, s->input);
+
+			if (trace.read) {
+				trace.parse = time_us();
+				histogram_add(&trace.read_parse, trace.parse - trace.read);
+			}
+
+			/* Lines added for this message are timestamped by the server,
+			 * messages older than the latest received are replayed history */
+			if (parsed && p.tags && tag_get(p.tags, "time", &tag)) {
+				newline_time = tag_time(&tag);
+
+				if (newline_time > s->history_time)
+					s->history_time = newline_time;
+				else if (newline_time < s->history_time)
+					recv_history = 1;
+			}
+
+			/* Lines added for a message in an open batch are held until it ends */
+			if (parsed && p.tags && tag_get(p.tags, "batch", &tag)) {
+				tag_unescape(ref, sizeof(ref), &tag);
+				if ((newline_batch = batch_get(s, ref)))
+					recv_history = 1;
+			}
+
+			if (!parsed) {
+				s->stats.parse_errors++;
 				newline(s->channel, 0, "-!!-", "Failed to parse message");
+			}
 			else if (isdigit(*p.command))
-				err = recv_numeric(errbuff, &p, s);
+				err = recv_numeric(errbuff, &p, s), type = RECV_NUMERIC;
+			else if (!strcmp(p.command, "PRIVMSG") && recv_ignored(s, &p, IGNORE_PRIVMSG))
+				s->stats.recv_ignored++, type = RECV_PRIVMSG;
+			else if (!strcmp(p.command, "NOTICE") && recv_ignored(s, &p, IGNORE_NOTICE))
+				s->stats.recv_ignored++, type = RECV_NOTICE;
+			else if (!strcmp(p.command, "PRIVMSG") && recv_filtered(s, &p, FILTER_PRIVMSG, NULL))
+				type = RECV_PRIVMSG;
+			else if (!strcmp(p.command, "NOTICE") && recv_filtered(s, &p, FILTER_NOTICE, NULL))
+				type = RECV_NOTICE;
 			else if (!strcmp(p.command, "PRIVMSG"))
-				err = recv_priv(errbuff, &p, s);
+				err = recv_priv(errbuff, &p, s), type = RECV_PRIVMSG;
 			else if (!strcmp(p.command, "JOIN"))
-				err = recv_join(errbuff, &p, s);
+				err = recv_join(errbuff, &p, s), type = RECV_JOIN;
 			else if (!strcmp(p.command, "PART"))
-				err = recv_part(errbuff, &p, s);
+				err = recv_part(errbuff, &p, s), type = RECV_PART;
 			else if (!strcmp(p.command, "QUIT"))
-				err = recv_quit(errbuff, &p, s);
+				err = recv_quit(errbuff, &p, s), type = RECV_QUIT;
 			else if (!strcmp(p.command, "NOTICE"))
-				err = recv_notice(errbuff, &p, s);
+				err = recv_notice(errbuff, &p, s), type = RECV_NOTICE;
 			else if (!strcmp(p.command, "NICK"))
-				err = recv_nick(errbuff, &p, s);
+				err = recv_nick(errbuff, &p, s), type = RECV_NICK;
 			else if (!strcmp(p.command, "PING"))
-				err = recv_ping(errbuff, &p, s);
+				err = recv_ping(errbuff, &p, s), type = RECV_PING;
 			else if (!strcmp(p.command, "MODE"))
-				err = recv_mode(errbuff, &p, s);
+				err = recv_mode(errbuff, &p, s), type = RECV_MODE;
 			else if (!strcmp(p.command, "ERROR"))
-				err = recv_error(errbuff, &p, s);
-			else
+				err = recv_error(errbuff, &p, s), type = RECV_ERROR;
+			else if (!strcmp(p.command, "BATCH"))
+				err = recv_batch(errbuff, &p, s), type = RECV_BATCH;
+			else if (!strcmp(p.command, "CAP"))
+				err = recv_cap(errbuff, &p, s), type = RECV_CAP;
+			else {
 				newlinef(s->channel, 0, "-!!-", "Message type '%s' unknown", p.command);
+				type = RECV_UNKNOWN;
+			}
+
+			if (p.command)
+				s->stats.recv_types[type]++;
 
 			if (err)
 				newlinef(s->channel, 0, "-!!-", "%s", errbuff);
 
+			err = 0;
 			ptr = s->input;
 
+			newline_batch = NULL;
+			newline_time = 0;
+			recv_history = 0;
+			trace.parse = 0;
+
 		/* Don't accept unprintable characters unless space or ctcp markup */
 		} else if (ptr < max && (isgraph(*inp) || *inp == ' ' || *inp == 0x01))
 			*ptr++ = *inp;
@@ -588,6 +1174,128 @@ recv_mesg(char *inp, int count, server *s)
 	s->iptr = ptr;
 }
 
+static int
+recv_batch(char *err, parsed_mesg *p, server *s)
+{
+	/* BATCH +<ref> <type> [params]
+	 * BATCH -<ref> */
+
+	char *ref, *type;
+
+	if (!p->params || !(ref = strtok_r(p->params, " ", &p->params)))
+		fail("BATCH: reference is null");
+
+	if (*ref == '+') {
+
+		if (!(type = strtok_r(p->params, " ", &p->params)))
+			fail("BATCH: type is null");
+
+		/* Only history playback is held, other batches are handled as they arrive */
+		if (!strcmp(type, "chathistory") || !strcmp(type, "znc.in/playback"))
+			batch_start(s, ref + 1);
+
+		return 0;
+	}
+
+	if (*ref == '-') {
+		batch_end(s, ref + 1);
+		return 0;
+	}
+
+	failf("BATCH: invalid reference '%s'", ref);
+}
+
+static int
+recv_cap(char *err, parsed_mesg *p, server *s)
+{
+	/* :server CAP <target> LS [*] :<capabilities>
+	 * :server CAP <target> ACK :<capabilities>
+	 * :server CAP <target> NAK :<capabilities>
+	 * :server CAP <target> DEL :<capabilities> */
+
+	char *cmd, *more, *cap, *val, buff[BUFFSIZE];
+	unsigned int i, found = 0;
+	size_t len = 0;
+
+	if (!p->params || !strtok_r(p->params, " ", &p->params))
+		fail("CAP: target is null");
+
+	if (!(cmd = strtok_r(p->params, " ", &p->params)))
+		fail("CAP: subcommand is null");
+
+	more = strtok_r(p->params, " ", &p->params);
+
+	/* A single capability might not be sent as trailing */
+	if (!p->trailing) {
+		p->trailing = more;
+		more = NULL;
+	}
+
+	if (!p->trailing)
+		fail("CAP: capabilities are null");
+
+	/* Capabilities found, as a bitmask of indices in caps[] */
+	while ((cap = strtok_r(p->trailing, " ", &p->trailing))) {
+
+		/* CAP LS 302 lists capabilities with values, cap=value */
+		if ((val = strchr(cap, '=')))
+			*val = '\0';
+
+		for (i = 0; i < CAPS; i++)
+			if (!strcmp(cap, caps[i].name))
+				found |= (1 << i);
+	}
+
+	if (!strcmp(cmd, "LS")) {
+
+		s->caps_ls |= found;
+
+		/* The list continues in another message */
+		if (more && !strcmp(more, "*"))
+			return 0;
+
+		for (i = 0; i < CAPS; i++)
+			if (s->caps_ls & (1 << i))
+				len += snprintf(buff + len, sizeof(buff) - len, "%s%s", len ? " " : "", caps[i].name);
+
+		s->caps_ls = 0;
+
+		if (len)
+			return sendf(err, s, "CAP REQ :%s", buff);
+
+		return sendf(err, s, "CAP END");
+	}
+
+	if (!strcmp(cmd, "ACK")) {
+
+		for (i = 0; i < CAPS; i++) {
+			if (found & (1 << i)) {
+				s->caps |= caps[i].cap;
+				len += snprintf(buff + len, sizeof(buff) - len, "%s%s", len ? " " : "", caps[i].name);
+			}
+		}
+
+		if (len)
+			newlinef(s->channel, 0, "--", "Capabilities enabled: %s", buff);
+
+		return sendf(err, s, "CAP END");
+	}
+
+	if (!strcmp(cmd, "NAK"))
+		return sendf(err, s, "CAP END");
+
+	if (!strcmp(cmd, "DEL")) {
+
+		for (i = 0; i < CAPS; i++)
+			if (found & (1 << i))
+				s->caps &= ~caps[i].cap;
+
+		return 0;
+	}
+
+	return 0;
+}
+
 static int
 recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 {
@@ -600,14 +1308,10 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 	if (!p->from)
 		fail("CTCP: sender's nick is null");
 
-	/* CTCP request from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
-
-	if (!(targ = strtok(p->params, " ")))
+	if (!p->params || !(targ = strtok(p->params, " ")))
 		fail("CTCP: target is null");
 
-	if (!(mesg = strtok(p->trailing, "\x01")))
+	if (!p->trailing || !(mesg = strtok(p->trailing, "\x01")))
 		fail("CTCP: invalid markup");
 
 	/* Markup is valid, get command */
@@ -625,7 +1329,7 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 				c->type = 'p';
 			}
 
-			if (c != ccur)
+			if (c != ccur && !recv_history)
 				c->active = ACTIVITY_PINGED;
 
 		} else if ((c = channel_get(targ, s)) == NULL)
@@ -656,7 +1360,7 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 }
 
 static int
-recv_ctcp_rpl(char *err, parsed_mesg *p)
+recv_ctcp_rpl(char *err, parsed_mesg *p, server *s)
 {
 	/* CTCP replies:
 	 * NOTICE <target> :0x01<command> <arguments>0x01 */
@@ -666,11 +1370,9 @@ recv_ctcp_rpl(char *err, parsed_mesg *p)
 	if (!p->from)
 		fail("CTCP: sender's nick is null");
 
-	/* CTCP reply from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
+	UNUSED(s);
 
-	if (!(mesg = strtok(p->trailing, "\x01")))
+	if (!p->trailing || !(mesg = strtok(p->trailing, "\x01")))
 		fail("CTCP: invalid markup");
 
 	/* Markup is valid, get command */
@@ -702,6 +1404,8 @@ recv_join(char *err, parsed_mesg *p, server *s)
 
 	char *chan;
 	channel *c;
+	avl_node *n;
+	struct netsplit *split;
 
 	if (!p->from)
 		fail("JOIN: sender's nick is null");
@@ -719,29 +1423,48 @@ recv_join(char *err, parsed_mesg *p, server *s)
 	/* FIXME: temporary fix for the above issue */
 	if (!p->params)
 		p->params = p->trailing;
-	if (!(chan = strtok(p->params, " ")))
+	if (!p->params || !(chan = strtok(p->params, " ")))
 		fail("JOIN: channel is null");
 
 	if (IS_ME(p->from)) {
 		if ((c = channel_get(chan, s)) == NULL)
-			ccur = new_channel(chan, s, ccur);
+			c = ccur = new_channel(chan, s, ccur);
 		else {
 			c->parted = 0;
 			newlinef(c, 0, ">", "You have rejoined %s", chan);
 		}
 		draw(D_FULL);
+
+		/* Members staged from an earlier NAMES reply that never ended are stale */
+		reset_names(c);
+
+		/* The key the channel was joined with is kept for rejoining on reconnect */
+		if ((n = avl_get(s->join_keys, s->isupport.casemap, chan, strlen(chan) + 1))) {
+			free(c->key);
+			c->key = n->val;
+			n->val = NULL;
+			avl_del(&s->join_keys, s->isupport.casemap, chan);
+		}
+
+		/* A bouncer's playback covers all channels, see RPL_WELCOME */
+		if ((s->caps & CAP_CHATHISTORY) && !(s->caps & CAP_PLAYBACK))
+			return request_history(err, s, chan);
 	} else {
 
 		if ((c = channel_get(chan, s)) == NULL)
 			failf("JOIN: channel '%s' not found", chan);
 
-		if (!avl_add(&(c->nicklist), p->from, NULL))
+		if (!avl_add(&(c->nicklist), s->isupport.casemap, p->from, NULL))
 			failf("JOIN: nick '%s' already in '%s'", p->from, chan);
 
 		c->nick_count++;
 
-		if (c->nick_count < config.join_part_quit_threshold)
-			newlinef(c, 0, ">", "%s!%s has joined %s", p->from, p->hostinfo, chan);
+		if (!recv_ignored(s, p, IGNORE_JOIN) && !recv_filtered(s, p, FILTER_JOIN, c)) {
+			if ((split = netsplit_find(s, p->from)))
+				netsplit_add(split, c, p->from, 1);
+			else
+				newlinef(c, 0, ">", "%s!%s has joined %s", p->from, p->hostinfo, chan);
+		}
 
 		draw(D_STATUS);
 	}
@@ -749,34 +1472,209 @@ recv_join(char *err, parsed_mesg *p, server *s)
 	return 0;
 }
 
+static void
+recv_isupport(server *s, char *param)
+{
+	/* <param>[=<value>], or -<param> to reset it to its default
+	 *
+	 * Unknown and malformed parameters are ignored */
+
+	const struct isupport *d = &isupport_default;
+	char *val, *end;
+	int i, reset;
+
+	if ((reset = (*param == '-')))
+		param++;
+
+	if ((val = strchr(param, '=')))
+		*val++ = '\0';
+	else
+		val = "";
+
+	if (!strcmp(param, "CASEMAPPING")) {
+
+		/* Unknown casemappings, e.g. rfc7613, fold at least ascii */
+		if (reset)
+			s->isupport.casemap = d->casemap;
+		else if (!strcmp(val, "rfc1459"))
+			s->isupport.casemap = casemap_rfc1459;
+		else if (!strcmp(val, "strict-rfc1459"))
+			s->isupport.casemap = casemap_strict_rfc1459;
+		else
+			s->isupport.casemap = casemap_ascii;
+
+		/* Highlights are recompiled for the new casemapping */
+		highlight_free(s->highlight);
+		s->highlight = NULL;
+	}
+
+	else if (!strcmp(param, "CHANMODES")) {
+
+		/* CHANMODES=A,B,C,D, types may be empty and more may be added */
+		for (i = 0; i < 4; i++) {
+
+			if (reset) {
+				strcpy(s->isupport.chanmodes[i], d->chanmodes[i]);
+				continue;
+			}
+
+			if ((end = strchr(val, ',')))
+				*end = '\0';
+
+			snprintf(s->isupport.chanmodes[i], ISUPPORT_SIZE, "%s", val);
+
+			val = (end) ? end + 1 : "";
+		}
+	}
+
+	else if (!strcmp(param, "CHANTYPES")) {
+
+		if (reset)
+			strcpy(s->isupport.chantypes, d->chantypes);
+		else
+			snprintf(s->isupport.chantypes, ISUPPORT_SIZE, "%s", val);
+	}
+
+	else if (!strcmp(param, "NICKLEN")) {
+
+		/* Nicks longer than NICKSIZE are never accepted */
+		s->isupport.nicklen = d->nicklen;
+
+		if (!reset && (i = atoi(val)) > 0 && i < NICKSIZE)
+			s->isupport.nicklen = i;
+	}
+
+	else if (!strcmp(param, "TARGMAX")) {
+
+		/* TARGMAX=<cmd>:[max],... with no max when empty, only JOIN is used */
+		s->isupport.targmax_join = d->targmax_join;
+
+		while (!reset && (end = strtok_r(val, ",", &val))) {
+			if (!strncmp(end, "JOIN:", strlen("JOIN:")) && (i = atoi(end + strlen("JOIN:"))) > 0)
+				s->isupport.targmax_join = i;
+		}
+	}
+
+	else if (!strcmp(param, "PREFIX")) {
+
+		/* PREFIX=(modes)chars, with a prefix character for each mode, or empty */
+		if (reset) {
+			strcpy(s->isupport.prefix_modes, d->prefix_modes);
+			strcpy(s->isupport.prefix_chars, d->prefix_chars);
+		}
+
+		else if (*val == '\0') {
+			*s->isupport.prefix_modes = '\0';
+			*s->isupport.prefix_chars = '\0';
+		}
+
+		else if (*val == '(' && (end = strchr(val, ')'))
+				&& end - val - 1 == (int) strlen(end + 1)
+				&& end - val - 1 < ISUPPORT_SIZE) {
+
+			*end = '\0';
+
+			strcpy(s->isupport.prefix_modes, val + 1);
+			strcpy(s->isupport.prefix_chars, end + 1);
+		}
+	}
+}
+
+void
+reset_isupport(server *s)
+{
+	/* Reset a server's ISUPPORT parameters, until sent in RPL_ISUPPORT */
+
+	s->isupport = isupport_default;
+
+	highlight_free(s->highlight);
+	s->highlight = NULL;
+}
+
+static char*
+mode_arg(parsed_mesg *p)
+{
+	/* Get a MODE message's next flags or argument, from the params then the trailing */
+
+	char *arg;
+
+	if ((arg = getarg(&p->params, 1)))
+		return arg;
+
+	return getarg(&p->trailing, 1);
+}
+
 static int
 recv_mode(char *err, parsed_mesg *p, server *s)
 {
-	/* :nick!user@hostname.domain MODE <targ> :<flags> */
+	/* :nick!user@hostname.domain MODE <targ> <flags> [<args>] */
 
 	int modebit;
-	char *targ, *flags, plusminus = '\0';
+	char *arg, *mode, *targ, *flags, plusminus = '\0';
+	avl_node *n;
 
 	if (!p->from)
 		fail("MODE: sender's nick is null");
 
-	if (!(targ = strtok(p->params, " ")))
+	if (!p->params || !(targ = getarg(&p->params, 1)))
 		fail("MODE: target is null");
 
-	/* FIXME: is this true?? why do i even get mode message then? */
-	/* Flags can be null */
-	if (!(flags = p->trailing))
-		return 0;
+	/* Flags can be null */
+	if (!(flags = mode_arg(p)))
+		return 0;
+
+	channel *c;
+	if ((c = channel_get(targ, s))) {
+
+		int *chanmode = &c->chanmode;
+
+		newlinef(c, 0, "--", "%s set %s mode: [%s%s%s%s%s]", p->from, targ, flags,
+				(p->params && *p->params) ? " " : "", (p->params) ? p->params : "",
+				(p->trailing) ? " " : "", (p->trailing) ? p->trailing : "");
+
+		/* Chanmodes */
+		do {
+			if (*flags != '+' && *flags != '-') {
+
+				if (plusminus == '\0')
+					failf("MODE: invalid format (%s)", flags);
+
+				/* Prefix modes set a member's status, by the bit of the mode's rank */
+				if ((mode = strchr(s->isupport.prefix_modes, *flags))) {
+
+					if (!(arg = mode_arg(p)))
+						failf("MODE: '%c' nick is null", *flags);
+
+					if (!(n = avl_get(c->nicklist, s->isupport.casemap, arg, strlen(arg) + 1)))
+						continue;
+
+					if (plusminus == '+')
+						n->prefix |= PREFIX_BIT(mode - s->isupport.prefix_modes);
+					else
+						n->prefix &= ~PREFIX_BIT(mode - s->isupport.prefix_modes);
+
+					continue;
+				}
+
+				/* CHANMODES type A and B take an argument, type C only when set */
+				arg = NULL;
+
+				if (strchr(s->isupport.chanmodes[0], *flags)
+						|| strchr(s->isupport.chanmodes[1], *flags)
+						|| (plusminus == '+' && strchr(s->isupport.chanmodes[2], *flags)))
+					arg = mode_arg(p);
 
-	channel *c;
-	if ((c = channel_get(targ, s))) {
+				/* The channel key is kept for rejoining on reconnect */
+				if (*flags == 'k') {
 
-		int *chanmode = &c->chanmode;
+					free(c->key);
+					c->key = NULL;
 
-		newlinef(c, 0, "--", "%s set %s mode: [%s]", p->from, targ, flags);
+					if (plusminus == '+' && arg && (c->key = strdup(arg)) == NULL)
+						fatal("strdup");
+				}
+			}
 
-		/* Chanmodes */
-		do {
 			switch (*flags) {
 				case '+':
 				case '-':
@@ -838,9 +1736,6 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 					continue;
 			}
 
-			if (plusminus == '\0')
-				failf("MODE: invalid format (%s)", p->trailing);
-
 			if (plusminus == '+')
 				*chanmode |= modebit;
 			else
@@ -849,7 +1744,7 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 		} while (*(++flags) != '\0');
 	}
 
-	if (IS_ME(targ)) {
+	else if (IS_ME(targ)) {
 
 		int *usermode = &s->usermode;
 
@@ -892,7 +1787,7 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 			}
 
 			if (plusminus == '\0')
-				failf("MODE: invalid format (%s)", p->trailing);
+				failf("MODE: invalid format (%s)", flags);
 
 			if (plusminus == '+')
 				*usermode |= modebit;
@@ -922,7 +1817,7 @@ recv_nick(char *err, parsed_mesg *p, server *s)
 	/* FIXME: temporary fix for the issue strtok issue */
 	if (!p->params)
 		p->params = p->trailing;
-	if (!(nick = strtok(p->params, " ")))
+	if (!p->params || !(nick = strtok(p->params, " ")))
 		fail("NICK: new nick is null");
 
 	if (IS_ME(p->from)) {
@@ -930,11 +1825,25 @@ recv_nick(char *err, parsed_mesg *p, server *s)
 		newlinef(s->channel, 0, "--", "You are now known as %s", nick);
 	}
 
+	int ignored = recv_ignored(s, p, IGNORE_NICK);
+
+	avl_node *n;
+	unsigned int prefix;
+
 	channel *c = s->channel;
 	do {
-		if (avl_del(&c->nicklist, p->from)) {
-			avl_add(&c->nicklist, nick, NULL);
-			newlinef(c, 0, "--", "%s  >>  %s", p->from, nick);
+		/* Members keep their prefix across nick changes */
+		if ((n = avl_get(c->nicklist, s->isupport.casemap, p->from, strlen(p->from) + 1))) {
+
+			prefix = n->prefix;
+
+			avl_del(&c->nicklist, s->isupport.casemap, p->from);
+
+			if (avl_add(&c->nicklist, s->isupport.casemap, nick, NULL))
+				avl_get(c->nicklist, s->isupport.casemap, nick, strlen(nick) + 1)->prefix = prefix;
+
+			if (!ignored && !recv_filtered(s, p, FILTER_NICK, c))
+				newlinef(c, 0, "--", "%s  >>  %s", p->from, nick);
 		}
 	} while ((c = c->next) != s->channel);
 
@@ -954,16 +1863,12 @@ recv_notice(char *err, parsed_mesg *p, server *s)
 
 	/* CTCP reply */
 	if (*p->trailing == 0x01)
-		return recv_ctcp_rpl(err, p);
+		return recv_ctcp_rpl(err, p, s);
 
 	if (!p->from)
 		fail("NOTICE: sender's nick is null");
 
-	/* Notice from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
-
-	if (!(targ = strtok(p->params, " ")))
+	if (!p->params || !(targ = strtok(p->params, " ")))
 		fail("NOTICE: target is null");
 
 	if ((c = channel_get(targ, s)))
@@ -980,13 +1885,18 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 	/* :server <numeric> <target> [args] */
 
 	channel *c;
-	char *nick, *chan, *time, *type, *num;
+	char *nick, *chan, *time, *type, *num, *ptr, *modes, *arg;
+	unsigned int prefix;
 
 	/* Target should be s->nick_me, or '*' if unregistered.
 	 * Currently not used for anything */
-	if (!(nick = strtok_r(p->params, " ", &p->params)))
+	if (!p->params || !(nick = strtok_r(p->params, " ", &p->params)))
 		fail("NUMERIC: target is null");
 
+	/* Numerics without a trailing parameter are handled as if it were empty */
+	if (!p->trailing)
+		p->trailing = "";
+
 	/* Extract numeric code */
 	int code = 0;
 	do {
@@ -1012,19 +1922,11 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 		/* Reset list of auto nicks */
 		s->nptr = config.nicks;
 
-		if (config.auto_join) {
-			/* Only send the autojoin on command-line connect */
-			fail_if(sendf(err, s, "JOIN %s", config.auto_join));
-			config.auto_join = NULL;
-		} else {
-			/* If reconnecting to server, join any non-parted channels */
-			c = s->channel;
-			do {
-				if (c->type && c->type != 'p' && !c->parted)
-					fail_if(sendf(err, s, "JOIN %s", c->name));
-				c = c->next;
-			} while (c != s->channel);
-		}
+		/* Play back the bouncer's buffers since the last message seen */
+		if (s->caps & CAP_PLAYBACK)
+			fail_if(sendf(err, s, "PRIVMSG *playback :PLAY * %ld", (long) s->history_time));
+
+		fail_if(join_channels(err, s));
 
 		newline(s->channel, 0, "--", p->trailing);
 		return 0;
@@ -1038,9 +1940,18 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 
 
 	case RPL_MYINFO:    /* 004 <nick> <params> :Are supported by this server */
+
+		newlinef(s->channel, 0, "--", "%s ~ supported by this server", p->params);
+		return 0;
+
+
 	case RPL_ISUPPORT:  /* 005 <nick> <params> :Are supported by this server */
 
 		newlinef(s->channel, 0, "--", "%s ~ supported by this server", p->params);
+
+		while ((type = strtok_r(p->params, " ", &p->params)))
+			recv_isupport(s, type);
+
 		return 0;
 
 
@@ -1055,6 +1966,40 @@ num_200:
 	/* Numeric types (200, 400) */
 	switch (code) {
 
+	/* 324 <channel> <modes> [<args>] */
+	case RPL_CHANNELMODEIS:
+
+		if (!(chan = strtok_r(p->params, " ", &p->params)))
+			fail("RPL_CHANNELMODEIS: channel is null");
+
+		if ((c = channel_get(chan, s)) == NULL)
+			failf("RPL_CHANNELMODEIS: channel '%s' not found", chan);
+
+		if (!(modes = mode_arg(p)))
+			fail("RPL_CHANNELMODEIS: modes are null");
+
+		newlinef(c, 0, "--", "Mode for %s is: [%s%s%s%s%s]", chan, modes,
+				(p->params && *p->params) ? " " : "", (p->params) ? p->params : "",
+				(*p->trailing) ? " " : "", p->trailing);
+
+		/* Set modes with an argument are CHANMODES type B and C, the channel
+		 * key is kept for rejoining on reconnect */
+		for (; *modes; modes++) {
+
+			if (!strchr(s->isupport.chanmodes[1], *modes) && !strchr(s->isupport.chanmodes[2], *modes))
+				continue;
+
+			if ((arg = mode_arg(p)) && *modes == 'k') {
+
+				free(c->key);
+
+				if ((c->key = strdup(arg)) == NULL)
+					fatal("strdup");
+			}
+		}
+		return 0;
+
+
 	/* 328 <channel> :<url> */
 	case RPL_CHANNEL_URL:
 
@@ -1103,7 +2048,7 @@ num_200:
 		return 0;
 
 
-	/* 353 ("="/"*"/"@") <channel> :*([ "@" / "+" ]<nick>) */
+	/* 353 ("="/"*"/"@") <channel> :*(*[ <prefix> ]<nick>) */
 	case RPL_NAMREPLY:
 
 		/* @:secret   *:private   =:public */
@@ -1118,13 +2063,49 @@ num_200:
 
 		c->type = *type;
 
+		/* Members are staged until RPL_ENDOFNAMES, and the nicklist built at once */
 		while ((nick = strtok_r(p->trailing, " ", &p->trailing))) {
-			if (*nick == '@' || *nick == '+')
-				nick++;
-			if (avl_add(&c->nicklist, nick, NULL))
-				c->nick_count++;
+
+			/* Nicks are prefixed by any of the PREFIX characters, or all with multi-prefix */
+			for (prefix = 0; *nick && (ptr = strchr(s->isupport.prefix_chars, *nick)); nick++)
+				prefix |= PREFIX_BIT(ptr - s->isupport.prefix_chars);
+
+			if (*nick == '\0')
+				continue;
+
+			if (c->names.len == c->names.size) {
+				c->names.size = c->names.size ? c->names.size * 2 : 64;
+				if ((c->names.nodes = realloc(c->names.nodes, c->names.size * sizeof(avl_node*))) == NULL)
+					fatal("realloc");
+			}
+
+			c->names.nodes[c->names.len] = avl_new_node(nick, NULL);
+			c->names.nodes[c->names.len++]->prefix = prefix;
 		}
 
+		return 0;
+
+
+	/* 366 <channel> :<Message> */
+	case RPL_ENDOFNAMES:
+
+		if (!(chan = strtok_r(p->params, " ", &p->params)))
+			fail("RPL_ENDOFNAMES: channel is null");
+
+		/* Channels not joined have no names staged */
+		if ((c = channel_get(chan, s)) == NULL || c->names.len == 0)
+			return 0;
+
+		/* The reply lists all nicks in the channel, replacing the nicklist */
+		free_avl(c->nicklist);
+
+		c->nicklist = avl_build(s->isupport.casemap, c->names.nodes, &c->names.len);
+		c->nick_count = c->names.len;
+
+		/* The staged nodes are now the nicklist's */
+		c->names.len = 0;
+		reset_names(c);
+
 		draw(D_STATUS);
 		return 0;
 
@@ -1159,7 +2140,6 @@ num_200:
 
 	/* Not printing these */
 	case RPL_NOTOPIC:     /* 331 <chan> :<Message> */
-	case RPL_ENDOFNAMES:  /* 366 <chan> :<Message> */
 	case RPL_ENDOFMOTD:   /* 376 :<Message> */
 
 		return 0;
@@ -1237,7 +2217,7 @@ recv_part(char *err, parsed_mesg *p, server *s)
 	if (!p->from)
 		fail("PART: sender's nick is null");
 
-	if (!(targ = strtok_r(p->params, " ", &p->params)))
+	if (!p->params || !(targ = strtok_r(p->params, " ", &p->params)))
 		fail("PART: target is null");
 
 	if (IS_ME(p->from)) {
@@ -1252,6 +2232,8 @@ recv_part(char *err, parsed_mesg *p, server *s)
 			free_avl(c->nicklist);
 			c->nicklist = NULL;
 
+			reset_names(c);
+
 			if (p->trailing)
 				newlinef(c, 0, "<", "you have left %s (%s)", targ, p->trailing);
 			else
@@ -1266,12 +2248,12 @@ recv_part(char *err, parsed_mesg *p, server *s)
 	if ((c = channel_get(targ, s)) == NULL)
 		failf("PART: channel '%s' not found", targ);
 
-	if (!avl_del(&c->nicklist, p->from))
+	if (!avl_del(&c->nicklist, s->isupport.casemap, p->from))
 		failf("PART: nick '%s' not found in '%s'", p->from, targ);
 
 	c->nick_count--;
 
-	if (c->nick_count < config.join_part_quit_threshold) {
+	if (!recv_ignored(s, p, IGNORE_JOIN) && !recv_filtered(s, p, FILTER_PART, c)) {
 		if (p->trailing)
 			newlinef(c, 0, "<", "%s!%s has left %s (%s)", p->from, p->hostinfo, targ, p->trailing);
 		else
@@ -1312,11 +2294,7 @@ recv_priv(char *err, parsed_mesg *p, server *s)
 	if (!p->from)
 		fail("PRIVMSG: sender's nick is null");
 
-	/* Privmesg from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
-
-	if (!(targ = strtok_r(p->params, " ", &p->params)))
+	if (!p->params || !(targ = strtok_r(p->params, " ", &p->params)))
 		fail("PRIVMSG: target is null");
 
 	/* Find the target channel */
@@ -1327,17 +2305,21 @@ recv_priv(char *err, parsed_mesg *p, server *s)
 			c->type = 'p';
 		}
 
-		if (c != ccur)
+		if (c != ccur && !recv_history)
 			c->active = ACTIVITY_PINGED;
 
 	} else if ((c = channel_get(targ, s)) == NULL)
 		failf("PRIVMSG: channel '%s' not found", targ);
 
-	if (check_pinged(p->trailing, s->nick_me)) {
+	/* Highlights replayed from history are marked, but don't ping */
+	if (check_highlight(s, p->trailing)) {
 
-		if (c != ccur)
+		if (c != ccur && !recv_history)
 			c->active = ACTIVITY_PINGED;
 
+		if (!recv_history)
+			draw_bell();
+
 		newline(c, LINE_PINGED, p->from, p->trailing);
 	} else
 		newline(c, LINE_CHAT, p->from, p->trailing);
@@ -1345,6 +2327,41 @@ recv_priv(char *err, parsed_mesg *p, server *s)
 	return 0;
 }
 
+static int
+check_highlight(server *s, const char *mesg)
+{
+	/* Check a message for highlights of the current nick, any of the
+	 * configured nicks, or keywords.
+	 *
+	 * These are compiled into a single automaton per server, recompiled
+	 * when the server's nick or casemapping changes */
+
+	char *words;
+	size_t len;
+
+	if (s->highlight == NULL || strcmp(s->highlight_nick, s->nick_me)) {
+
+		const char *nicks = config.nicks ? config.nicks : "";
+		const char *keywords = config.highlights ? config.highlights : "";
+
+		len = strlen(s->nick_me) + strlen(nicks) + strlen(keywords) + 3;
+
+		if ((words = malloc(len)) == NULL)
+			fatal("malloc");
+
+		snprintf(words, len, "%s,%s,%s", s->nick_me, nicks, keywords);
+
+		highlight_free(s->highlight);
+		s->highlight = highlight_compile(s->isupport.casemap, words);
+
+		strcpy(s->highlight_nick, s->nick_me);
+
+		free(words);
+	}
+
+	return highlight_match(s->highlight, mesg);
+}
+
 static int
 recv_quit(char *err, parsed_mesg *p, server *s)
 {
@@ -1353,12 +2370,22 @@ recv_quit(char *err, parsed_mesg *p, server *s)
 	if (!p->from)
 		fail("QUIT: sender's nick is null");
 
+	int ignored = recv_ignored(s, p, IGNORE_JOIN);
+
+	/* Quits with a netsplit's reason are summarized with the split */
+	struct netsplit *split = NULL;
+
+	if (!ignored && p->trailing && netsplit_reason(p->trailing))
+		split = netsplit_get(s, p->trailing);
+
 	channel *c = s->channel;
 	do {
-		if (avl_del(&c->nicklist, p->from)) {
+		if (avl_del(&c->nicklist, s->isupport.casemap, p->from)) {
 			c->nick_count--;
-			if (c->nick_count < config.join_part_quit_threshold) {
-				if (p->trailing)
+			if (!ignored && !recv_filtered(s, p, FILTER_QUIT, c)) {
+				if (split)
+					netsplit_add(split, c, p->from, 0);
+				else if (p->trailing)
 					newlinef(c, 0, "<", "%s!%s has quit (%s)", p->from, p->hostinfo, p->trailing);
 				else
 					newlinef(c, 0, "<", "%s!%s has quit", p->from, p->hostinfo);
@@ -1367,7 +2394,396 @@ recv_quit(char *err, parsed_mesg *p, server *s)
 		c = c->next;
 	} while (c != s->channel);
 
+	if (split)
+		avl_add(&split->nicks, s->isupport.casemap, p->from, NULL);
+
 	draw(D_STATUS);
 
 	return 0;
 }
+
+static int
+netsplit_reason(const char *reason)
+{
+	/* Check a quit reason for a netsplit's, i.e. the names of the two servers
+	 * split, e.g. "hub.server.tld leaf.server.tld", or masked as "*.net *.split"
+	 *
+	 * Names must differ and contain '.', with none at their ends or repeated */
+
+	const char *ptr = reason, *space = NULL;
+
+	for (;;) {
+
+		const char *name = ptr;
+
+		for (; *ptr && *ptr != ' '; ptr++) {
+
+			if (*ptr == '.' && (ptr == name || ptr[1] == '.' || ptr[1] == ' ' || ptr[1] == '\0'))
+				return 0;
+
+			if (*ptr != '.' && !isalnum((unsigned char) *ptr) && *ptr != '-' && *ptr != '*' && *ptr != '_')
+				return 0;
+		}
+
+		if (!memchr(name, '.', ptr - name))
+			return 0;
+
+		if (space || *ptr == '\0')
+			break;
+
+		space = ptr++;
+	}
+
+	if (space == NULL || *ptr)
+		return 0;
+
+	return (space - reason != ptr - space - 1 || strncmp(reason, space + 1, space - reason));
+}
+
+static struct netsplit*
+netsplit_find(server *s, const char *nick)
+{
+	/* Find the netsplit a nick was lost to, if any, moving the nick to the
+	 * split's rejoins so only its joins until the next summary are collected */
+
+	struct netsplit *split;
+	size_t len = strlen(nick) + 1;
+
+	for (split = s->netsplit; split; split = split->next) {
+		if (avl_get(split->rejoins, s->isupport.casemap, nick, len))
+			return split;
+		if (avl_del(&split->nicks, s->isupport.casemap, nick)) {
+			avl_add(&split->rejoins, s->isupport.casemap, nick, NULL);
+			return split;
+		}
+	}
+
+	return NULL;
+}
+
+static struct netsplit*
+netsplit_get(server *s, const char *reason)
+{
+	/* Get the netsplit for a quit reason, starting it if new */
+
+	char servers[BUFFSIZE];
+	const char *space = strchr(reason, ' ');
+	struct netsplit *split;
+
+	snprintf(servers, sizeof(servers), "%.*s <-> %s", (int)(space - reason), reason, space + 1);
+
+	for (split = s->netsplit; split; split = split->next)
+		if (!strcmp(split->servers, servers))
+			break;
+
+	if (split == NULL) {
+
+		if ((split = calloc(1, sizeof(*split) + strlen(servers) + 1)) == NULL)
+			fatal("calloc");
+
+		strcpy(split->servers, servers);
+
+		split->next = s->netsplit;
+		s->netsplit = split;
+	}
+
+	split->quit_time = time(NULL);
+
+	if (split->quit_first == 0)
+		split->quit_first = split->quit_time;
+
+	return split;
+}
+
+static void
+netsplit_add(struct netsplit *split, channel *c, const char *nick, int joined)
+{
+	/* Add a nick's quit or rejoin in a channel to the split's summary */
+
+	struct netsplit_chan *sc;
+	unsigned int *count;
+	size_t *len;
+	char *str;
+
+	for (sc = split->chans; sc; sc = sc->next)
+		if (!strcmp(sc->name, c->name))
+			break;
+
+	if (sc == NULL) {
+
+		if ((sc = calloc(1, sizeof(*sc))) == NULL)
+			fatal("calloc");
+
+		strcpy(sc->name, c->name);
+
+		sc->next = split->chans;
+		split->chans = sc;
+	}
+
+	if (joined) {
+		split->join_time = time(NULL);
+		if (split->join_first == 0)
+			split->join_first = split->join_time;
+		count = &sc->joins, len = &sc->joins_len, str = sc->joins_str;
+	} else {
+		count = &sc->quits, len = &sc->quits_len, str = sc->quits_str;
+	}
+
+	/* Nicks that don't fit are only counted */
+	if (*len + strlen(nick) + 2 < NETSPLIT_NICKS)
+		*len += sprintf(str + *len, "%s%s", *len ? ", " : "", nick);
+
+	(*count)++;
+}
+
+static void
+netsplit_line(channel *c, struct netsplit *split, const char *type, unsigned int count, const char *nicks, size_t len)
+{
+	/* Add a channel's summary line for the nicks quit or rejoined */
+
+	unsigned int listed = 0;
+	const char *ptr;
+
+	for (ptr = nicks; len && ptr; ptr = strchr(ptr + 1, ','))
+		listed++;
+
+	if (listed < count)
+		newlinef(c, 0, (*type == 'j') ? ">" : "<", "Netsplit %s, %s: %s (+%u more)",
+				split->servers, type, nicks, count - listed);
+	else
+		newlinef(c, 0, (*type == 'j') ? ">" : "<", "Netsplit %s, %s: %s",
+				split->servers, type, nicks);
+}
+
+void
+check_netsplits(server *s, time_t t)
+{
+	/* Summarize a server's netsplits' quits and rejoins once none have been
+	 * received for NETSPLIT_DELAY, or held for NETSPLIT_HOLD, and end the
+	 * netsplits once their nicks are no longer expected to rejoin */
+
+	struct netsplit *split, **split_ptr = &s->netsplit;
+	struct netsplit_chan *sc, **sc_ptr;
+	channel *c;
+
+	while ((split = *split_ptr)) {
+
+		int quits_due = split->quit_first
+			&& (t - split->quit_time >= NETSPLIT_DELAY || t - split->quit_first >= NETSPLIT_HOLD);
+
+		int joins_due = split->join_first
+			&& (t - split->join_time >= NETSPLIT_DELAY || t - split->join_first >= NETSPLIT_HOLD);
+
+		if (quits_due)
+			split->quit_first = 0;
+
+		if (joins_due) {
+			split->join_first = 0;
+			free_avl(split->rejoins);
+			split->rejoins = NULL;
+		}
+
+		for (sc_ptr = &split->chans; (sc = *sc_ptr);) {
+
+			c = channel_get(sc->name, s);
+
+			/* Quits are summarized before rejoins */
+			if (quits_due && sc->quits) {
+				if (c)
+					netsplit_line(c, split, "quit", sc->quits, sc->quits_str, sc->quits_len);
+				sc->quits = 0;
+				sc->quits_len = 0;
+			}
+
+			if (joins_due && sc->joins) {
+				if (c)
+					netsplit_line(c, split, "joined", sc->joins, sc->joins_str, sc->joins_len);
+				sc->joins = 0;
+				sc->joins_len = 0;
+			}
+
+			if (sc->quits || sc->joins) {
+				sc_ptr = &sc->next;
+			} else {
+				*sc_ptr = sc->next;
+				free(sc);
+			}
+		}
+
+		time_t last = (split->join_time > split->quit_time) ? split->join_time : split->quit_time;
+
+		if (split->chans == NULL && t - last >= NETSPLIT_TIMEOUT) {
+			*split_ptr = split->next;
+			free_avl(split->nicks);
+			free_avl(split->rejoins);
+			free(split);
+		} else {
+			split_ptr = &split->next;
+		}
+	}
+}
+
+void
+free_netsplits(server *s)
+{
+	struct netsplit *t, *split = s->netsplit;
+	struct netsplit_chan *tc, *sc;
+
+	while ((t = split)) {
+
+		for (sc = split->chans; (tc = sc);) {
+			sc = sc->next;
+			free(tc);
+		}
+
+		split = split->next;
+		free_avl(t->nicks);
+		free_avl(t->rejoins);
+		free(t);
+	}
+
+	s->netsplit = NULL;
+}
+
+static int
+join_channels(char *err, server *s)
+{
+	/* Join the command-line channels on first connect, or rejoin channels not
+	 * parted when reconnecting, packed into as few JOIN lines as allowed and
+	 * queued to be sent at a paced rate */
+
+	char *chan, *chans, *key, *keys, *join;
+	int keyed, ret = 0;
+	struct join_line j = {0};
+	channel *c;
+
+	if (config.auto_join) {
+
+		/* `<chans>[ <keys>]`, keys paired with the first channels in order */
+		if ((join = strdup(config.auto_join)) == NULL)
+			fatal("strdup");
+
+		config.auto_join = NULL;
+
+		keys = join;
+		chans = strtok_r(keys, " ", &keys);
+		keys = strtok_r(keys, " ", &keys);
+
+		while (!ret && chans && (chan = strtok_r(chans, ",", &chans))) {
+			key = (keys) ? strtok_r(keys, ",", &keys) : NULL;
+			if (!(ret = join_add(err, s, &j, chan, key)))
+				join_key(s, chan, key);
+		}
+
+		free(join);
+
+	} else {
+
+		/* Keys are positional, channels with keys are added first */
+		for (keyed = 1; keyed >= 0; keyed--) {
+
+			c = s->channel;
+
+			do {
+				if (!ret && c->type && c->type != 'p' && !c->parted && (c->key != NULL) == keyed)
+					ret = join_add(err, s, &j, c->name, c->key);
+				c = c->next;
+			} while (c != s->channel);
+		}
+	}
+
+	return (ret) ? ret : join_send(err, s, &j);
+}
+
+static void
+join_key(server *s, const char *chan, const char *key)
+{
+	/* Set the key a channel is being joined with, kept once the JOIN succeeds */
+
+	avl_del(&s->join_keys, s->isupport.casemap, chan);
+
+	if (key && *key) {
+
+		char *dup;
+
+		if ((dup = strdup(key)) == NULL)
+			fatal("strdup");
+
+		avl_add(&s->join_keys, s->isupport.casemap, chan, dup);
+	}
+}
+
+static int
+join_add(char *err, server *s, struct join_line *j, const char *chan, const char *key)
+{
+	/* Add a channel, and its key if any, to a JOIN line. The line is queued
+	 * first when the channel would exceed the maximum message length or the
+	 * server's TARGMAX for JOIN */
+
+	size_t chan_len = strlen(chan);
+	size_t key_len = (key) ? strlen(key) : 0;
+
+	/* `JOIN <chans>[ <keys>]\r\n`, adding the separating commas */
+	size_t len = strlen("JOIN  \r\n")
+		+ j->chans_len + (j->count > 0) + chan_len
+		+ j->keys_len + (j->keys_len > 0) + key_len;
+
+	if (j->count && (len > BUFFSIZE || j->count == s->isupport.targmax_join))
+		fail_if(join_send(err, s, j));
+
+	if (strlen("JOIN  \r\n") + chan_len + key_len > BUFFSIZE)
+		failf("Error: JOIN exceeds maximum length of " STR(BUFFSIZE) " bytes, for '%s'", chan);
+
+	if (j->count)
+		j->chans[j->chans_len++] = ',';
+
+	memcpy(j->chans + j->chans_len, chan, chan_len + 1);
+	j->chans_len += chan_len;
+
+	if (key_len) {
+
+		if (j->keys_len)
+			j->keys[j->keys_len++] = ',';
+
+		memcpy(j->keys + j->keys_len, key, key_len + 1);
+		j->keys_len += key_len;
+	}
+
+	j->count++;
+
+	return 0;
+}
+
+static int
+join_send(char *err, server *s, struct join_line *j)
+{
+	/* Queue a JOIN line, if any channels were added, and empty it */
+
+	if (j->count == 0)
+		return 0;
+
+	fail_if(sendq_join(err, s, j->chans, j->keys));
+
+	j->chans_len = 0;
+	j->keys_len = 0;
+	j->count = 0;
+
+	*j->chans = '\0';
+	*j->keys = '\0';
+
+	return 0;
+}
+
+static int
+request_history(char *err, server *s, const char *chan)
+{
+	/* Request a channel's history since the last message seen, or its latest
+	 * messages, up to a full buffer */
+
+	char since[64] = "*";
+
+	if (s->history_time)
+		strftime(since, sizeof(since), "timestamp=%Y-%m-%dT%H:%M:%S.000Z", gmtime(&s->history_time));
+
+	return sendf(err, s, "CHATHISTORY LATEST %s %s %d", chan, since, SCROLLBACK_BUFFER);
+}
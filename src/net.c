@@ -23,6 +23,50 @@ typedef struct connection_thread {
 	pthread_t tid;
 } connection_thread;
 
+/* Queued message, sent when the server's send queue is next drained */
+struct sendq_line {
+	struct sendq_line *next;
+	char *echo_targ;
+	char *echo_mesg;
+	size_t len;
+	char text[];
+};
+
+/* Capture files start with a magic string, followed by records:
+ *
+ *   type    1 byte, CAPTURE_CONNECT, CAPTURE_RECV or CAPTURE_SEND
+ *   server  1 byte, the server's index in order of CAPTURE_CONNECT records
+ *   time    8 bytes, microseconds since the capture started
+ *   length  4 bytes
+ *
+ * followed by length bytes of data, which for CAPTURE_CONNECT is the server's
+ * host. Integers are big endian */
+#define CAPTURE_MAGIC   "rirc-capture-1\n"
+#define CAPTURE_HEADER  14
+#define CAPTURE_CONNECT 'c'
+#define CAPTURE_RECV    'r'
+#define CAPTURE_SEND    's'
+
+/* Max servers in a capture, indexed by a single byte */
+#define CAPTURE_SERVERS 256
+
+/* Capture recording and replay state */
+static struct {
+	FILE *record;
+	FILE *replay;
+	int servers;
+	unsigned long long start;
+	struct {
+		unsigned long long start;
+		unsigned long bytes;
+		unsigned long records;
+		unsigned char header[CAPTURE_HEADER];
+		long offset;
+		int pending;
+		server *servers[CAPTURE_SERVERS];
+	} replay_state;
+} capture;
+
 /* DLL of current servers */
 static server *server_head;
 
@@ -32,8 +76,17 @@ static void free_server(server*);
 static int check_connect(server*);
 static int check_latency(server*, time_t);
 static int check_reconnect(server*, time_t);
+static int check_sendq(server*, time_t);
 static int check_socket(server*, time_t);
 
+static void free_sendq(server*);
+static void sendq_append(server*, struct sendq_line*);
+static void sendq_consume(server*, size_t);
+
+static int check_replay(void);
+static int replay_header(void);
+static void capture_write(int, server*, const char*, size_t);
+
 static void connected(server*);
 
 static void* threaded_connect(void*);
@@ -49,11 +102,14 @@ new_server(char *host, char *port)
 
 	/* Set non-zero default fields */
 	s->soc = -1;
+	s->capture_id = -1;
 	s->iptr = s->input;
 	s->nptr = config.nicks;
 	s->host = strdup(host);
 	s->port = strdup(port);
 
+	reset_isupport(s);
+
 	auto_nick(&(s->nptr), s->nick_me);
 
 	s->channel = ccur = new_channel(host, s, NULL);
@@ -68,30 +124,64 @@ free_server(server *s)
 {
 	channel *t, *c = s->channel;
 
+	batch_end_all(s);
+
 	do {
 		t = c;
 		c = c->next;
 		free_channel(t);
 	} while (c != s->channel);
 
+	free_sendq(s);
+	free_netsplits(s);
+	free_avl(s->join_keys);
+	highlight_free(s->highlight);
+	ignore_free(s->ignore);
 	free(s->host);
 	free(s->port);
 	free(s);
 }
 
+static void
+free_sendq(server *s)
+{
+	/* Discard all messages in a server's send queue */
+
+	struct sendq_line *t, *l = s->sendq.head;
+
+	while (l) {
+		t = l;
+		l = l->next;
+		free(t);
+	}
+
+	s->sendq.head = NULL;
+	s->sendq.tail = NULL;
+	s->sendq.offset = 0;
+	s->sendq.count = 0;
+	s->sendq.total = 0;
+}
+
 int
 sendf(char *err, server *s, const char *fmt, ...)
 {
 	/* Send a formatted message to a server.
 	 *
 	 * Returns non-zero on failure and prints the error message to the buffer pointed
-	 * to by err.
+	 * to by err, or discards it if err is NULL.
 	 */
 
-	char sendbuff[BUFFSIZE];
+	char errbuff[MAX_ERROR], sendbuff[BUFFSIZE];
 	int soc, len;
 	va_list ap;
 
+	if (err == NULL)
+		err = errbuff;
+
+	/* Replayed servers have no connection, messages are discarded */
+	if (s && s->replay)
+		return 0;
+
 	if (s == NULL || (soc = s->soc) < 0) {
 		strncpy(err, "Error: Not connected to server", MAX_ERROR);
 		return 1;
@@ -102,11 +192,13 @@ sendf(char *err, server *s, const char *fmt, ...)
 	va_end(ap);
 
 	if (len < 0) {
+		s->stats.send_errors++;
 		strncpy(err, "Error: Invalid message format", MAX_ERROR);
 		return 1;
 	}
 
 	if (len >= BUFFSIZE-2) {
+		s->stats.send_errors++;
 		strncpy(err, "Error: Message exceeds maximum length of " STR(BUFFSIZE) " bytes", MAX_ERROR);
 		return 1;
 	}
@@ -118,14 +210,149 @@ sendf(char *err, server *s, const char *fmt, ...)
 	sendbuff[len++] = '\r';
 	sendbuff[len++] = '\n';
 
+	/* Complete any partially sent queued message first, so messages aren't interleaved */
+	if (s->sendq.offset) {
+
+		struct sendq_line *l = s->sendq.head;
+		ssize_t ret;
+
+		if ((ret = send(soc, l->text + s->sendq.offset, l->len - s->sendq.offset, 0)) < 0) {
+			s->stats.send_errors++;
+			snprintf(err, MAX_ERROR, "Error: %s", strerror(errno));
+			return 1;
+		}
+
+		capture_write(CAPTURE_SEND, s, l->text + s->sendq.offset, ret);
+
+		sendq_consume(s, ret);
+
+		if (s->sendq.offset) {
+			s->stats.send_errors++;
+			strncpy(err, "Error: Send queue blocked", MAX_ERROR);
+			return 1;
+		}
+	}
+
 	if (send(soc, sendbuff, len, 0) < 0) {
+		s->stats.send_errors++;
 		snprintf(err, MAX_ERROR, "Error: %s", strerror(errno));
 		return 1;
 	}
 
+	capture_write(CAPTURE_SEND, s, sendbuff, len);
+
+	s->stats.send_bytes += len;
+	s->stats.send_lines++;
+
+	return 0;
+}
+
+int
+sendq_privmsg(char *err, server *s, const char *targ, const char *mesg)
+{
+	/* Queue a PRIVMSG to be sent at a paced rate, echoing the message to
+	 * the target's buffer when it's sent.
+	 *
+	 * Returns non-zero on failure and prints the error message to the buffer pointed
+	 * to by err.
+	 */
+
+	struct sendq_line *l;
+	size_t len, targ_len;
+
+	if (s == NULL || s->soc < 0) {
+		strncpy(err, "Error: Not connected to server", MAX_ERROR);
+		return 1;
+	}
+
+	targ_len = strlen(targ);
+
+	/* `PRIVMSG <targ> :<mesg>\r\n` */
+	len = strlen("PRIVMSG  :\r\n") + targ_len + strlen(mesg);
+
+	if (len > BUFFSIZE) {
+		strncpy(err, "Error: Message exceeds maximum length of " STR(BUFFSIZE) " bytes", MAX_ERROR);
+		return 1;
+	}
+
+	/* The message text is followed by a copy of the target */
+	if ((l = malloc(sizeof(*l) + len + targ_len + 2)) == NULL)
+		fatal("malloc");
+
+	snprintf(l->text, len + 1, "PRIVMSG %s :%s\r\n", targ, mesg);
+
+	l->len = len;
+	l->echo_mesg = l->text + strlen("PRIVMSG  :") + targ_len;
+	l->echo_targ = strcpy(l->text + len + 1, targ);
+
+	sendq_append(s, l);
+
 	return 0;
 }
 
+int
+sendq_join(char *err, server *s, const char *chans, const char *keys)
+{
+	/* Queue a JOIN to be sent at a paced rate, for comma separated channels
+	 * and optionally their keys.
+	 *
+	 * Returns non-zero on failure and prints the error message to the buffer pointed
+	 * to by err.
+	 */
+
+	struct sendq_line *l;
+	size_t len;
+
+	if (s == NULL || s->soc < 0) {
+		strncpy(err, "Error: Not connected to server", MAX_ERROR);
+		return 1;
+	}
+
+	/* `JOIN <chans>[ <keys>]\r\n` */
+	len = strlen("JOIN \r\n") + strlen(chans) + (*keys ? strlen(keys) + 1 : 0);
+
+	if (len > BUFFSIZE) {
+		strncpy(err, "Error: Message exceeds maximum length of " STR(BUFFSIZE) " bytes", MAX_ERROR);
+		return 1;
+	}
+
+	if ((l = malloc(sizeof(*l) + len + 1)) == NULL)
+		fatal("malloc");
+
+	snprintf(l->text, len + 1, "JOIN %s%s%s\r\n", chans, (*keys ? " " : ""), keys);
+
+	l->len = len;
+	l->echo_mesg = NULL;
+	l->echo_targ = NULL;
+
+	sendq_append(s, l);
+
+	return 0;
+}
+
+static void
+sendq_append(server *s, struct sendq_line *l)
+{
+	/* Add a message to the end of the server's send queue */
+
+	l->next = NULL;
+
+	if (s->sendq.tail)
+		s->sendq.tail->next = l;
+	else
+		s->sendq.head = l;
+
+	s->sendq.tail = l;
+	s->sendq.count++;
+	s->sendq.total++;
+
+	if (s->sendq.count > s->stats.sendq_max)
+		s->stats.sendq_max = s->sendq.count;
+
+	if (ccur->server == s)
+		draw(D_STATUS);
+}
+
 void
 server_connect(char *host, char *port)
 {
@@ -193,6 +420,17 @@ connected(server *s)
 	s->latency_time = time(NULL);
 	s->latency_delta = 0;
 
+	s->sendq.tokens = SENDQ_BURST;
+	s->sendq.time = s->latency_time;
+
+	/* Servers are numbered in the capture in order of connecting */
+	if (capture.record && s->capture_id < 0 && capture.servers < CAPTURE_SERVERS) {
+		s->capture_id = capture.servers++;
+		capture_write(CAPTURE_CONNECT, s, s->host, strlen(s->host));
+	}
+
+	/* Registration is held by servers supporting CAP until CAP END */
+	sendf(NULL, s, "CAP LS 302");
 	sendf(NULL, s, "NICK %s", s->nick_me);
 	sendf(NULL, s, "USER %s 8 * :%s", config.username, config.realname);
 }
@@ -314,9 +552,19 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 
 		close(s->soc);
 
+		/* Messages queued for this connection are discarded */
+		free_sendq(s);
+
+		/* History received before disconnecting is kept */
+		batch_end_all(s);
+
 		/* Set all server attributes back to default */
 		s->soc = -1;
 		s->usermode = 0;
+		s->caps = 0;
+		s->caps_ls = 0;
+
+		reset_isupport(s);
 		s->iptr = s->input;
 		s->nptr = config.nicks;
 		s->latency_delta = 0;
@@ -335,6 +583,8 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 			free_avl(c->nicklist);
 			c->nicklist = NULL;
 
+			reset_names(c);
+
 		} while ((c = c->next) != s->channel);
 	}
 
@@ -365,12 +615,16 @@ check_servers(void)
 	 *  - Ping timeout.      Skip the rest detected
 	 *  - Reconnect attempt. Skip the rest if successful
 	 *  - Socket input.      Consume all input
+	 *  - Send queue.        Send any queued messages allowed by pacing
 	 *  */
 
 	/* TODO: there's probably a better order to check these */
 
 	server *s;
 
+	if (capture.replay)
+		check_replay();
+
 	if ((s = server_head) == NULL)
 		return;
 
@@ -388,7 +642,15 @@ check_servers(void)
 
 		check_socket(s, t);
 
+		check_sendq(s, t);
+
+		check_netsplits(s, t);
+
 	} while ((s = s->next) != server_head);
+
+	/* Keep the capture complete up to the last check, in case of a crash */
+	if (capture.record)
+		fflush(capture.record);
 }
 
 static int
@@ -470,6 +732,116 @@ check_reconnect(server *s, time_t t)
 	return 0;
 }
 
+static int
+check_sendq(server *s, time_t t)
+{
+	/* Send queued messages, up to SENDQ_BURST at once, refilling at
+	 * one message per SENDQ_DELTA seconds.
+	 *
+	 * All messages allowed by pacing are coalesced and written with a single
+	 * send(). If the socket accepts only part of the batch, the remainder stays
+	 * queued and the offset into the partially sent message is kept for the
+	 * next check */
+
+	char sendbuff[BUFFSIZE * SENDQ_BURST];
+	size_t len = 0;
+	ssize_t ret;
+	int n = 0;
+
+	struct sendq_line *l;
+	unsigned int count = s->sendq.count;
+
+	if (s->soc < 0 || s->sendq.head == NULL)
+		return 0;
+
+	if (t - s->sendq.time >= SENDQ_DELTA) {
+		s->sendq.tokens += (t - s->sendq.time) / SENDQ_DELTA;
+		s->sendq.time = t;
+
+		if (s->sendq.tokens > SENDQ_BURST)
+			s->sendq.tokens = SENDQ_BURST;
+	}
+
+	/* Build the batch, the head message might be partially sent */
+	for (l = s->sendq.head; l && n < s->sendq.tokens; l = l->next, n++) {
+
+		size_t offset = (l == s->sendq.head) ? s->sendq.offset : 0;
+
+		memcpy(sendbuff + len, l->text + offset, l->len - offset);
+		len += l->len - offset;
+	}
+
+	if (len == 0)
+		return 0;
+
+	if ((ret = send(s->soc, sendbuff, len, 0)) < 0) {
+
+		/* Socket is non-blocking, try again next check */
+		if (errno == EWOULDBLOCK || errno == EAGAIN)
+			return 0;
+
+		s->stats.send_errors++;
+		newlinef(s->channel, 0, "-!!-", "Error: %s", strerror(errno));
+		free_sendq(s);
+
+		return 0;
+	}
+
+	capture_write(CAPTURE_SEND, s, sendbuff, ret);
+
+	sendq_consume(s, ret);
+
+	/* Only messages sent by pacing use tokens, not those completed by sendf() */
+	s->sendq.tokens -= (int) (count - s->sendq.count);
+
+	if (count != s->sendq.count && ccur->server == s)
+		draw(D_STATUS);
+
+	return 0;
+}
+
+static void
+sendq_consume(server *s, size_t len)
+{
+	/* Dequeue all messages fully sent by a write of len bytes, echoing those
+	 * with a target to its buffer */
+
+	struct sendq_line *l;
+	channel *c = NULL;
+
+	s->stats.send_bytes += len;
+
+	while ((l = s->sendq.head) && len >= l->len - s->sendq.offset) {
+
+		len -= l->len - s->sendq.offset;
+
+		s->sendq.offset = 0;
+
+		if (l->echo_targ) {
+
+			/* Consecutive messages are typically to the same target */
+			if (c == NULL || strcmp(c->name, l->echo_targ))
+				c = channel_get(l->echo_targ, s);
+
+			if (c)
+				_newline(c, LINE_CHAT, s->nick_me, l->echo_mesg, l->len - (l->echo_mesg - l->text) - 2);
+		}
+
+		if ((s->sendq.head = l->next) == NULL) {
+			s->sendq.tail = NULL;
+			s->sendq.total = 0;
+		}
+
+		s->sendq.count--;
+
+		s->stats.send_lines++;
+
+		free(l);
+	}
+
+	s->sendq.offset += len;
+}
+
 static int
 check_socket(server *s, time_t t)
 {
@@ -490,7 +862,15 @@ check_socket(server *s, time_t t)
 		s->latency_time = t;
 		s->latency_delta = 0;
 
+		s->stats.recv_bytes += count;
+
+		capture_write(CAPTURE_RECV, s, recv_buff, count);
+
+		trace.read = time_us();
+
 		recv_mesg(recv_buff, count, s);
+
+		trace.read = 0;
 	}
 
 	/* Server received ERROR message or remote hangup */
@@ -503,3 +883,184 @@ check_socket(server *s, time_t t)
 
 	return 0;
 }
+
+void
+init_capture(void)
+{
+	/* Open the capture files for recording and replay */
+
+	char magic[sizeof(CAPTURE_MAGIC) - 1];
+
+	capture.start = time_us();
+
+	if (config.record_file) {
+
+		if ((capture.record = fopen(config.record_file, "wb")) == NULL)
+			fatal("fopen - record file");
+
+		fwrite(CAPTURE_MAGIC, 1, sizeof(magic), capture.record);
+	}
+
+	if (config.replay_file) {
+
+		if ((capture.replay = fopen(config.replay_file, "rb")) == NULL)
+			fatal("fopen - replay file");
+
+		if (fread(magic, 1, sizeof(magic), capture.replay) != sizeof(magic)
+		 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+			errno = 0;
+			fatal("replay file is not a capture");
+		}
+	}
+}
+
+void
+free_capture(void)
+{
+	if (capture.record)
+		fclose(capture.record);
+
+	if (capture.replay)
+		fclose(capture.replay);
+}
+
+static void
+capture_write(int type, server *s, const char *buf, size_t len)
+{
+	/* Append a record to the capture file, if recording */
+
+	unsigned char header[CAPTURE_HEADER];
+	unsigned long long t;
+	int i;
+
+	if (capture.record == NULL || s->capture_id < 0 || len == 0)
+		return;
+
+	t = time_us() - capture.start;
+
+	header[0] = type;
+	header[1] = s->capture_id;
+
+	for (i = 0; i < 8; i++)
+		header[2 + i] = t >> (56 - 8 * i);
+
+	for (i = 0; i < 4; i++)
+		header[10 + i] = len >> (24 - 8 * i);
+
+	fwrite(header, 1, CAPTURE_HEADER, capture.record);
+	fwrite(buf, 1, len, capture.record);
+}
+
+static int
+replay_header(void)
+{
+	/* Read the next record header, returns 0 at the end of the capture, or
+	 * -1 if it ends within the header */
+
+	size_t ret;
+
+	if (!capture.replay_state.pending) {
+
+		capture.replay_state.offset = ftell(capture.replay);
+
+		if ((ret = fread(capture.replay_state.header, 1, CAPTURE_HEADER, capture.replay)) != CAPTURE_HEADER)
+			return (ret == 0 && feof(capture.replay)) ? 0 : -1;
+
+		capture.replay_state.pending = 1;
+	}
+
+	return 1;
+}
+
+static int
+check_replay(void)
+{
+	/* Feed received data from the replay capture through recv_mesg(), either at
+	 * the original speed, or all at once when config.replay_fast is set.
+	 *
+	 * Sent data is skipped, replies to replayed messages are discarded by sendf() */
+
+	char buf[BUFFSIZE * SENDQ_BURST];
+	const char *invalid = NULL;
+	unsigned char *h = capture.replay_state.header;
+	unsigned long long t, now = time_us() - capture.start;
+	size_t len;
+	server *s;
+	int i, ret;
+
+	if (capture.replay_state.start == 0)
+		capture.replay_state.start = time_us();
+
+	while ((ret = replay_header()) > 0) {
+
+		for (t = 0, i = 0; i < 8; i++)
+			t = (t << 8) | h[2 + i];
+
+		for (len = 0, i = 0; i < 4; i++)
+			len = (len << 8) | h[10 + i];
+
+		/* Not yet due */
+		if (!config.replay_fast && t > now)
+			return 0;
+
+		if (len > sizeof(buf)) {
+			invalid = "record exceeds " STR(BUFFSIZE) " * " STR(SENDQ_BURST) " bytes";
+			break;
+		}
+
+		if (fread(buf, 1, len, capture.replay) != len) {
+			invalid = "record truncated";
+			break;
+		}
+
+		capture.replay_state.pending = 0;
+		capture.replay_state.records++;
+
+		s = capture.replay_state.servers[h[1]];
+
+		if (h[0] == CAPTURE_CONNECT) {
+
+			char host[BUFFSIZE];
+
+			snprintf(host, sizeof(host), "%.*s", (int) len, buf);
+
+			s = new_server(host, "replay");
+			s->replay = 1;
+
+			capture.replay_state.servers[h[1]] = s;
+
+			newlinef(s->channel, 0, "--", "Replaying '%s' from %s", host, config.replay_file);
+
+		} else if (h[0] == CAPTURE_RECV && s) {
+
+			capture.replay_state.bytes += len;
+
+			s->stats.recv_bytes += len;
+
+			trace.read = time_us();
+
+			recv_mesg(buf, len, s);
+
+			trace.read = 0;
+		}
+	}
+
+	if (ret < 0)
+		invalid = "record header truncated";
+
+	if (invalid)
+		newlinef(rirc, 0, "-!!-", "Replay failed: %s, at offset %ld after %lu records",
+				invalid,
+				capture.replay_state.offset,
+				capture.replay_state.records);
+	else
+		newlinef(rirc, 0, "--", "Replay finished: %lu records, %lu bytes received in %llums",
+				capture.replay_state.records,
+				capture.replay_state.bytes,
+				(time_us() - capture.replay_state.start) / 1000);
+
+	fclose(capture.replay);
+	capture.replay = NULL;
+
+	return 0;
+}
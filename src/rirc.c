@@ -12,6 +12,7 @@
 static void cleanup(void);
 static void configure(void);
 static void getopts(int, char**);
+static void headless_loop(void);
 static void main_loop(void);
 static void splash(channel*);
 static void startup(void);
@@ -29,6 +30,14 @@ static struct
 	char *port;
 	char *join;
 	char *nicks;
+	char *highlights;
+	char *filters;
+	char *trace;
+	char *headless;
+	char *record;
+	char *replay;
+	char *timestamp;
+	int fast;
 } opts;
 
 static struct termios oterm, nterm;
@@ -39,7 +48,11 @@ main(int argc, char **argv)
 	getopts(argc, argv);
 	configure();
 	startup();
-	main_loop();
+
+	if (config.headless)
+		headless_loop();
+	else
+		main_loop();
 
 	return EXIT_SUCCESS;
 }
@@ -62,6 +75,18 @@ usage(void)
 	"  -p, --port=PORT        Connect using PORT\n"
 	"  -j, --join=CHANNELS    Comma separated list of channels to join\n"
 	"  -n, --nicks=NICKS      Comma and/or space separated list of nicks to use\n"
+	"  -k, --highlight=WORDS  Comma and/or space separated list of keywords to\n"
+	"                         highlight, in addition to nicks\n"
+	"  -f, --filter=RULES     Semicolon separated list of rules dropping messages,\n"
+	"                         default '" DEFAULT_FILTERS "'\n"
+	"  -t, --trace=FILE       Write receive to render latency records to FILE\n"
+	"  -H, --headless=FIFO    Run without a terminal, reading commands from FIFO\n"
+	"                         and writing buffer lines to stdout\n"
+	"  -r, --record=FILE      Capture all server traffic to FILE\n"
+	"  -R, --replay=FILE      Replay server traffic captured in FILE\n"
+	"  -F, --fast             Replay as fast as possible\n"
+	"  -T, --timestamp=FORMAT strftime format of line timestamps, of at most\n"
+	"                         minute resolution, default '" TIMESTAMP_FORMAT "'\n"
 	"  -v, --version          Print rirc version and exit\n"
 	"\n"
 	"Examples:\n"
@@ -93,6 +118,14 @@ getopts(int argc, char **argv)
 	opts.port    = NULL;
 	opts.join    = NULL;
 	opts.nicks   = NULL;
+	opts.highlights = NULL;
+	opts.filters = NULL;
+	opts.trace   = NULL;
+	opts.headless = NULL;
+	opts.record   = NULL;
+	opts.replay   = NULL;
+	opts.timestamp = NULL;
+	opts.fast     = 0;
 
 	int c, opt_i = 0;
 
@@ -102,12 +135,20 @@ getopts(int argc, char **argv)
 		{"port",    required_argument, 0, 'p'},
 		{"join",    required_argument, 0, 'j'},
 		{"nick",    required_argument, 0, 'n'},
+		{"highlight", required_argument, 0, 'k'},
+		{"filter",  required_argument, 0, 'f'},
+		{"trace",   required_argument, 0, 't'},
+		{"headless", required_argument, 0, 'H'},
+		{"record",  required_argument, 0, 'r'},
+		{"replay",  required_argument, 0, 'R'},
+		{"fast",    no_argument,       0, 'F'},
+		{"timestamp", required_argument, 0, 'T'},
 		{"version", no_argument,       0, 'v'},
 		{"help",    no_argument,       0, 'h'},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "c:p:n:j:vh", long_opts, &opt_i))) {
+	while ((c = getopt_long(argc, argv, "c:p:n:k:f:j:t:H:r:R:FT:vh", long_opts, &opt_i))) {
 
 		if (c == -1)
 			break;
@@ -141,6 +182,24 @@ getopts(int argc, char **argv)
 				opts.nicks = optarg;
 				break;
 
+			/* Comma and/or space separated list of keywords to highlight */
+			case 'k':
+				if (*optarg == '-') {
+					puts("-k/--highlight requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.highlights = optarg;
+				break;
+
+			/* Semicolon separated list of filter rules */
+			case 'f':
+				if (*optarg == '-') {
+					puts("-f/--filter requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.filters = optarg;
+				break;
+
 			/* Comma separated list of channels to join */
 			case 'j':
 				if (*optarg == '-') {
@@ -150,6 +209,56 @@ getopts(int argc, char **argv)
 				opts.join = optarg;
 				break;
 
+			/* Write latency trace records to file */
+			case 't':
+				if (*optarg == '-') {
+					puts("-t/--trace requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.trace = optarg;
+				break;
+
+			/* Run without a terminal, reading commands from a FIFO */
+			case 'H':
+				if (*optarg == '-') {
+					puts("-H/--headless requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.headless = optarg;
+				break;
+
+			/* Capture server traffic to file */
+			case 'r':
+				if (*optarg == '-') {
+					puts("-r/--record requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.record = optarg;
+				break;
+
+			/* Replay captured server traffic */
+			case 'R':
+				if (*optarg == '-') {
+					puts("-R/--replay requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.replay = optarg;
+				break;
+
+			/* Replay as fast as possible */
+			case 'F':
+				opts.fast = 1;
+				break;
+
+			/* strftime format of line timestamps */
+			case 'T':
+				if (timestamp_width(optarg) == 0) {
+					puts("-T/--timestamp requires a format giving timestamps under " STR(TIMESTAMP_SIZE) " bytes");
+					exit(EXIT_FAILURE);
+				}
+				opts.timestamp = optarg;
+				break;
+
 			/* Print rirc version and exit */
 			case 'v':
 				puts("rirc version " VERSION);
@@ -174,16 +283,40 @@ configure(void)
 		config.auto_connect = opts.connect;
 		config.auto_port = opts.port ? opts.port : "6667";
 		config.auto_join = opts.join;
-		config.nicks = opts.nicks ? opts.nicks : getenv("USER");
 	} else {
 		config.auto_connect = NULL;
 		config.auto_port = NULL;
 		config.auto_join = NULL;
-		config.nicks = getenv("USER");
 	}
+
+	/* Nicks also apply to servers connected by /connect, or replayed */
+	config.nicks = opts.nicks ? opts.nicks : getenv("USER");
+
+	/* Random nicks are generated when none are available */
+	if (config.nicks == NULL)
+		config.nicks = "";
+
+	config.highlights = opts.highlights;
 	config.username = "rirc_v" VERSION;
 	config.realname = "rirc v" VERSION;
-	config.join_part_quit_threshold = 100;
+	config.filters = opts.filters ? opts.filters : DEFAULT_FILTERS;
+	config.timestamp_format = opts.timestamp ? opts.timestamp : TIMESTAMP_FORMAT;
+	config.history_size = SCROLLBACK_INPUT;
+	config.trace_file = opts.trace;
+	config.headless = opts.headless;
+	config.record_file = opts.record;
+	config.replay_file = opts.replay;
+	config.replay_fast = opts.fast;
+
+	/* Input history is persisted to $HOME/.rirc_history */
+	static char history_file[BUFFSIZE];
+
+	if (getenv("HOME")) {
+		snprintf(history_file, BUFFSIZE, "%s/.rirc_history", getenv("HOME"));
+		config.history_file = history_file;
+	} else {
+		config.history_file = NULL;
+	}
 }
 
 static void
@@ -200,30 +333,58 @@ startup(void)
 	/* stdout is fflush()'ed on every redraw */
 	setvbuf(stdout, NULL, _IOFBF, 0);
 
-	/* Set terminal to raw mode */
-	tcgetattr(0, &oterm);
-	nterm = oterm;
-	nterm.c_lflag &= ~(ECHO | ICANON | ISIG);
-	nterm.c_cc[VMIN] = 1;
-	nterm.c_cc[VTIME] = 0;
-	if (tcsetattr(0, TCSADRAIN, &nterm) < 0)
-		fatal("tcsetattr");
+	/* Open the traffic capture files */
+	init_capture();
+
+	/* Open the latency trace file */
+	if (config.trace_file && (trace.file = fopen(config.trace_file, "wb")) == NULL)
+		fatal("fopen - trace file");
+
+	if (config.headless) {
 
-	/* Set mousewheel event handling */
-	printf("\x1b[?1000h");
+		/* Open the command FIFO, the terminal is left untouched */
+		init_headless();
+
+	} else {
+
+		/* Set terminal to raw mode */
+		tcgetattr(0, &oterm);
+		nterm = oterm;
+		nterm.c_lflag &= ~(ECHO | ICANON | ISIG);
+		nterm.c_cc[VMIN] = 1;
+		nterm.c_cc[VTIME] = 0;
+		if (tcsetattr(0, TCSADRAIN, &nterm) < 0)
+			fatal("tcsetattr");
+
+		/* Query the terminal for optional capabilities used when drawing */
+		probe_term();
+
+		/* Set mousewheel event handling */
+		printf("\x1b[?1000h");
+
+		/* Set bracketed paste mode */
+		printf("\x1b[?2004h");
+	}
 
 	srand(time(NULL));
 
 	/* Build the avl tree of command handlers */
 	init_commands();
 
+	/* Load the input history */
+	init_history();
+
 	/* Init draw */
-	draw(D_RESIZE);
+	if (!config.headless)
+		draw(D_RESIZE);
 
 	rirc = ccur = new_channel("rirc", NULL, NULL);
 
 	splash(rirc);
 
+	/* Compile the filter rules, reporting invalid rules */
+	init_filters();
+
 	/* Set up signal handlers */
 	sa_sigwinch.sa_handler = signal_sigwinch;
 	if (sigaction(SIGWINCH, &sa_sigwinch, NULL) == -1)
@@ -242,13 +403,30 @@ static void
 cleanup(void)
 {
 	/* Reset terminal modes */
-	tcsetattr(0, TCSADRAIN, &oterm);
+	if (!config.headless)
+		tcsetattr(0, TCSADRAIN, &oterm);
 
 	/* Free the tree of command handlers */
 	free_avl(commands);
 
+	/* Free the input history */
+	free_history();
+
+	/* Close the traffic capture files */
+	free_capture();
+
+	/* Close the latency trace file */
+	if (trace.file)
+		fclose(trace.file);
+
+	if (config.headless)
+		return;
+
 	/* Reset mousewheel event handling */
 	printf("\x1b[?1000l");
+
+	/* Reset bracketed paste mode */
+	printf("\x1b[?2004l");
 }
 
 static void
@@ -270,3 +448,21 @@ main_loop(void)
 		redraw(ccur);
 	}
 }
+
+static void
+headless_loop(void)
+{
+	/* Main loop without a terminal, nothing is drawn */
+
+	for (;;) {
+
+		/* Check for commands on the FIFO, sleep 200ms */
+		poll_headless();
+
+		/* For each server, check connection status, and input */
+		check_servers();
+
+		/* Write out lines logged since the last iteration */
+		fflush(stdout);
+	}
+}
@@ -8,7 +8,36 @@
 
 #include "common.h"
 
+/* Lines added while handling messages in a history playback batch are held
+ * until the batch ends, then inserted in bulk */
+struct batch
+{
+	char ref[BATCH_REFSIZE];
+	unsigned int count;
+	struct batch *next;
+	struct batch_line *head;
+	struct batch_line *tail;
+};
+
+struct batch_line
+{
+	channel *c;
+	char *from;
+	line_t type;
+	size_t len;
+	time_t time;
+	struct batch_line *next;
+	char text[];
+};
+
 static int action_close_server(char);
+static void batch_add(struct batch*, channel*, line_t, const char*, const char*, size_t);
+static void batch_drop(channel*);
+static void batch_flush(struct batch*);
+static const char* timestamp(time_t);
+static void log_line(channel*, line*);
+static void nick_pad_add(channel*, size_t);
+static void nick_pad_del(channel*, size_t);
 
 void
 newline(channel *c, line_t type, const char *from, const char *mesg)
@@ -31,6 +60,12 @@ newlinef(channel *c, line_t type, const char *from, const char *fmt, ...)
 	len = vsnprintf(buff, BUFFSIZE, fmt, ap);
 	va_end(ap);
 
+	/* Message was truncated */
+	if (len < 0)
+		len = 0;
+	else if (len >= BUFFSIZE)
+		len = BUFFSIZE - 1;
+
 	_newline(c, type, from, buff, len);
 }
 
@@ -41,6 +76,12 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 
 	line *new_line;
 
+	/* Lines received in a batch are inserted when it ends */
+	if (newline_batch) {
+		batch_add(newline_batch, c, type, from, mesg, len);
+		return;
+	}
+
 	/* c->buffer_head points to the first printable line, so get the next line in the
 	 * circular buffer */
 	if ((new_line = c->buffer_head + 1) == &c->buffer[SCROLLBACK_BUFFER])
@@ -56,6 +97,18 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 
 	c->buffer_head = new_line;
 
+	/* Lines appended since the last draw might be scrolled in */
+	if (c->draw.appended < SCROLLBACK_BUFFER)
+		c->draw.appended++;
+
+	/* The line being overwritten no longer contributes to the nick padding */
+	if (new_line->text)
+		nick_pad_del(c, new_line->from_len);
+
+	/* A line still traced when overwritten was scrolled past, never drawn */
+	if (new_line->text && new_line->trace.read)
+		trace_line(new_line, 0);
+
 	/* new_channel() memsets c->buffer to 0, so this will either free(NULL) or an old line */
 	free(new_line->text);
 
@@ -65,17 +118,38 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 	/* Set the line meta data */
 	new_line->len = len;
 	new_line->type = type;
-	new_line->time = time(NULL);
+	new_line->time = newline_time ? newline_time : time(NULL);
+
+	strcpy(new_line->time_str, timestamp(new_line->time));
 
 	/* Rows are recalculated by the draw routine when == 0 */
 	new_line->rows = 0;
 
+	/* Trace lines resulting from received messages */
+	new_line->trace.read = 0;
+
+	if (trace.read && trace.parse) {
+
+		new_line->trace.read = trace.read;
+		new_line->trace.parse = trace.parse;
+		new_line->trace.insert = time_us();
+
+		histogram_add(&trace.parse_insert, new_line->trace.insert - trace.parse);
+
+		/* Lines not added to the current channel aren't drawn immediately */
+		if (c != ccur)
+			trace_line(new_line, 0);
+	}
+
 	/* If from is NULL, assume server message */
-	strncpy(new_line->from, (from) ? from : c->name, NICKSIZE);
+	strncpy(new_line->from, (from) ? from : c->name, NICKSIZE - 1);
+	new_line->from[NICKSIZE - 1] = '\0';
+
+	/* Sender width and colour are fixed for the line's lifetime */
+	new_line->from_len = strlen(new_line->from);
+	new_line->from_fg = nick_col(new_line->from, c->server ? c->server->isupport.casemap : casemap_ascii);
 
-	size_t len_from;
-	if ((len_from = strlen(new_line->from)) > c->draw.nick_pad)
-		c->draw.nick_pad = len_from;
+	nick_pad_add(c, new_line->from_len);
 
 	if (mesg == NULL)
 		fatal("mesg is null");
@@ -83,7 +157,11 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 	if ((new_line->text = malloc(new_line->len + 1)) == NULL)
 		fatal("newline");
 
-	strcpy(new_line->text, mesg);
+	memcpy(new_line->text, mesg, len);
+	new_line->text[len] = '\0';
+
+	if (config.headless)
+		log_line(c, new_line);
 
 	if (c == ccur)
 		draw(D_BUFFER);
@@ -93,6 +171,316 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 	}
 }
 
+static void
+batch_add(struct batch *b, channel *c, line_t type, const char *from, const char *mesg, size_t len)
+{
+	/* Append a line to a batch, the sender is stored after the text */
+
+	struct batch_line *l;
+	size_t from_len = (from) ? strlen(from) : 0;
+
+	if (c == NULL)
+		fatal("channel is null");
+
+	if (mesg == NULL)
+		fatal("mesg is null");
+
+	if ((l = malloc(sizeof(*l) + len + from_len + 2)) == NULL)
+		fatal("batch_add");
+
+	l->c = c;
+	l->type = type;
+	l->len = len;
+	l->time = newline_time ? newline_time : time(NULL);
+	l->next = NULL;
+
+	memcpy(l->text, mesg, len);
+	l->text[len] = '\0';
+
+	/* If from is NULL, _newline assumes a server message */
+	if (from) {
+		l->from = l->text + len + 1;
+		memcpy(l->from, from, from_len + 1);
+	} else
+		l->from = NULL;
+
+	if (b->tail)
+		b->tail->next = l;
+	else
+		b->head = l;
+
+	b->tail = l;
+
+	/* Bound the memory held by a batch that never ends */
+	if (++b->count == BATCH_LINES)
+		batch_flush(b);
+}
+
+static void
+batch_drop(channel *c)
+{
+	/* Discard a channel's lines from its server's batches, before it's freed */
+
+	struct batch *b;
+	struct batch_line *l, **lp;
+
+	for (b = c->server->batch; b; b = b->next) {
+
+		b->tail = NULL;
+
+		for (lp = &b->head; (l = *lp);) {
+			if (l->c == c) {
+				*lp = l->next;
+				b->count--;
+				free(l);
+			} else {
+				b->tail = l;
+				lp = &l->next;
+			}
+		}
+	}
+}
+
+static void
+batch_flush(struct batch *b)
+{
+	/* Insert a batch's lines into their channels' buffers.
+	 *
+	 * Only the last SCROLLBACK_BUFFER lines for a channel would remain in its
+	 * buffer, so any before them are skipped, unless every line is logged */
+
+	struct batch *batch = newline_batch;
+	struct batch_line *t, *l;
+	time_t time = newline_time;
+
+	newline_batch = NULL;
+
+	for (l = b->head; l; l = l->next)
+		l->c->batch_lines++;
+
+	for (l = b->head; l;) {
+
+		if (l->c->batch_lines-- <= SCROLLBACK_BUFFER || config.headless) {
+			newline_time = l->time;
+			_newline(l->c, l->type, l->from, l->text, l->len);
+		}
+
+		t = l;
+		l = l->next;
+		free(t);
+	}
+
+	b->head = NULL;
+	b->tail = NULL;
+	b->count = 0;
+
+	newline_batch = batch;
+	newline_time = time;
+}
+
+struct batch*
+batch_get(server *s, const char *ref)
+{
+	/* Find an open batch by reference, returns NULL if not found */
+
+	struct batch *b;
+
+	for (b = s->batch; b; b = b->next)
+		if (!strcmp(b->ref, ref))
+			return b;
+
+	return NULL;
+}
+
+void
+batch_start(server *s, const char *ref)
+{
+	/* Open a batch. Beyond BATCH_OPEN open batches, or for an invalid
+	 * reference, lines are instead inserted as they arrive */
+
+	struct batch *b;
+	unsigned int n = 0;
+
+	for (b = s->batch; b; b = b->next)
+		n++;
+
+	if (n >= BATCH_OPEN || strlen(ref) >= BATCH_REFSIZE || batch_get(s, ref))
+		return;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		fatal("calloc");
+
+	strcpy(b->ref, ref);
+
+	b->next = s->batch;
+	s->batch = b;
+}
+
+void
+batch_end(server *s, const char *ref)
+{
+	/* Close a batch, inserting its lines */
+
+	struct batch *b, **bp;
+
+	for (bp = &s->batch; (b = *bp); bp = &b->next) {
+		if (!strcmp(b->ref, ref)) {
+
+			*bp = b->next;
+
+			batch_flush(b);
+
+			if (newline_batch == b)
+				newline_batch = NULL;
+
+			free(b);
+
+			return;
+		}
+	}
+}
+
+void
+batch_end_all(server *s)
+{
+	/* Close all of a server's batches, e.g. when disconnected mid-playback */
+
+	while (s->batch)
+		batch_end(s, s->batch->ref);
+}
+
+static void
+log_line(channel *c, line *l)
+{
+	/* In headless mode lines are written to stdout rather than drawn, as tab
+	 * separated fields: <time> <server> <channel> <from> <text> */
+
+	printf("%ld\t%s\t%s\t%s\t%s\n",
+		(long) l->time,
+		c->server ? c->server->host : "-",
+		c->name,
+		l->from,
+		l->text);
+}
+
+void
+trace_line(line *l, unsigned long long draw_time)
+{
+	/* Record a traced line's receive to render latency, and stop tracing it.
+	 *
+	 * draw_time is 0 for lines not drawn immediately */
+
+	if (draw_time) {
+		histogram_add(&trace.insert_draw, draw_time - l->trace.insert);
+		histogram_add(&trace.read_draw, draw_time - l->trace.read);
+	} else {
+		trace.undrawn++;
+	}
+
+	if (trace.file) {
+
+		struct trace_record r = {
+			.read = l->trace.read,
+			.parse = l->trace.parse,
+			.insert = l->trace.insert,
+			.draw = draw_time
+		};
+
+		fwrite(&r, sizeof(r), 1, trace.file);
+	}
+
+	l->trace.read = 0;
+}
+
+static void
+nick_pad_add(channel *c, size_t len)
+{
+	/* Count a line sender of length len, growing the channel's nick padding if needed */
+
+	c->draw.nick_pad_count[len]++;
+
+	if (len > c->draw.nick_pad) {
+		c->draw.nick_pad = len;
+
+		/* Cached line rows depend on the padding */
+		c->resized = 1;
+	}
+}
+
+static void
+nick_pad_del(channel *c, size_t len)
+{
+	/* Uncount a line sender of length len, shrinking the channel's nick padding
+	 * to the next widest sender when the last of the widest is removed */
+
+	if (c->draw.nick_pad_count[len] == 0 || --c->draw.nick_pad_count[len] || len != c->draw.nick_pad)
+		return;
+
+	while (c->draw.nick_pad && c->draw.nick_pad_count[c->draw.nick_pad] == 0)
+		c->draw.nick_pad--;
+
+	/* Cached line rows depend on the padding */
+	c->resized = 1;
+}
+
+static const char*
+timestamp(time_t t)
+{
+	/* Format a line timestamp, caching the result for the current minute
+	 *
+	 * Lines typically arrive in bursts within the same minute, so localtime()
+	 * and strftime() are only called when the minute changes */
+
+	static char cache[TIMESTAMP_SIZE];
+	static time_t cache_minute = -1;
+
+	time_t minute = t - (t % 60);
+
+	if (minute != cache_minute) {
+
+		struct tm *tm = localtime(&t);
+
+		if (tm == NULL || !strftime(cache, TIMESTAMP_SIZE, config.timestamp_format, tm))
+			*cache = '\0';
+
+		cache_minute = minute;
+	}
+
+	return cache;
+}
+
+int
+timestamp_width(const char *format)
+{
+	/* Width of the widest timestamp a format gives, sampled over every hour,
+	 * weekday and month. Returns 0 for formats giving an empty timestamp or
+	 * exceeding TIMESTAMP_SIZE */
+
+	char buf[TIMESTAMP_SIZE];
+	int i, len, width = 0;
+
+	struct tm tm = {
+		.tm_year = 100,
+		.tm_mday = 28,
+		.tm_min = 59
+	};
+
+	for (i = 0; i < 24 * 7; i++) {
+
+		tm.tm_hour = i % 24;
+		tm.tm_wday = i % 7;
+		tm.tm_mon = i % 12;
+
+		if ((len = strftime(buf, sizeof(buf), format, &tm)) == 0)
+			return 0;
+
+		if (len > width)
+			width = len;
+	}
+
+	return width;
+}
+
 channel*
 new_channel(char *name, server *server, channel *chanlist)
 {
@@ -123,9 +511,15 @@ void
 free_channel(channel *c)
 {
 	line *l;
+
+	if (c->server)
+		batch_drop(c);
+
 	for (l = c->buffer; l < c->buffer + SCROLLBACK_BUFFER; l++)
 		free(l->text);
 
+	reset_names(c);
+	free(c->key);
 	free_avl(c->nicklist);
 	free_input(c->input);
 	free(c);
@@ -137,7 +531,7 @@ channel_get(char *chan, server *s)
 	channel *c = s->channel;
 
 	do {
-		if (!strcmp(c->name, chan))
+		if (!irc_strcmp(s->isupport.casemap, c->name, chan))
 			return c;
 
 	} while ((c = c->next) != s->channel);
@@ -145,14 +539,32 @@ channel_get(char *chan, server *s)
 	return NULL;
 }
 
+void
+reset_names(channel *c)
+{
+	/* Free the members staged from NAMES replies not yet ended */
+
+	while (c->names.len)
+		free_avl(c->names.nodes[--c->names.len]);
+
+	free(c->names.nodes);
+	c->names.nodes = NULL;
+	c->names.size = 0;
+}
+
 void
 clear_channel(channel *c)
 {
-	free(c->buffer_head->text);
+	line *l;
+	for (l = c->buffer; l < c->buffer + SCROLLBACK_BUFFER; l++) {
+		free(l->text);
+		l->text = NULL;
+	}
 
-	c->buffer_head->text = NULL;
+	memset(c->draw.nick_pad_count, 0, sizeof(c->draw.nick_pad_count));
 
 	c->draw.nick_pad = 0;
+	c->draw.scrollable = 0;
 
 	draw(D_BUFFER);
 }
@@ -1,7 +1,11 @@
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <string.h>
 #include <strings.h>
@@ -11,16 +15,170 @@
 #define H(N) (N == NULL ? 0 : N->height)
 #define MAX(A, B) (A > B ? A : B)
 
+/* Ignore mask functions */
+static char* mask_prefix(char*, size_t, const char*, const char*);
+static int glob_match(const unsigned char*, const char*, const char*);
+static int suffix_match(const unsigned char*, const char*, size_t, const char*, const char*);
+static size_t glob_suffix(const char*);
+static void ignore_compile(struct ignore*, const unsigned char*);
+
+/* Filter rule functions */
+struct filter_rule;
+static void filter_compile(struct filter*);
+static void filter_rule_free(struct filter_rule*);
+
 /* AVL tree function */
 static avl_node* _avl_add(avl_node*, const char*, void*);
+static avl_node* _avl_build(avl_node**, size_t);
+static void avl_sort(avl_node**, avl_node**, size_t);
 static avl_node* _avl_del(avl_node*, const char*);
 static avl_node* _avl_get(avl_node*, const char*, size_t);
-static avl_node* avl_new_node(const char*, void*);
 static avl_node* avl_rotate_L(avl_node*);
 static avl_node* avl_rotate_R(avl_node*);
 
 static jmp_buf jmpbuf;
 
+/* Case folding for AVL tree comparisons, set by the entry points */
+static const unsigned char *avl_casemap;
+
+/* Ignore masks, nick!user@host globs of '*' and '?', each with the types
+ * of message it ignores.
+ *
+ * Masks are compiled into a trie of their case folded literal prefixes, up
+ * to their first glob character, each node listing the masks whose prefix
+ * ends there. A message's prefix walks the trie, so only masks along its
+ * path are glob matched, from the end of their literal prefix, once their
+ * literal suffix, following their last glob character, is found to match.
+ * Masks are compiled on the first match following a change */
+struct ignore_mask
+{
+	struct ignore_mask *next;
+	struct ignore_mask *node_next;
+	size_t prefix_len;
+	size_t suffix_len;
+	const char *suffix;
+	unsigned int types;
+	char mask[];
+};
+
+struct ignore_node
+{
+	unsigned char c;
+	unsigned int child;
+	unsigned int sibling;
+	struct ignore_mask *masks;
+};
+
+struct ignore
+{
+	const unsigned char *casemap;
+	struct ignore_mask *masks;
+	struct ignore_node *nodes;
+	unsigned int nodes_len;
+	unsigned int nodes_size;
+};
+
+/* Filter rules, each a set of conditions on a message, all of which must
+ * be met for the rule to drop it.
+ *
+ * Rules are compiled into a program of tests, ordered cheapest first within
+ * each rule, where a failed test jumps to the next rule's first test and a
+ * rule's last instruction drops the message. The union of all rules' types
+ * rejects most messages before the program runs */
+enum filter_op
+{
+	FILTER_OP_TYPES,
+	FILTER_OP_USERS,
+	FILTER_OP_CHAN,
+	FILTER_OP_FROM,
+	FILTER_OP_TEXT,
+	FILTER_OP_DROP
+};
+
+struct filter_insn
+{
+	enum filter_op op;
+	unsigned int fail;
+	struct filter_rule *rule;
+};
+
+struct filter_rule
+{
+	struct filter_rule *next;
+	unsigned long hits;
+	unsigned int types;
+	long users;
+	const char *chan;
+	const char *from;
+	const char *from_suffix;
+	size_t from_suffix_len;
+	regex_t *text;
+	char *args;
+	char rule[];
+};
+
+struct filter
+{
+	struct filter_rule *rules;
+	struct filter_insn *prog;
+	unsigned int len;
+	unsigned int types;
+};
+
+/* Message types filter rules apply to */
+static const struct {
+	const char *name;
+	unsigned int type;
+} filter_names[] = {
+	{ "privmsg", FILTER_PRIVMSG },
+	{ "notice",  FILTER_NOTICE },
+	{ "join",    FILTER_JOIN },
+	{ "part",    FILTER_PART },
+	{ "quit",    FILTER_QUIT },
+	{ "nick",    FILTER_NICK },
+	{ "all",     FILTER_ALL }
+};
+
+#define FILTER_TYPES (sizeof(filter_names) / sizeof(filter_names[0]))
+
+/* Highlight automaton, an Aho-Corasick automaton of words compiled to a DFA.
+ *
+ * Transitions are over character classes rather than bytes, characters
+ * folding to the same character of a word share a class, and all others
+ * share class 0. State 0 is the root. For each state, out is the length
+ * of the word ending there, or 0, and dict is the nearest state along its
+ * failure links with a word ending there, or 0.
+ *
+ * Once compiled, transitions hold the offset of the state's row, flagged
+ * with HIGHLIGHT_OUT for states where any word ends */
+#define HIGHLIGHT_OUT (1u << 31)
+
+struct highlight
+{
+	unsigned char class[256];
+	unsigned int classes;
+	unsigned int states;
+	unsigned int *delta;
+	unsigned int *out;
+	unsigned int *dict;
+};
+
+/* Case folding tables, mapping uppercase characters to lowercase, where
+ * uppercase ranges from 'A' up to U:
+ *
+ *   ascii:           A-Z
+ *   rfc1459:         A-Z [ \ ] ^   as   a-z { | } ~
+ *   strict-rfc1459:  A-Z [ \ ]     as   a-z { | } */
+#define CM1(C, U)   (((C) >= 'A' && (C) <= (U)) ? (C) + ('a' - 'A') : (C))
+#define CM4(C, U)   CM1(C, U),        CM1(C + 1, U),        CM1(C + 2, U),        CM1(C + 3, U)
+#define CM16(C, U)  CM4(C, U),        CM4(C + 4, U),        CM4(C + 8, U),        CM4(C + 12, U)
+#define CM64(C, U)  CM16(C, U),       CM16(C + 16, U),      CM16(C + 32, U),      CM16(C + 48, U)
+#define CM256(U)    CM64(0, U),       CM64(64, U),          CM64(128, U),         CM64(192, U)
+
+const unsigned char casemap_ascii[256]          = { CM256('Z') };
+const unsigned char casemap_rfc1459[256]        = { CM256('^') };
+const unsigned char casemap_strict_rfc1459[256] = { CM256(']') };
+
 /* TODO:
  *
  * this should just be rewritten as an implementation of strsep, and would replace
@@ -113,6 +271,20 @@ parse(parsed_mesg *p, char *mesg)
 
 	*p = (parsed_mesg){0};
 
+	/* IRCv3 message tags, split lazily by tag_next() */
+	/* message =/ [ "@" tags SPACE ] [ ":" prefix SPACE ] command [ params ] crlf */
+
+	if (*mesg == '@') {
+
+		p->tags = ++mesg;
+
+		while (*mesg && *mesg != ' ')
+			mesg++;
+
+		while (*mesg == ' ')
+			*mesg++ = '\0';
+	}
+
 	/* prefix = servername / ( nickname [ [ "!" user ] "@" host ] ) */
 
 	if (*mesg == ':') {
@@ -163,35 +335,989 @@ parse(parsed_mesg *p, char *mesg)
 	return 1;
 }
 
-/* TODO:
- * Consider cleaning up the policy here. Ideally a match should be:
- * match = nick *[chars] (space / null)
- * chars = Any printable characters not allowed in a nick by this server */
 int
-check_pinged(char *mesg, char *nick)
+tag_next(const char **tags, mesg_tag *t)
 {
-	int len = strlen(nick);
+	/* Get the next tag from a message's tags, advancing *tags past it.
+	 * Returns 0 when no tags remain.
+	 *
+	 * tags = tag *( ";" tag ), tag = key [ "=" escaped_value ] */
 
-	while (*mesg) {
+	const char *ptr = *tags;
 
-		/* skip to next word */
-		while (*mesg == ' ')
-			mesg++;
+	if (ptr == NULL || *ptr == '\0')
+		return 0;
+
+	t->key = ptr;
+
+	while (*ptr && *ptr != '=' && *ptr != ';')
+		ptr++;
+
+	t->key_len = ptr - t->key;
+
+	if (*ptr == '=')
+		ptr++;
+
+	t->val = ptr;
+
+	while (*ptr && *ptr != ';')
+		ptr++;
+
+	t->val_len = ptr - t->val;
+
+	if (*ptr == ';')
+		ptr++;
+
+	*tags = ptr;
 
-		/* nick prefixes the word, following character is space or symbol */
-		if (!strncasecmp(mesg, nick, len) && !isalnum(*(mesg + len))) {
-			putchar('\a');
+	return 1;
+}
+
+int
+tag_get(const char *tags, const char *key, mesg_tag *t)
+{
+	/* Find a tag by key, returns 0 if not found */
+
+	size_t len = strlen(key);
+
+	while (tag_next(&tags, t))
+		if (t->key_len == len && !memcmp(t->key, key, len))
 			return 1;
+
+	return 0;
+}
+
+size_t
+tag_unescape(char *buf, size_t size, const mesg_tag *t)
+{
+	/* Copy a tag's value to buf, unescaped and null terminated, truncating to
+	 * fit within size. Returns the length copied.
+	 *
+	 * \: = ';', \s = ' ', \\ = '\', \r = CR, \n = LF, otherwise the backslash
+	 * is dropped, including a trailing backslash */
+
+	const char *ptr = t->val, *end = t->val + t->val_len;
+	size_t len = 0;
+
+	if (size == 0)
+		return 0;
+
+	while (ptr < end && len < size - 1) {
+
+		char c = *ptr++;
+
+		if (c == '\\') {
+
+			if (ptr == end)
+				break;
+
+			switch ((c = *ptr++)) {
+				case ':': c = ';';  break;
+				case 's': c = ' ';  break;
+				case 'r': c = '\r'; break;
+				case 'n': c = '\n'; break;
+			}
 		}
 
-		/* skip to end of word */
-		while (*mesg && *mesg != ' ')
-			mesg++;
+		buf[len++] = c;
+	}
+
+	buf[len] = '\0';
+
+	return len;
+}
+
+static int
+tag_digits(const char **ptr, int n)
+{
+	/* Read exactly n decimal digits, returns -1 if invalid */
+
+	int ret = 0;
+
+	while (n--) {
+
+		if (!isdigit((unsigned char) **ptr))
+			return -1;
+
+		ret = ret * 10 + (*(*ptr)++ - '0');
+	}
+
+	return ret;
+}
+
+time_t
+tag_time(const mesg_tag *t)
+{
+	/* Convert a server-time tag's value, YYYY-MM-DDThh:mm:ss[.sss]Z in UTC, to
+	 * a time_t. Returns 0 if invalid.
+	 *
+	 * Parsed by hand rather than sscanf() since it's done for most messages
+	 * from servers supporting server-time */
+
+	char buf[32];
+	const char *ptr = buf;
+	int Y, M, D, h, m, s;
+	long era, yoe, doy, doe, days;
+
+	tag_unescape(buf, sizeof(buf), t);
+
+	if ((Y = tag_digits(&ptr, 4)) < 0 || *ptr++ != '-'
+	 || (M = tag_digits(&ptr, 2)) < 0 || *ptr++ != '-'
+	 || (D = tag_digits(&ptr, 2)) < 0 || *ptr++ != 'T'
+	 || (h = tag_digits(&ptr, 2)) < 0 || *ptr++ != ':'
+	 || (m = tag_digits(&ptr, 2)) < 0 || *ptr++ != ':'
+	 || (s = tag_digits(&ptr, 2)) < 0)
+		return 0;
+
+	/* Fractional seconds are ignored, but the time must be UTC */
+	if (*ptr == '.')
+		while (isdigit((unsigned char) *++ptr))
+			;
+
+	if (strcmp(ptr, "Z") || M < 1 || M > 12 || D < 1 || D > 31 || h > 23 || m > 59 || s > 60)
+		return 0;
+
+	/* Days since the epoch, for the proleptic Gregorian calendar, with the
+	 * year starting in March so leap days fall at its end */
+	Y -= (M <= 2);
+
+	era = (Y >= 0 ? Y : Y - 399) / 400;
+	yoe = Y - era * 400;
+	doy = (153 * (M + (M > 2 ? -3 : 9)) + 2) / 5 + D - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	days = era * 146097 + doe - 719468;
+
+	return (time_t) days * 86400 + h * 3600 + m * 60 + s;
+}
+
+/* Highlight functions */
+
+struct highlight*
+highlight_compile(const unsigned char *casemap, const char *words)
+{
+	/* Compile a comma and/or space separated list of words to match by
+	 * highlight_match(), case folded by casemap.
+	 *
+	 * The Aho-Corasick automaton of the words is built as a trie, then
+	 * completed to a DFA in breadth first order, each state's missing
+	 * transitions taken from the state at its failure link */
+
+	struct highlight *h;
+	unsigned int *fail, *queue, c, u, v, head, tail, size = 1;
+	unsigned char folded[256] = {0};
+	const char *ptr;
+	size_t i;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		fatal("calloc");
+
+	/* Assign a class to each folded character of the words, class 0 being
+	 * all other characters */
+	for (h->classes = 1, ptr = words; *ptr; ptr++, size++) {
+
+		unsigned char f = casemap[(unsigned char) *ptr];
+
+		if (*ptr != ',' && *ptr != ' ' && !folded[f])
+			folded[f] = h->classes++;
+	}
+
+	for (i = 0; i < 256; i++)
+		h->class[i] = folded[casemap[i]];
+
+	if ((h->delta = calloc(size * h->classes, sizeof(*h->delta))) == NULL)
+		fatal("calloc");
+
+	if ((h->out = calloc(size, sizeof(*h->out))) == NULL)
+		fatal("calloc");
+
+	if ((h->dict = calloc(size, sizeof(*h->dict))) == NULL)
+		fatal("calloc");
+
+	if ((fail = calloc(size, sizeof(*fail))) == NULL || (queue = calloc(size, sizeof(*queue))) == NULL)
+		fatal("calloc");
+
+	/* Build the trie, no transition leads to the root so 0 is none */
+	for (h->states = 1, ptr = words; *ptr;) {
+
+		size_t len = strcspn(ptr, ", ");
+
+		for (u = 0, i = 0; i < len; i++, u = v) {
+
+			c = h->class[(unsigned char) ptr[i]];
+
+			if (!(v = h->delta[u * h->classes + c]))
+				v = h->delta[u * h->classes + c] = h->states++;
+		}
+
+		if (len)
+			h->out[u] = len;
+
+		ptr += len;
+		ptr += strspn(ptr, ", ");
+	}
+
+	/* Complete the DFA, a state's own row holds only its trie transitions
+	 * until it's dequeued */
+	for (head = 0, tail = 1, queue[0] = 0; head < tail; head++) {
+
+		u = queue[head];
+
+		for (c = 0; c < h->classes; c++) {
+
+			if ((v = h->delta[u * h->classes + c])) {
+
+				fail[v] = u ? h->delta[fail[u] * h->classes + c] : 0;
+				h->dict[v] = h->out[fail[v]] ? fail[v] : h->dict[fail[v]];
+
+				queue[tail++] = v;
+
+			} else if (u) {
+				h->delta[u * h->classes + c] = h->delta[fail[u] * h->classes + c];
+			}
+		}
+	}
+
+	/* Replace states by their row offset, flagging states ending words */
+	for (i = 0; i < (size_t) h->states * h->classes; i++) {
+
+		v = h->delta[i];
+
+		h->delta[i] = (v * h->classes) | ((h->out[v] || h->dict[v]) ? HIGHLIGHT_OUT : 0);
+	}
+
+	free(fail);
+	free(queue);
+
+	return h;
+}
+
+int
+highlight_match(const struct highlight *h, const char *mesg)
+{
+	/* Find any compiled word in mesg, as a whole word, i.e. not preceded or
+	 * followed by an alphanumeric character. Returns 1 if found */
+
+	const char *ptr;
+	unsigned int t, u = 0;
+
+	for (ptr = mesg; *ptr; ptr++) {
+
+		u = h->delta[(u & ~HIGHLIGHT_OUT) + h->class[(unsigned char) *ptr]];
+
+		if (!(u & HIGHLIGHT_OUT))
+			continue;
+
+		t = (u & ~HIGHLIGHT_OUT) / h->classes;
+
+		/* Each word ending here, longest first */
+		for (t = h->out[t] ? t : h->dict[t]; t; t = h->dict[t]) {
+
+			const char *start = ptr - h->out[t] + 1;
+
+			if ((start == mesg || !isalnum((unsigned char) start[-1])) && !isalnum((unsigned char) ptr[1]))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+highlight_free(struct highlight *h)
+{
+	if (h == NULL)
+		return;
+
+	free(h->delta);
+	free(h->out);
+	free(h->dict);
+	free(h);
+}
+
+unsigned long long
+time_us(void)
+{
+	/* Monotonic time in microseconds, for measuring durations */
+
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		fatal("clock_gettime");
+
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Histogram functions */
+
+void
+histogram_add(histogram *h, unsigned long val)
+{
+	/* Count a value in a log-linear histogram
+	 *
+	 * Values less than 2^(HISTOGRAM_SUB_BITS + 1) are counted exactly. Larger
+	 * values are bucketed by their most significant bit, then by the following
+	 * HISTOGRAM_SUB_BITS bits */
+
+	unsigned long tmp = val;
+	unsigned int i, msb = 0;
+
+	h->count++;
+	h->sum += val;
+
+	if (val > h->max)
+		h->max = val;
+
+	while ((tmp >>= 1))
+		msb++;
+
+	if (msb <= HISTOGRAM_SUB_BITS)
+		i = val;
+	else
+		i = ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+			+ ((val >> (msb - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+
+	if (i >= HISTOGRAM_BUCKETS)
+		i = HISTOGRAM_BUCKETS - 1;
+
+	h->buckets[i]++;
+}
+
+unsigned long
+histogram_percentile(const histogram *h, double p)
+{
+	/* Return the lower bound of the bucket containing the pth percentile value,
+	 * or the max value if it's lower */
+
+	unsigned long count = 0, target = p * h->count, val;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+		if ((count += h->buckets[i]) > target)
+			break;
+
+	if (i < (2 << HISTOGRAM_SUB_BITS))
+		val = i;
+	else
+		val = (unsigned long)((1 << HISTOGRAM_SUB_BITS) + (i & ((1 << HISTOGRAM_SUB_BITS) - 1)))
+			<< ((i >> HISTOGRAM_SUB_BITS) - 1);
+
+	return (val < h->max) ? val : h->max;
+}
+
+int
+irc_strcmp(const unsigned char *casemap, const char *s1, const char *s2)
+{
+	/* Compare strings, case folded by a casemap table.
+	 *
+	 * Characters are only folded where they differ, the common case when
+	 * comparing nicks being equal bytes */
+
+	const unsigned char *p1 = (const unsigned char *) s1;
+	const unsigned char *p2 = (const unsigned char *) s2;
+
+	for (; *p1 == *p2 || casemap[*p1] == casemap[*p2]; p1++, p2++)
+		if (*p1 == '\0')
+			return 0;
+
+	return casemap[*p1] - casemap[*p2];
+}
+
+int
+irc_strncmp(const unsigned char *casemap, const char *s1, const char *s2, size_t n)
+{
+	/* Compare at most n characters of strings, case folded by a casemap table */
+
+	const unsigned char *p1 = (const unsigned char *) s1;
+	const unsigned char *p2 = (const unsigned char *) s2;
+
+	for (; n; n--, p1++, p2++) {
+
+		if (*p1 != *p2 && casemap[*p1] != casemap[*p2])
+			return casemap[*p1] - casemap[*p2];
+
+		if (*p1 == '\0')
+			return 0;
+	}
+
+	return 0;
+}
+
+/* Ignore mask functions */
+
+int
+ignore_add(struct ignore **i, const unsigned char *casemap, const char *mask, unsigned int types)
+{
+	/* Add a mask ignoring types, returns 0 if the mask exists */
+
+	struct ignore_mask *m, **ptr;
+
+	if (*i == NULL && (*i = calloc(1, sizeof(**i))) == NULL)
+		fatal("calloc");
+
+	for (ptr = &(*i)->masks; *ptr; ptr = &(*ptr)->next)
+		if (!irc_strcmp(casemap, (*ptr)->mask, mask))
+			return 0;
+
+	if ((m = calloc(1, sizeof(*m) + strlen(mask) + 1)) == NULL)
+		fatal("calloc");
+
+	strcpy(m->mask, mask);
+	m->types = types;
+
+	*ptr = m;
+
+	(*i)->casemap = NULL;
+
+	return 1;
+}
+
+int
+ignore_del(struct ignore **i, const unsigned char *casemap, const char *mask)
+{
+	/* Delete a mask, returns 0 if not found */
+
+	struct ignore_mask *m, **ptr;
+
+	if (*i == NULL)
+		return 0;
+
+	for (ptr = &(*i)->masks; (m = *ptr); ptr = &m->next) {
+		if (!irc_strcmp(casemap, m->mask, mask)) {
+			*ptr = m->next;
+			free(m);
+			(*i)->casemap = NULL;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+const char*
+ignore_list(const struct ignore *i, const void **iter, unsigned int *types)
+{
+	/* Iterate a server's masks in the order added, starting from *iter
+	 * NULL. Returns NULL following the last */
+
+	const struct ignore_mask *m;
+
+	if (i == NULL)
+		return NULL;
+
+	m = (*iter) ? ((const struct ignore_mask *) *iter)->next : i->masks;
+
+	if ((*iter = m) == NULL)
+		return NULL;
+
+	*types = m->types;
+
+	return m->mask;
+}
+
+int
+ignore_match(struct ignore *i, const unsigned char *casemap, unsigned int type, const char *nick, const char *hostinfo)
+{
+	/* Returns 1 if a message of type from nick, with the parsed prefix's
+	 * hostinfo, i.e. user@host, host, or none, is ignored */
+
+	char prefix[BUFFSIZE], *end;
+	const char *ptr;
+	struct ignore_mask *m;
+	unsigned int u = 0;
+
+	if (i == NULL || i->masks == NULL)
+		return 0;
+
+	if (i->casemap != casemap)
+		ignore_compile(i, casemap);
+
+	if ((end = mask_prefix(prefix, sizeof(prefix), nick, hostinfo)) == NULL)
+		return 0;
+
+	for (ptr = prefix;; ptr++) {
+
+		for (m = i->nodes[u].masks; m; m = m->node_next) {
+
+			if (!(m->types & type) || !suffix_match(casemap, m->suffix, m->suffix_len, ptr, end))
+				continue;
+
+			if (glob_match(casemap, m->mask + m->prefix_len, ptr))
+				return 1;
+		}
+
+		if (*ptr == '\0')
+			return 0;
+
+		for (u = i->nodes[u].child; u; u = i->nodes[u].sibling)
+			if (i->nodes[u].c == casemap[(unsigned char) *ptr])
+				break;
+
+		if (u == 0)
+			return 0;
+	}
+}
+
+void
+ignore_free(struct ignore *i)
+{
+	struct ignore_mask *t, *m;
+
+	if (i == NULL)
+		return;
+
+	for (m = i->masks; m; m = t) {
+		t = m->next;
+		free(m);
+	}
+
+	free(i->nodes);
+	free(i);
+}
+
+static void
+ignore_compile(struct ignore *i, const unsigned char *casemap)
+{
+	/* Build the trie of masks' literal prefixes, node 0 is the root, and
+	 * as no node is a child of the root, 0 is also none */
+
+	struct ignore_mask *m;
+	unsigned int u, v;
+	const char *ptr;
+
+	i->nodes_len = 1;
+	i->nodes_size = 0;
+
+	for (m = i->masks; m; m = m->next)
+		i->nodes_size += strlen(m->mask) + 1;
+
+	free(i->nodes);
+
+	if ((i->nodes = calloc(i->nodes_size + 1, sizeof(*i->nodes))) == NULL)
+		fatal("calloc");
+
+	for (m = i->masks; m; m = m->next) {
+
+		for (u = 0, ptr = m->mask; *ptr && *ptr != '*' && *ptr != '?'; ptr++, u = v) {
+
+			unsigned char c = casemap[(unsigned char) *ptr];
+
+			for (v = i->nodes[u].child; v; v = i->nodes[v].sibling)
+				if (i->nodes[v].c == c)
+					break;
+
+			if (v == 0) {
+				v = i->nodes_len++;
+				i->nodes[v].c = c;
+				i->nodes[v].sibling = i->nodes[u].child;
+				i->nodes[u].child = v;
+			}
+		}
+
+		m->prefix_len = ptr - m->mask;
+		m->suffix_len = glob_suffix(ptr);
+		m->suffix = ptr + strlen(ptr) - m->suffix_len;
+
+		m->node_next = i->nodes[u].masks;
+		i->nodes[u].masks = m;
+	}
+
+	i->casemap = casemap;
+}
+
+static char*
+mask_prefix(char *buf, size_t size, const char *nick, const char *hostinfo)
+{
+	/* Build a message's prefix as nick!user@host in buf, user and host
+	 * possibly empty. Returns its end, or NULL if it doesn't fit */
+
+	char *end;
+	size_t nick_len = strlen(nick), host_len = hostinfo ? strlen(hostinfo) : 0;
+
+	if (nick_len + host_len + 3 > size)
+		return NULL;
+
+	memcpy(buf, nick, nick_len);
+	end = buf + nick_len;
+	*end++ = '!';
+
+	if (hostinfo == NULL || !strchr(hostinfo, '@'))
+		*end++ = '@';
+
+	memcpy(end, hostinfo ? hostinfo : "", host_len);
+	end += host_len;
+	*end = '\0';
+
+	return end;
+}
+
+static int
+glob_match(const unsigned char *casemap, const char *glob, const char *str)
+{
+	/* Case folded match of str against glob, where '*' matches any sequence
+	 * of characters and '?' any single character.
+	 *
+	 * On mismatch, only the most recent '*' is retried, extended by one
+	 * character, which is sufficient as any earlier '*' could only absorb
+	 * what the later one can */
+
+	const char *glob_star = NULL, *str_star = NULL;
+
+	while (*str) {
+
+		if (*glob == '*') {
+			glob_star = ++glob;
+			str_star = str;
+		} else if (*glob && (*glob == '?' || casemap[(unsigned char) *glob] == casemap[(unsigned char) *str])) {
+			glob++;
+			str++;
+		} else if (glob_star) {
+			glob = glob_star;
+			str = ++str_star;
+		} else {
+			return 0;
+		}
+	}
+
+	while (*glob == '*')
+		glob++;
+
+	return (*glob == '\0');
+}
+
+static size_t
+glob_suffix(const char *glob)
+{
+	/* Length of a glob's literal suffix, following its last glob character */
+
+	size_t len = 0;
+
+	for (; *glob; glob++)
+		len = (*glob == '*' || *glob == '?') ? 0 : len + 1;
+
+	return len;
+}
+
+static int
+suffix_match(const unsigned char *casemap, const char *suffix, size_t len, const char *str, const char *end)
+{
+	/* Case folded check that the string from str to end ends with suffix,
+	 * rejecting most globs before backtracking over their '*' */
+
+	size_t i;
+
+	if ((size_t)(end - str) < len)
+		return 0;
+
+	for (end -= len, i = 0; i < len; i++)
+		if (casemap[(unsigned char) suffix[i]] != casemap[(unsigned char) end[i]])
+			return 0;
+
+	return 1;
+}
+
+/* Filter rule functions */
+
+const char*
+filter_add(struct filter **f, const char *rule)
+{
+	/* Add a rule, returns NULL, or an error describing why it's invalid.
+	 *
+	 * <types> [in <chan>] [over <users>] [from <mask>] [matching <regex>]
+	 *
+	 * types:    comma separated, any of privmsg, notice, join, part, quit,
+	 *           nick, or all
+	 * chan:     glob matched against the message's channel
+	 * users:    count of users in the message's channel exceeded
+	 * mask:     glob matched against the sender's nick!user@host
+	 * regex:    extended regular expression, the remainder of the rule,
+	 *           searched for in the message's text */
+
+	char *arg, *key, *name, *state, *type_state, *end;
+	const char *err = NULL;
+	struct filter_rule *r, **ptr;
+	unsigned int i;
+
+	if ((r = calloc(1, sizeof(*r) + strlen(rule) + 1)) == NULL)
+		fatal("calloc");
+
+	strcpy(r->rule, rule);
+
+	r->users = -1;
+
+	if ((r->args = strdup(rule)) == NULL)
+		fatal("strdup");
+
+	if ((arg = strtok_r(r->args, " ", &state)) == NULL) {
+		err = "missing types";
+		goto error;
+	}
+
+	for (name = strtok_r(arg, ",", &type_state); name; name = strtok_r(NULL, ",", &type_state)) {
+
+		for (i = 0; i < FILTER_TYPES && strcmp(name, filter_names[i].name); i++)
+			;
+
+		if (i == FILTER_TYPES) {
+			err = "unknown type";
+			goto error;
+		}
+
+		r->types |= filter_names[i].type;
+	}
+
+	while ((key = strtok_r(NULL, " ", &state))) {
+
+		/* The regex is the remainder of the rule, spaces included */
+		if (!strcmp(key, "matching")) {
+
+			while (*state == ' ')
+				state++;
+
+			if (*state == '\0') {
+				err = "missing regex";
+				goto error;
+			}
+
+			if ((r->text = malloc(sizeof(*r->text))) == NULL)
+				fatal("malloc");
+
+			if (regcomp(r->text, state, REG_EXTENDED | REG_NOSUB)) {
+				free(r->text);
+				r->text = NULL;
+				err = "invalid regex";
+				goto error;
+			}
+
+			break;
+		}
+
+		if ((arg = strtok_r(NULL, " ", &state)) == NULL) {
+			err = "missing argument";
+			goto error;
+		}
+
+		if (!strcmp(key, "in"))
+			r->chan = arg;
+		else if (!strcmp(key, "from")) {
+			r->from = arg;
+			r->from_suffix_len = glob_suffix(arg);
+			r->from_suffix = arg + strlen(arg) - r->from_suffix_len;
+		}
+		else if (!strcmp(key, "over")) {
+			r->users = strtol(arg, &end, 10);
+			if (*end || !isdigit((unsigned char) *arg)) {
+				err = "invalid user count";
+				goto error;
+			}
+		} else {
+			err = "unknown condition";
+			goto error;
+		}
+	}
+
+	if (*f == NULL && (*f = calloc(1, sizeof(**f))) == NULL)
+		fatal("calloc");
+
+	for (ptr = &(*f)->rules; *ptr; ptr = &(*ptr)->next)
+		;
+
+	*ptr = r;
+
+	filter_compile(*f);
+
+	return NULL;
+
+error:
+	filter_rule_free(r);
+
+	return err;
+}
+
+int
+filter_del(struct filter **f, unsigned int n)
+{
+	/* Delete the nth rule, counting from 1, returns 0 if not found */
+
+	struct filter_rule *r, **ptr;
+
+	if (*f == NULL || n == 0)
+		return 0;
+
+	for (ptr = &(*f)->rules; (r = *ptr); ptr = &r->next) {
+		if (--n == 0) {
+			*ptr = r->next;
+			filter_rule_free(r);
+			filter_compile(*f);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+const char*
+filter_list(const struct filter *f, const void **iter, unsigned long *hits)
+{
+	/* Iterate rules in the order added, starting from *iter NULL. Returns
+	 * NULL following the last */
+
+	const struct filter_rule *r;
+
+	if (f == NULL)
+		return NULL;
+
+	r = (*iter) ? ((const struct filter_rule *) *iter)->next : f->rules;
+
+	if ((*iter = r) == NULL)
+		return NULL;
+
+	*hits = r->hits;
+
+	return r->rule;
+}
+
+unsigned int
+filter_types(const struct filter *f)
+{
+	/* Types of message any rule applies to */
+
+	return f ? f->types : 0;
+}
+
+int
+filter_match(struct filter *f, const unsigned char *casemap, const struct filter_mesg *m)
+{
+	/* Run the program over a message, returns 1 if a rule drops it */
+
+	char prefix[BUFFSIZE], *end = NULL;
+	const struct filter_insn *insn;
+	const struct filter_rule *r;
+	unsigned int pc = 0;
+	int pass = 0;
+
+	if (f == NULL || !(f->types & m->type))
+		return 0;
+
+	while (pc < f->len) {
+
+		insn = &f->prog[pc];
+		r = insn->rule;
+
+		switch (insn->op) {
+			case FILTER_OP_TYPES:
+				pass = (r->types & m->type);
+				break;
+			case FILTER_OP_USERS:
+				pass = (m->chan && m->users > (unsigned long) r->users);
+				break;
+			case FILTER_OP_CHAN:
+				pass = (m->chan && glob_match(casemap, r->chan, m->chan));
+				break;
+			case FILTER_OP_FROM:
+				if (m->nick && end == NULL)
+					end = mask_prefix(prefix, sizeof(prefix), m->nick, m->hostinfo);
+				pass = (end
+					&& suffix_match(casemap, r->from_suffix, r->from_suffix_len, prefix, end)
+					&& glob_match(casemap, r->from, prefix));
+				break;
+			case FILTER_OP_TEXT:
+				pass = (m->text && !regexec(r->text, m->text, 0, NULL, 0));
+				break;
+			case FILTER_OP_DROP:
+				insn->rule->hits++;
+				return 1;
+		}
+
+		pc = pass ? pc + 1 : insn->fail;
 	}
 
 	return 0;
 }
 
+void
+filter_free(struct filter *f)
+{
+	struct filter_rule *t, *r;
+
+	if (f == NULL)
+		return;
+
+	for (r = f->rules; r; r = t) {
+		t = r->next;
+		filter_rule_free(r);
+	}
+
+	free(f->prog);
+	free(f);
+}
+
+static void
+filter_compile(struct filter *f)
+{
+	/* Compile the rules into a program, each rule's tests ordered by cost */
+
+	struct filter_rule *r;
+	unsigned int start, len = 0;
+
+	for (r = f->rules; r; r = r->next)
+		len += 2 + (r->users >= 0) + !!r->chan + !!r->from + !!r->text;
+
+	free(f->prog);
+
+	if ((f->prog = calloc(len + 1, sizeof(*f->prog))) == NULL)
+		fatal("calloc");
+
+	f->len = 0;
+	f->types = 0;
+
+	#define EMIT(OP) \
+		do { f->prog[f->len].op = (OP); f->prog[f->len++].rule = r; } while (0)
+
+	for (r = f->rules; r; r = r->next) {
+
+		start = f->len;
+
+		EMIT(FILTER_OP_TYPES);
+
+		if (r->users >= 0)
+			EMIT(FILTER_OP_USERS);
+
+		if (r->chan)
+			EMIT(FILTER_OP_CHAN);
+
+		if (r->from)
+			EMIT(FILTER_OP_FROM);
+
+		if (r->text)
+			EMIT(FILTER_OP_TEXT);
+
+		EMIT(FILTER_OP_DROP);
+
+		while (start < f->len)
+			f->prog[start++].fail = f->len;
+
+		f->types |= r->types;
+	}
+
+	#undef EMIT
+}
+
+static void
+filter_rule_free(struct filter_rule *r)
+{
+	if (r->text) {
+		regfree(r->text);
+		free(r->text);
+	}
+
+	free(r->args);
+	free(r);
+}
+
 /* AVL tree functions */
 
 void
@@ -210,45 +1336,88 @@ free_avl(avl_node *n)
 }
 
 int
-avl_add(avl_node **n, const char *key, void *val)
+avl_add(avl_node **n, const unsigned char *casemap, const char *key, void *val)
 {
 	/* Entry point for adding a node to an AVL tree */
 
 	if (setjmp(jmpbuf))
 		return 0;
 
+	avl_casemap = casemap;
+
 	*n = _avl_add(*n, key, val);
 
 	return 1;
 }
 
 int
-avl_del(avl_node **n, const char *key)
+avl_del(avl_node **n, const unsigned char *casemap, const char *key)
 {
 	/* Entry point for removing a node from an AVL tree */
 
 	if (setjmp(jmpbuf))
 		return 0;
 
+	avl_casemap = casemap;
+
 	*n = _avl_del(*n, key);
 
 	return 1;
 }
 
-const avl_node*
-avl_get(avl_node *n, const char *key, size_t len)
+avl_node*
+avl_build(const unsigned char *casemap, avl_node **nodes, size_t *len)
+{
+	/* Build a balanced AVL tree of unlinked nodes, in linear time once sorted.
+	 *
+	 * Nodes are sorted in place by key, and duplicates freed, *len is set to
+	 * the number of nodes in the tree */
+
+	avl_node **tmp;
+	size_t i, j;
+
+	if (*len == 0)
+		return NULL;
+
+	if ((tmp = malloc(*len * sizeof(*tmp))) == NULL)
+		fatal("malloc");
+
+	avl_casemap = casemap;
+
+	avl_sort(nodes, tmp, *len);
+
+	free(tmp);
+
+	for (i = 1, j = 1; i < *len; i++) {
+		if (irc_strcmp(casemap, nodes[j - 1]->key, nodes[i]->key))
+			nodes[j++] = nodes[i];
+		else
+			free_avl(nodes[i]);
+	}
+
+	*len = j;
+
+	return _avl_build(nodes, j);
+}
+
+avl_node*
+avl_get(avl_node *n, const unsigned char *casemap, const char *key, size_t len)
 {
 	/* Entry point for fetching an avl node with prefix key */
 
 	if (setjmp(jmpbuf))
 		return NULL;
 
+	avl_casemap = casemap;
+
 	return _avl_get(n, key, len);
 }
 
-static avl_node*
+avl_node*
 avl_new_node(const char *key, void *val)
 {
+	/* Allocate an unlinked node, with a copy of key */
+
 	avl_node *n;
 
 	if ((n = calloc(1, sizeof(*n))) == NULL)
@@ -261,6 +1430,57 @@ avl_new_node(const char *key, void *val)
 	return n;
 }
 
+static avl_node*
+_avl_build(avl_node **nodes, size_t len)
+{
+	/* Build a perfectly balanced tree of sorted nodes, rooted at the median */
+
+	avl_node *n;
+	size_t mid = len / 2;
+
+	if (len == 0)
+		return NULL;
+
+	n = nodes[mid];
+	n->l = _avl_build(nodes, mid);
+	n->r = _avl_build(nodes + mid + 1, len - mid - 1);
+	n->height = MAX(H(n->l), H(n->r)) + 1;
+
+	return n;
+}
+
+static void
+avl_sort(avl_node **nodes, avl_node **tmp, size_t len)
+{
+	/* Bottom up merge sort of nodes by key, case folded by avl_casemap */
+
+	avl_node **src = nodes, **dst = tmp, **swap;
+	size_t i, k, l, r, mid, end, width;
+
+	for (width = 1; width < len; width *= 2) {
+
+		for (i = 0; i < len; i += 2 * width) {
+
+			mid = (i + width < len) ? i + width : len;
+			end = (i + 2 * width < len) ? i + 2 * width : len;
+
+			for (k = i, l = i, r = mid; k < end; k++) {
+				if (l < mid && (r == end || irc_strcmp(avl_casemap, src[l]->key, src[r]->key) <= 0))
+					dst[k] = src[l++];
+				else
+					dst[k] = src[r++];
+			}
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != nodes)
+		memcpy(nodes, src, len * sizeof(*nodes));
+}
+
 static avl_node*
 avl_rotate_R(avl_node *r)
 {
@@ -316,12 +1536,12 @@ _avl_add(avl_node *n, const char *key, void *val)
 {
 	/* Recursively add key to an AVL tree.
 	 *
-	 * If a duplicate is found (case insensitive) longjmp is called to indicate failure */
+	 * If a duplicate is found (case folded) longjmp is called to indicate failure */
 
 	if (n == NULL)
 		return avl_new_node(key, val);
 
-	int ret = strcasecmp(key, n->key);
+	int ret = irc_strcmp(avl_casemap, key, n->key);
 
 	if (ret == 0)
 		/* Duplicate found */
@@ -343,7 +1563,7 @@ _avl_add(avl_node *n, const char *key, void *val)
 	if (balance > 1) {
 
 		/* left-right rotation */
-		if (strcasecmp(key, n->l->key) > 0)
+		if (irc_strcmp(avl_casemap, key, n->l->key) > 0)
 			n->l = avl_rotate_L(n->l);
 
 		return avl_rotate_R(n);
@@ -353,7 +1573,7 @@ _avl_add(avl_node *n, const char *key, void *val)
 	if (balance < -1) {
 
 		/* right-left rotation */
-		if (strcasecmp(n->r->key, key) > 0)
+		if (irc_strcmp(avl_casemap, n->r->key, key) > 0)
 			n->r = avl_rotate_R(n->r);
 
 		return avl_rotate_L(n);
@@ -367,13 +1587,13 @@ _avl_del(avl_node *n, const char *key)
 {
 	/* Recursive function for deleting nodes from an AVL tree
 	 *
-	 * If the node isn't found (case insensitive) longjmp is called to indicate failure */
+	 * If the node isn't found (case folded) longjmp is called to indicate failure */
 
 	if (n == NULL)
 		/* Node not found */
 		longjmp(jmpbuf, 1);
 
-	int ret = strcasecmp(key, n->key);
+	int ret = irc_strcmp(avl_casemap, key, n->key);
 
 	if (ret == 0) {
 		/* Node found */
@@ -387,11 +1607,17 @@ _avl_del(avl_node *n, const char *key)
 			while (next->l)
 				next = next->l;
 
-			/* Swap it's value with the node being deleted */
+			/* Swap it's key, value and prefix with the node being deleted */
 			char *t = n->key;
+			void *v = n->val;
+			unsigned int prefix = n->prefix;
 
 			n->key = next->key;
+			n->val = next->val;
+			n->prefix = next->prefix;
 			next->key = t;
+			next->val = v;
+			next->prefix = prefix;
 
 			/* Recusively delete in the right subtree */
 			n->r = _avl_del(n->r, t);
@@ -400,6 +1626,8 @@ _avl_del(avl_node *n, const char *key)
 			/* If n has a child, return it */
 			avl_node *tmp = (n->l) ? n->l : n->r;
 
+			free(n->key);
+			free(n->val);
 			free(n);
 
 			return tmp;
@@ -444,13 +1672,13 @@ _avl_del(avl_node *n, const char *key)
 static avl_node*
 _avl_get(avl_node *n, const char *key, size_t len)
 {
-	/* Case insensitive search for a node whose value is prefixed by key */
+	/* Case folded search for a node whose value is prefixed by key */
 
 	/* Failed to find node */
 	if (n == NULL)
 		longjmp(jmpbuf, 1);
 
-	int ret = strncasecmp(key, n->key, len);
+	int ret = irc_strncmp(avl_casemap, key, n->key, len);
 
 	if (ret > 0)
 		return _avl_get(n->r, key, len);
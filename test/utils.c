@@ -1,3 +1,6 @@
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
@@ -75,7 +78,13 @@ _avl_height(avl_node *n)
  * */
 
 int test_avl(void);
+int test_casemap(void);
+int test_filter(void);
+int test_highlight(void);
+int test_histogram(void);
+int test_ignore(void);
 int test_parse(void);
+int test_tags(void);
 
 int
 test_avl(void)
@@ -101,7 +110,7 @@ test_avl(void)
 
 	/* Add all strings to the tree */
 	for (ptr = strings; *ptr; ptr++) {
-		if (!avl_add(&root, *ptr, NULL))
+		if (!avl_add(&root, casemap_ascii, *ptr, NULL))
 			fail_testf("avl_add() failed to add %s", *ptr);
 		else
 			count++;
@@ -122,17 +131,17 @@ test_avl(void)
 		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
 
 	/* Test adding a duplicate and case sensitive duplicate */
-	if (avl_add(&root, "aa", NULL) && count++)
+	if (avl_add(&root, casemap_ascii, "aa", NULL) && count++)
 		fail_test("avl_add() failed to detect duplicate 'aa'");
 
-	if (avl_add(&root, "aA", NULL) && count++)
+	if (avl_add(&root, casemap_ascii, "aA", NULL) && count++)
 		fail_test("avl_add() failed to detect case sensitive duplicate 'aA'");
 
 	/* Delete about half of the strings */
 	int num_delete = count / 2;
 
 	for (ptr = strings; *ptr && num_delete > 0; ptr++, num_delete--) {
-		if (!avl_del(&root, *ptr))
+		if (!avl_del(&root, casemap_ascii, *ptr))
 			fail_testf("avl_del() failed to delete %s", *ptr);
 		else
 			count--;
@@ -153,9 +162,449 @@ test_avl(void)
 		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
 
 	/* Test deleting string that was previously deleted */
-	if (avl_del(&root, *strings))
+	if (avl_del(&root, casemap_ascii, *strings))
 		fail_testf("_avl_del() should have failed to delete %s", *strings);
 
+	free_avl(root);
+
+	/* Build a tree from all strings at once, with case folded duplicates */
+	avl_node *nodes[sizeof(strings) / sizeof(*strings) + 2];
+	size_t len = 0;
+
+	for (ptr = strings; *ptr; ptr++, len++)
+		(nodes[len] = avl_new_node(*ptr, NULL))->prefix = len % 4;
+
+	nodes[len++] = avl_new_node("Zz", NULL);
+	nodes[len++] = avl_new_node("A", NULL);
+
+	root = avl_build(casemap_rfc1459, nodes, &len);
+
+	if (len != (size_t) (ptr - strings) || (ret = _avl_count(root)) != (int) len)
+		fail_testf("avl_build() built %d nodes, expected %d", _avl_count(root), (int) (ptr - strings));
+
+	if (!_avl_is_binary(root))
+		fail_test("avl_build() tree failed _avl_is_binary()");
+
+	/* Perfectly balanced, of minimal height */
+	if ((ret = _avl_height(root)) != (int) ceil(log2(len + 1)) || ret != root->height)
+		fail_testf("avl_build() tree of height %d, expected %d", ret, (int) ceil(log2(len + 1)));
+
+	/* The first of duplicates is kept, and prefixes kept with their keys */
+	for (ptr = strings; *ptr; ptr++)
+		if ((ret = avl_get(root, casemap_rfc1459, *ptr, strlen(*ptr) + 1)->prefix) != (ptr - strings) % 4)
+			fail_testf("avl_build() node %s has prefix %d, expected %d", *ptr, ret, (int) (ptr - strings) % 4);
+
+	/* Deleting nodes with two children moves their successors, with their prefixes */
+	for (ptr = strings; *ptr; ptr++)
+		if ((ptr - strings) % 2 && !avl_del(&root, casemap_rfc1459, *ptr))
+			fail_testf("avl_del() failed for %s, in a built tree", *ptr);
+
+	for (ptr = strings; *ptr; ptr += 2)
+		if ((ret = avl_get(root, casemap_rfc1459, *ptr, strlen(*ptr) + 1)->prefix) != (ptr - strings) % 4)
+			fail_testf("avl_del() moved node %s has prefix %d, expected %d", *ptr, ret, (int) (ptr - strings) % 4);
+
+	for (ptr = strings; *ptr; ptr++)
+		if ((ptr - strings) % 2 && !avl_add(&root, casemap_rfc1459, *ptr, NULL))
+			fail_testf("avl_add() failed for %s, in a built tree", *ptr);
+
+	/* Nodes heights are kept, for rebalancing on later additions */
+	for (ptr = strings; *ptr; ptr++)
+		if (!avl_del(&root, casemap_rfc1459, *ptr) || !avl_add(&root, casemap_rfc1459, *ptr, NULL))
+			fail_testf("avl_del() and avl_add() failed for %s, in a built tree", *ptr);
+
+	max_height = 1.44 * log2(len + 2) - 0.328;
+
+	if ((ret = _avl_height(root)) >= max_height || !_avl_is_binary(root))
+		fail_testf("_avl_height() returned %d following rebalances, expected strictly less than %f", ret, max_height);
+
+	free_avl(root);
+
+	return failures;
+}
+
+int
+test_casemap(void)
+{
+	/* Test case folded comparisons for each casemapping */
+
+	int failures = 0;
+
+	avl_node *root = NULL;
+
+	if (irc_strcmp(casemap_ascii, "Nick[a]", "nick[A]"))
+		fail_test("ascii: 'Nick[a]' != 'nick[A]'");
+
+	if (!irc_strcmp(casemap_ascii, "nick[]", "nick{}"))
+		fail_test("ascii: 'nick[]' == 'nick{}'");
+
+	if (irc_strcmp(casemap_rfc1459, "Nick[]\\^", "nick{}|~"))
+		fail_test("rfc1459: 'Nick[]\\^' != 'nick{}|~'");
+
+	if (irc_strcmp(casemap_strict_rfc1459, "Nick[]\\", "nick{}|"))
+		fail_test("strict-rfc1459: 'Nick[]\\' != 'nick{}|'");
+
+	if (!irc_strcmp(casemap_strict_rfc1459, "nick^", "nick~"))
+		fail_test("strict-rfc1459: 'nick^' == 'nick~'");
+
+	if (irc_strcmp(casemap_ascii, "nick", "nicks") >= 0 || irc_strcmp(casemap_ascii, "nicks", "nick") <= 0)
+		fail_test("ascii: 'nick' not ordered before 'nicks'");
+
+	/* Characters above 0x7f are compared unsigned, and not folded */
+	if (irc_strcmp(casemap_ascii, "a\xe9", "a") <= 0 || !irc_strcmp(casemap_ascii, "\xc9", "\xe9"))
+		fail_test("ascii: non-ascii characters folded or signed");
+
+	if (irc_strncmp(casemap_rfc1459, "[Nick]", "{nick}s", 6))
+		fail_test("rfc1459: '[Nick]' != '{nick}s' for 6 characters");
+
+	if (!irc_strncmp(casemap_rfc1459, "[Nick]", "{nick}s", 7))
+		fail_test("rfc1459: '[Nick]' == '{nick}s' for 7 characters");
+
+	/* Test AVL trees are keyed by the casemapping */
+	if (!avl_add(&root, casemap_rfc1459, "nick[away]", NULL))
+		fail_test("avl_add() failed to add 'nick[away]'");
+
+	if (avl_add(&root, casemap_rfc1459, "NICK{AWAY}", NULL))
+		fail_test("avl_add() failed to detect rfc1459 duplicate 'NICK{AWAY}'");
+
+	if (!avl_get(root, casemap_rfc1459, "Nick{", 5))
+		fail_test("avl_get() failed to find prefix 'Nick{'");
+
+	if (!avl_del(&root, casemap_rfc1459, "nick{away}"))
+		fail_test("avl_del() failed to delete 'nick{away}'");
+
+	if (root != NULL)
+		fail_test("avl_del() failed to empty the tree");
+
+	free_avl(root);
+
+	if (failures)
+		printf("\t%d failure%c\n", failures, (failures > 1) ? 's' : 0);
+
+	return failures;
+}
+
+int
+test_filter(void)
+{
+	/* Test compiling filter rules and matching messages against them */
+
+	int failures = 0;
+
+	struct filter *f = NULL;
+	const char *list;
+	const void *iter = NULL;
+	unsigned long hits;
+
+	struct filter_mesg join = {
+		.type = FILTER_JOIN,
+		.chan = "#large",
+		.users = 501,
+		.nick = "nick",
+		.hostinfo = "user@host"
+	};
+
+	struct filter_mesg priv = {
+		.type = FILTER_PRIVMSG,
+		.chan = "#Chan",
+		.users = 10,
+		.nick = "Bot1",
+		.hostinfo = "bot@bots.tld",
+		.text = "!quote 42"
+	};
+
+	if (filter_match(f, casemap_rfc1459, &join))
+		fail_test("matched with no rules");
+
+	if (!filter_add(&f, ""))
+		fail_test("filter_add() accepted an empty rule");
+
+	if (!filter_add(&f, "join,kick over 500"))
+		fail_test("filter_add() accepted an unknown type");
+
+	if (!filter_add(&f, "join over many"))
+		fail_test("filter_add() accepted an invalid user count");
+
+	if (!filter_add(&f, "join in"))
+		fail_test("filter_add() accepted a missing argument");
+
+	if (!filter_add(&f, "privmsg matching ("))
+		fail_test("filter_add() accepted an invalid regex");
+
+	if (filter_add(&f, "join,part,quit over 500"))
+		fail_test("filter_add() failed to add 'join,part,quit over 500'");
+
+	if (filter_add(&f, "privmsg in #chan from bot?!*@* matching ^!(quote|roll) "))
+		fail_test("filter_add() failed to add a regex rule");
+
+	if (filter_types(f) != (FILTER_JOIN | FILTER_PART | FILTER_QUIT | FILTER_PRIVMSG))
+		fail_test("filter_types() mismatch");
+
+	if (!filter_match(f, casemap_rfc1459, &join))
+		fail_test("JOIN in a channel over 500 users not dropped");
+
+	join.users = 500;
+
+	if (filter_match(f, casemap_rfc1459, &join))
+		fail_test("JOIN in a channel of 500 users dropped");
+
+	join.chan = NULL;
+	join.users = 0;
+
+	if (filter_match(f, casemap_rfc1459, &join))
+		fail_test("JOIN without a channel dropped");
+
+	if (!filter_match(f, casemap_rfc1459, &priv))
+		fail_test("PRIVMSG matching all conditions not dropped");
+
+	priv.text = "!quote42";
+
+	if (filter_match(f, casemap_rfc1459, &priv))
+		fail_test("PRIVMSG not matching the regex dropped");
+
+	priv.text = "!roll d20";
+	priv.nick = "bot12";
+
+	if (filter_match(f, casemap_rfc1459, &priv))
+		fail_test("PRIVMSG not matching the sender's mask dropped");
+
+	priv.nick = "bot2";
+	priv.chan = "#other";
+
+	if (filter_match(f, casemap_rfc1459, &priv))
+		fail_test("PRIVMSG in another channel dropped");
+
+	priv.chan = "#chan";
+	priv.type = FILTER_NOTICE;
+
+	if (filter_match(f, casemap_rfc1459, &priv))
+		fail_test("NOTICE dropped by a PRIVMSG rule");
+
+	if ((list = filter_list(f, &iter, &hits)) == NULL || strcmp(list, "join,part,quit over 500") || hits != 1)
+		fail_test("filter_list() mismatch for the first rule");
+
+	if ((list = filter_list(f, &iter, &hits)) == NULL || hits != 1)
+		fail_test("filter_list() mismatch for the second rule");
+
+	if (filter_list(f, &iter, &hits))
+		fail_test("filter_list() listed more than two rules");
+
+	if (filter_del(&f, 3))
+		fail_test("filter_del() deleted a third rule");
+
+	if (!filter_del(&f, 1))
+		fail_test("filter_del() failed to delete the first rule");
+
+	join.chan = "#large";
+	join.users = 1000;
+
+	if (filter_match(f, casemap_rfc1459, &join))
+		fail_test("JOIN dropped after its rule was deleted");
+
+	priv.type = FILTER_PRIVMSG;
+
+	if (!filter_match(f, casemap_rfc1459, &priv))
+		fail_test("PRIVMSG not dropped after recompiling");
+
+	filter_free(f);
+
+	if (failures)
+		printf("\t%d failure%c\n", failures, (failures > 1) ? 's' : 0);
+
+	return failures;
+}
+
+int
+test_highlight(void)
+{
+	/* Test matching words compiled into a highlight automaton */
+
+	int failures = 0;
+
+	struct highlight *h = highlight_compile(casemap_rfc1459, "nick[a], nick_ alt,,rirc he hers");
+
+	if (!highlight_match(h, "nick[a]"))
+		fail_test("'nick[a]' not matched");
+
+	if (!highlight_match(h, "hello NICK{A}: hi"))
+		fail_test("'NICK{A}' not matched, case folded");
+
+	if (!highlight_match(h, "@nick_, hi"))
+		fail_test("'nick_' not matched following a symbol");
+
+	if (!highlight_match(h, "what's rirc?"))
+		fail_test("keyword 'rirc' not matched");
+
+	if (highlight_match(h, "nick[a]s and rircs and alternate"))
+		fail_test("words matched followed by alphanumeric characters");
+
+	if (highlight_match(h, "xnick_ and abcrirc"))
+		fail_test("words matched preceded by alphanumeric characters");
+
+	if (highlight_match(h, "nick[ nick_a ni"))
+		fail_test("partial words matched");
+
+	/* 'he' ends within 'hers', and only matches as a word of its own */
+	if (highlight_match(h, "ushers shed"))
+		fail_test("'he' or 'hers' matched within words");
+
+	if (!highlight_match(h, "it's hers"))
+		fail_test("'hers' not matched");
+
+	if (!highlight_match(h, "ushe he"))
+		fail_test("'he' not matched following a failed match");
+
+	/* Failure links from the end of one word lead into another */
+	if (!highlight_match(h, "nick[nick_"))
+		fail_test("'nick_' not matched across failure links");
+
+	if (highlight_match(h, ""))
+		fail_test("empty message matched");
+
+	highlight_free(h);
+
+	/* Without words nothing matches */
+	h = highlight_compile(casemap_ascii, ", ,");
+
+	if (highlight_match(h, "nick"))
+		fail_test("matched with no words");
+
+	highlight_free(h);
+
+	if (failures)
+		printf("\t%d failure%c\n", failures, (failures > 1) ? 's' : 0);
+
+	return failures;
+}
+
+int
+test_histogram(void)
+{
+	/* Test histogram bucketing and percentiles */
+
+	int failures = 0;
+
+	unsigned long i, ret;
+
+	histogram h = {0};
+
+	/* Empty histogram */
+	if ((ret = histogram_percentile(&h, 0.5)) != 0)
+		fail_testf("histogram_percentile() returned %lu, expected 0", ret);
+
+	/* Small values are counted exactly */
+	for (i = 0; i < 10; i++)
+		histogram_add(&h, i);
+
+	if ((ret = histogram_percentile(&h, 0.5)) != 5)
+		fail_testf("histogram_percentile() returned %lu, expected 5", ret);
+
+	if ((ret = histogram_percentile(&h, 1.0)) != 9)
+		fail_testf("histogram_percentile() returned %lu, expected 9", ret);
+
+	/* Large values are within the relative error of their bucket */
+	h = (histogram){0};
+
+	for (i = 1; i <= 1000; i++)
+		histogram_add(&h, i * 1000);
+
+	if (h.count != 1000 || h.max != 1000000)
+		fail_testf("histogram count %lu, max %lu, expected 1000, 1000000", h.count, h.max);
+
+	ret = histogram_percentile(&h, 0.5);
+
+	if (ret > 500000 || ret < 500000 - (500000 >> HISTOGRAM_SUB_BITS))
+		fail_testf("histogram_percentile() returned %lu, expected ~500000", ret);
+
+	ret = histogram_percentile(&h, 0.99);
+
+	if (ret > 990000 || ret < 990000 - (990000 >> HISTOGRAM_SUB_BITS))
+		fail_testf("histogram_percentile() returned %lu, expected ~990000", ret);
+
+	/* Values exceeding the largest bucket */
+	histogram_add(&h, (unsigned long) -1);
+
+	if ((ret = histogram_percentile(&h, 1.0)) == 0)
+		fail_test("histogram_percentile() returned 0 for max value");
+
+	if (failures)
+		printf("\t%d failure%c\n", failures, (failures > 1) ? 's' : 0);
+
+	return failures;
+}
+
+int
+test_ignore(void)
+{
+	/* Test matching message prefixes against ignore masks */
+
+	int failures = 0;
+
+	struct ignore *i = NULL;
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_ALL, "nick", "user@host"))
+		fail_test("matched with no masks");
+
+	ignore_add(&i, casemap_rfc1459, "nick[a]!*@*", IGNORE_ALL);
+	ignore_add(&i, casemap_rfc1459, "*!*@*.spam.tld", IGNORE_PRIVMSG | IGNORE_NOTICE);
+	ignore_add(&i, casemap_rfc1459, "bot?!b*t@*", IGNORE_JOIN);
+	ignore_add(&i, casemap_rfc1459, "nick!*@*", IGNORE_ALL);
+
+	if (ignore_add(&i, casemap_rfc1459, "NICK{A}!*@*", IGNORE_ALL))
+		fail_test("ignore_add() failed to detect rfc1459 duplicate 'NICK{A}!*@*'");
+
+	if (!ignore_match(i, casemap_rfc1459, IGNORE_PRIVMSG, "NICK{a}", "user@host"))
+		fail_test("'NICK{a}' not matched, case folded");
+
+	if (!ignore_match(i, casemap_rfc1459, IGNORE_CTCP, "nick", NULL))
+		fail_test("'nick' not matched without hostinfo");
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_PRIVMSG, "nick_", "user@host"))
+		fail_test("'nick_' matched by 'nick!*@*'");
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_PRIVMSG, "nic", "user@host"))
+		fail_test("'nic' matched by a mask's literal prefix");
+
+	if (!ignore_match(i, casemap_rfc1459, IGNORE_NOTICE, "anyone", "user@a.b.SPAM.tld"))
+		fail_test("'*!*@*.spam.tld' not matched");
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_JOIN, "anyone", "user@a.b.spam.tld"))
+		fail_test("'*!*@*.spam.tld' matched for a type it doesn't ignore");
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_NOTICE, "anyone", "user@spam.tld"))
+		fail_test("'*!*@*.spam.tld' matched 'spam.tld'");
+
+	if (!ignore_match(i, casemap_rfc1459, IGNORE_JOIN, "bot1", "bot.bot.bt@host"))
+		fail_test("'bot?!b*t@*' not matched, backtracking over '*'");
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_JOIN, "bot12", "bt@host"))
+		fail_test("'bot?!b*t@*' matched 'bot12'");
+
+	if (!ignore_del(&i, casemap_rfc1459, "NICK!*@*"))
+		fail_test("ignore_del() failed to delete 'NICK!*@*'");
+
+	if (ignore_del(&i, casemap_rfc1459, "nick!*@*"))
+		fail_test("ignore_del() deleted 'nick!*@*' twice");
+
+	if (ignore_match(i, casemap_rfc1459, IGNORE_PRIVMSG, "nick", "user@host"))
+		fail_test("'nick' matched after being deleted");
+
+	/* Recompiled for a different casemapping */
+	ignore_add(&i, casemap_rfc1459, "nick^!*@*", IGNORE_ALL);
+
+	if (!ignore_match(i, casemap_rfc1459, IGNORE_PRIVMSG, "NICK~", "user@host"))
+		fail_test("rfc1459: 'NICK~' not matched by 'nick^!*@*'");
+
+	if (ignore_match(i, casemap_strict_rfc1459, IGNORE_PRIVMSG, "NICK~", "user@host"))
+		fail_test("strict-rfc1459: 'NICK~' matched by 'nick^!*@*'");
+
+	if (!ignore_match(i, casemap_strict_rfc1459, IGNORE_PRIVMSG, "NICK{A}", "user@host"))
+		fail_test("strict-rfc1459: 'NICK{A}' not matched by 'nick[a]!*@*'");
+
+	ignore_free(i);
+
+	if (failures)
+		printf("\t%d failure%c\n", failures, (failures > 1) ? 's' : 0);
+
 	return failures;
 }
 
@@ -268,6 +717,86 @@ test_parse(void)
 	return failures;
 }
 
+int
+test_tags(void)
+{
+	/* Test IRCv3 message tag parsing */
+
+	char buf[64], *val = buf;
+	int failures = 0;
+	const char *tags;
+
+	mesg_tag t;
+	parsed_mesg p;
+
+	/* Test tags are split from the prefix */
+	char mesg1[] = "@aaa=bbb;ccc;example.com/ddd=e\\s\\:f :nick!user@host CMD arg :trailing";
+
+	parse(&p, mesg1);
+	assert_strcmp(p.tags,     "aaa=bbb;ccc;example.com/ddd=e\\s\\:f");
+	assert_strcmp(p.from,     "nick");
+	assert_strcmp(p.hostinfo, "user@host");
+	assert_strcmp(p.command,  "CMD");
+	assert_strcmp(p.params,   "arg ");
+	assert_strcmp(p.trailing, "trailing");
+
+	/* Test iterating tags, with and without values */
+	tags = p.tags;
+
+	if (!tag_next(&tags, &t) || t.key_len != 3 || t.val_len != 3 || memcmp(t.val, "bbb", 3))
+		fail_test("tag_next() failed on 'aaa=bbb'");
+
+	if (!tag_next(&tags, &t) || t.key_len != 3 || t.val_len != 0)
+		fail_test("tag_next() failed on 'ccc'");
+
+	if (!tag_next(&tags, &t) || t.key_len != 15)
+		fail_test("tag_next() failed on 'example.com/ddd'");
+
+	if (tag_next(&tags, &t))
+		fail_test("tag_next() returned a tag past the end");
+
+	/* Test finding and unescaping */
+	if (tag_get(p.tags, "cc", &t))
+		fail_test("tag_get() matched a key prefix");
+
+	if (!tag_get(p.tags, "example.com/ddd", &t))
+		fail_test("tag_get() failed to find 'example.com/ddd'");
+
+	tag_unescape(buf, sizeof(buf), &t);
+	assert_strcmp(val, "e ;f");
+
+	tag_unescape(buf, 3, &t);
+	assert_strcmp(val, "e ");
+
+	/* Test untagged messages */
+	char mesg2[] = ":nick!user@host CMD arg";
+
+	parse(&p, mesg2);
+	assert_strcmp(p.tags, NULL);
+
+	if (tag_get(p.tags, "time", &t))
+		fail_test("tag_get() found a tag in an untagged message");
+
+	/* Test server-time */
+	char mesg3[] = "@time=2011-10-19T16:40:51.620Z;x=1;y=2000-01-01T00:00:00 CMD";
+
+	parse(&p, mesg3);
+
+	if (!tag_get(p.tags, "time", &t) || tag_time(&t) != 1319042451)
+		fail_test("tag_time() failed on '2011-10-19T16:40:51.620Z'");
+
+	if (!tag_get(p.tags, "x", &t) || tag_time(&t) != 0)
+		fail_test("tag_time() accepted 'x=1'");
+
+	if (!tag_get(p.tags, "y", &t) || tag_time(&t) != 0)
+		fail_test("tag_time() accepted a time without 'Z'");
+
+	if (failures)
+		printf("\t%d failure%c\n", failures, (failures > 1) ? 's' : 0);
+
+	return failures;
+}
+
 
 int
 main(void)
@@ -277,7 +806,13 @@ main(void)
 	int failures = 0;
 
 	failures += test_avl();
+	failures += test_casemap();
+	failures += test_filter();
+	failures += test_highlight();
+	failures += test_histogram();
+	failures += test_ignore();
 	failures += test_parse();
+	failures += test_tags();
 
 	if (failures) {
 		printf("%d failure%c total\n\n", failures, (failures > 1) ? 's' : 0);